@@ -0,0 +1,149 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef BIT_FRAME_H
+#define BIT_FRAME_H
+
+#include <vector>
+#include <boost/cstdint.hpp>
+
+using namespace std;
+
+/* A binary image packed 64 pixels to a word
+   (pixel p is bit p%64 of word p/64, with pixels in the same order as the
+   observation vectors, so row r, column c of a w-wide image is pixel r*w + c)
+   It keeps a Zobrist hash (the xor of a random key for each pixel that is on),
+   updated as pixels are set, so frames that change a few pixels at a time
+   can be fingerprinted without rehashing the whole image. */
+class BitFrame
+{
+  private:
+   int numPixels;
+   vector<boost::uint64_t> words;
+   boost::uint64_t hash;
+
+   //The Zobrist key of pixel p
+   static boost::uint64_t zobristKey(int p);
+
+  public:
+   BitFrame(int numPixels = 0);
+   BitFrame(const vector<int>& obs);
+
+   //Packs a vector of 0/1 pixels (any non-zero value counts as 1)
+   void pack(const vector<int>& obs);
+   void unpack(vector<int>& obs) const;
+
+   bool get(int p) const;
+   void set(int p, bool value);
+   void flip(int p);
+
+   int size() const;
+   int numWords() const;
+   boost::uint64_t word(int w) const;
+
+   //A 64 bit hash of the frame (equal frames have equal fingerprints)
+   //Constant time: the hash is maintained as pixels change
+   boost::uint64_t fingerprint() const;
+
+   bool operator==(const BitFrame& other) const;
+   bool operator!=(const BitFrame& other) const;
+};
+
+inline BitFrame::BitFrame(int numPixels) :
+   numPixels(numPixels),
+   words((numPixels + 63)/64, 0),
+   hash(0)
+{
+}
+
+inline BitFrame::BitFrame(const vector<int>& obs) :
+   numPixels(0),
+   hash(0)
+{
+   pack(obs);
+}
+
+inline boost::uint64_t BitFrame::zobristKey(int p)
+{
+   //splitmix64 finalizer of the position
+   boost::uint64_t z = (boost::uint64_t(p) + 1)*0x9E3779B97F4A7C15ULL;
+   z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+inline void BitFrame::pack(const vector<int>& obs)
+{
+   numPixels = obs.size();
+   words.assign((numPixels + 63)/64, 0);
+   hash = 0;
+   for(int p = 0; p < numPixels; p++)
+   {
+      if(obs[p])
+      {
+	 words[p >> 6] |= boost::uint64_t(1) << (p & 63);
+	 hash ^= zobristKey(p);
+      }
+   }
+}
+
+inline void BitFrame::unpack(vector<int>& obs) const
+{
+   obs.resize(numPixels);
+   for(int p = 0; p < numPixels; p++)
+   {
+      obs[p] = get(p);
+   }
+}
+
+inline bool BitFrame::get(int p) const
+{
+   return (words[p >> 6] >> (p & 63)) & 1;
+}
+
+inline void BitFrame::set(int p, bool value)
+{
+   if(get(p) != value)
+   {
+      flip(p);
+   }
+}
+
+inline void BitFrame::flip(int p)
+{
+   words[p >> 6] ^= boost::uint64_t(1) << (p & 63);
+   hash ^= zobristKey(p);
+}
+
+inline int BitFrame::size() const
+{
+   return numPixels;
+}
+
+inline int BitFrame::numWords() const
+{
+   return words.size();
+}
+
+inline boost::uint64_t BitFrame::word(int w) const
+{
+   return words[w];
+}
+
+inline boost::uint64_t BitFrame::fingerprint() const
+{
+   return hash;
+}
+
+inline bool BitFrame::operator==(const BitFrame& other) const
+{
+   return numPixels == other.numPixels && words == other.words;
+}
+
+inline bool BitFrame::operator!=(const BitFrame& other) const
+{
+   return !(*this == other);
+}
+
+#endif
@@ -0,0 +1,29 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef CTS_MATH_H
+#define CTS_MATH_H
+
+/* Math policies for SwitchingTreeT: which of the fast approximations to
+   log, exp and the Jacobian logarithm (log(1 + exp(x))) the tree's updates
+   and predictions use. Saved trees record the choices. Running ctsBenchmark
+   shows what each policy costs in time and compression. */
+
+/* The default: every approximation (see the tables in cts.cpp) */
+struct FastMath
+{
+   static const bool UseFastLog = true;
+   static const bool UseFastExp = true;
+   static const bool UseFastJacobianLog = true;
+};
+
+/* The standard library functions, for maximum compression */
+struct ExactMath
+{
+   static const bool UseFastLog = false;
+   static const bool UseFastExp = false;
+   static const bool UseFastJacobianLog = false;
+};
+
+#endif
@@ -0,0 +1,142 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef CTS_PRECISION_H
+#define CTS_PRECISION_H
+
+#include "common.hpp"
+#include <cstring>
+
+using namespace std;
+
+/* Precision policies for the statistics in the nodes of a SwitchingTreeT.
+   A policy gives the types the statistics are read as (weight_t, count_t),
+   an id recorded in saved trees, and Stats, which stores the log weights and
+   symbol counts of one node. The setters take the values in the order
+   SNodeT::update computes them (the estimate, then the weighted probability,
+   then the switching weights). */
+
+/* Stores every statistic in its own field */
+template<class Weight, class Count> struct PlainStats
+{
+   Weight log_prob_est;
+   Weight log_prob_weighted;
+   Weight log_b;
+   Weight log_s;
+   Count counts[2];
+
+   Weight logEst() const { return log_prob_est; }
+   Weight logWeighted() const { return log_prob_weighted; }
+   Weight logB() const { return log_b; }
+   Weight logS() const { return log_s; }
+   Count count(bit_t b) const { return counts[b]; }
+
+   void setLogEst(double x) { log_prob_est = x; }
+   void setLogWeighted(double x) { log_prob_weighted = x; }
+   void setLogB(double x) { log_b = x; }
+   void setLogS(double x) { log_s = x; }
+   void setCount(bit_t b, Count c) { counts[b] = c; }
+   void increment(bit_t b) { counts[b]++; }
+   void discount(Count d)
+   {
+      counts[0] *= d;
+      counts[1] *= d;
+   }
+};
+
+/* The default: what the trees have always used */
+struct FloatPrecision
+{
+   typedef float weight_t;
+   typedef float count_t;
+   typedef PlainStats<weight_t, count_t> Stats;
+   static const boost::uint8_t id = 0;
+};
+
+/* For reference runs (measuring what the smaller policies lose) */
+struct DoublePrecision
+{
+   typedef double weight_t;
+   typedef double count_t;
+   typedef PlainStats<weight_t, count_t> Stats;
+   static const boost::uint8_t id = 1;
+};
+
+/*Rounds to the nearest bfloat16 (the top half of a float)*/
+inline boost::uint16_t toBFloat16(double x)
+{
+   float f = x;
+   boost::uint32_t bits;
+   memcpy(&bits, &f, sizeof(bits));
+   bits += 0x7FFF + ((bits >> 16) & 1);
+   return bits >> 16;
+}
+
+inline float fromBFloat16(boost::uint16_t h)
+{
+   boost::uint32_t bits = boost::uint32_t(h) << 16;
+   float f;
+   memcpy(&f, &bits, sizeof(f));
+   return f;
+}
+
+/* Two thirds of the statistics memory of FloatPrecision (16 bytes instead of 24).
+   The switching weights are kept as bfloat16 offsets from the weighted
+   probability (they sum to it, so the offsets are small and only need
+   relative precision), and the counts are 16 bit integers that are both
+   halved when one would overflow. The estimate and weighted probability
+   grow with the whole sequence, so they stay floats. Discounted counts
+   are rounded to integers. With its child handles and reference count, a
+   node is 28 bytes (36 with FloatPrecision). */
+struct CompactPrecision
+{
+   typedef float weight_t;
+   typedef float count_t;
+   static const boost::uint8_t id = 2;
+
+   struct Stats
+   {
+      float log_prob_est;
+      float log_prob_weighted;
+      boost::uint16_t b_offset;
+      boost::uint16_t s_offset;
+      boost::uint16_t counts[2];
+
+      weight_t logEst() const { return log_prob_est; }
+      weight_t logWeighted() const { return log_prob_weighted; }
+      double logB() const { return log_prob_weighted + double(fromBFloat16(b_offset)); }
+      double logS() const { return log_prob_weighted + double(fromBFloat16(s_offset)); }
+      count_t count(bit_t b) const { return counts[b]; }
+
+      void setLogEst(double x) { log_prob_est = x; }
+      void setLogWeighted(double x)
+      {
+	 //Keep the switching weights where they were
+	 double b = logB();
+	 double s = logS();
+	 log_prob_weighted = x;
+	 setLogB(b);
+	 setLogS(s);
+      }
+      void setLogB(double x) { b_offset = toBFloat16(x - log_prob_weighted); }
+      void setLogS(double x) { s_offset = toBFloat16(x - log_prob_weighted); }
+      void setCount(bit_t b, count_t c) { counts[b] = c < 65535 ? boost::uint16_t(c + 0.5f) : 65535; }
+      void increment(bit_t b)
+      {
+	 if(counts[b] == 65535)
+	 {
+	    counts[0] = (counts[0] + 1)/2;
+	    counts[1] = (counts[1] + 1)/2;
+	 }
+	 counts[b]++;
+      }
+      void discount(count_t d)
+      {
+	 setCount(0, counts[0]*d);
+	 setCount(1, counts[1]*d);
+      }
+   };
+};
+
+#endif
@@ -0,0 +1,94 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <boost/cstdint.hpp>
+
+using namespace std;
+
+/* Helpers for the binary checkpoints written by the models' save methods.
+   Each saved object starts with a four character tag and a format version,
+   followed by the settings that have to match for a load to make sense.
+   Values are written in the machine's own byte order and type sizes
+   (checkpoints are for resuming runs, not for moving between machines). */
+
+const boost::uint32_t CHECKPOINT_VERSION = 4;
+
+template<class T> inline void writeBinary(ostream& out, const T& val)
+{
+   out.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template<class T> inline void writeBinary(ostream& out, const T* vals, size_t n)
+{
+   out.write(reinterpret_cast<const char*>(vals), n*sizeof(T));
+}
+
+template<class T> inline bool readBinary(istream& in, T& val)
+{
+   return in.read(reinterpret_cast<char*>(&val), sizeof(T));
+}
+
+template<class T> inline bool readBinary(istream& in, T* vals, size_t n)
+{
+   return in.read(reinterpret_cast<char*>(vals), n*sizeof(T));
+}
+
+//Strings are written with their length first
+inline void writeString(ostream& out, const string& str)
+{
+   writeBinary(out, boost::uint64_t(str.size()));
+   writeBinary(out, str.data(), str.size());
+}
+
+inline bool readString(istream& in, string& str)
+{
+   boost::uint64_t length;
+   if(!readBinary(in, length))
+   {
+      return false;
+   }
+   str.assign(length, ' ');
+   return length == 0 || readBinary(in, &str[0], length);
+}
+
+//Reads a setting, checking that it has the expected value
+template<class T> inline bool readMatching(istream& in, const T& expected)
+{
+   T val;
+   return readBinary(in, val) && val == expected;
+}
+
+//Rounds a length up to a multiple of 8 bytes
+inline size_t alignedLength(size_t length)
+{
+   return (length + 7)/8*8;
+}
+
+//Writes the zeros that bring a block of the given length up to a multiple of 8 bytes
+inline void writeAlignment(ostream& out, size_t length)
+{
+   const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+   out.write(zeros, alignedLength(length) - length);
+}
+
+inline void writeCheckpointHeader(ostream& out, const char* tag)
+{
+   writeBinary(out, tag, 4);
+   writeBinary(out, CHECKPOINT_VERSION);
+}
+
+//Checks for the tag and a version this code can read
+inline bool readCheckpointHeader(istream& in, const char* tag)
+{
+   char savedTag[4];
+   return readBinary(in, savedTag, 4) && memcmp(savedTag, tag, 4) == 0 && readMatching(in, CHECKPOINT_VERSION);
+}
+
+#endif
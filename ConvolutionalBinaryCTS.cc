@@ -3,17 +3,26 @@ Author: Erik Talvitie
 ********************/
 
 #include "ConvolutionalBinaryCTS.h"
+#include "Checkpoint.h"
+#include <cassert>
 #include <fstream>
+#include <sstream>
 #include <functional>
 
-ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, int seed) :
+ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, int seed, bool pruneUniquePaths, int numColors) :
    SamplingModel<int>(numActions, width*height),
    width(width),
    height(height),
    neighborhoodWidth(neighborhoodWidth),
    neighborhoodHeight(neighborhoodHeight),
-   numColors(2),
+   numColors(numColors),
    order(order),
+   pinnedDepth(0),
+   nodeBudget(0),
+   pruneUniquePaths(pruneUniquePaths),
+   rewardHead(true),
+   endHead(true),
+   deferHeadTraining(false),
    rng(seed),
    internal_uniform(rng),
    uniform(internal_uniform),
@@ -22,26 +31,38 @@ ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(int width, int height, int neighb
    obsHistory(1),
    rHistory(1),
    endHistory(1),
-   offsetToEncodedPos(neighborhoodWidth, vector<int>(neighborhoodHeight))
+   offsetToEncodedPos(neighborhoodWidth, vector<int>(neighborhoodHeight)),
+   pixelContexts(width*height),
+   savedPixelContexts(width*height)
 {
    init(neighborhoodWidth, neighborhoodHeight, numActions, numColors);
 
    int contextSize = order*(bitsPerPixel*neighborhoodWidth*neighborhoodHeight + bitsPerAction);
-   ct = new SwitchingTree(contextSize);
+   ct = new SwitchingTree(contextSize, -1, pruneUniquePaths);
+   for(int k = 1; k < bitsPerColor; k++)
+   {
+      colorCts.push_back(new SwitchingTree(contextSize + k, -1, pruneUniquePaths));
+   }
 
    int globalContextSize = order*((bitsPerPixel - 1)*width*height + bitsPerAction);
-   rct = new SwitchingTree(globalContextSize);
-   ect = new SwitchingTree(globalContextSize);
+   rct = new SwitchingTree(globalContextSize, -1, pruneUniquePaths);
+   ect = new SwitchingTree(globalContextSize, -1, pruneUniquePaths);
 }
 
-ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, randgen_t& uniform) :
+ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, randgen_t& uniform, bool pruneUniquePaths, int numColors) :
    SamplingModel<int>(numActions, width*height),
    width(width),
    height(height),
    neighborhoodWidth(neighborhoodWidth),
    neighborhoodHeight(neighborhoodHeight),
-   numColors(2),
+   numColors(numColors),
    order(order),
+   pinnedDepth(0),
+   nodeBudget(0),
+   pruneUniquePaths(pruneUniquePaths),
+   rewardHead(true),
+   endHead(true),
+   deferHeadTraining(false),
    internal_uniform(rng),
    uniform(uniform),
    savedHistoryLength(0),
@@ -49,16 +70,63 @@ ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(int width, int height, int neighb
    obsHistory(1),
    rHistory(1),
    endHistory(1),
-   offsetToEncodedPos(neighborhoodWidth, vector<int>(neighborhoodHeight))
+   offsetToEncodedPos(neighborhoodWidth, vector<int>(neighborhoodHeight)),
+   pixelContexts(width*height),
+   savedPixelContexts(width*height)
 {
    init(neighborhoodWidth, neighborhoodHeight, numActions, numColors);
 
    int contextSize = order*(bitsPerPixel*neighborhoodWidth*neighborhoodHeight + bitsPerAction);
-   ct = new SwitchingTree(contextSize);
+   ct = new SwitchingTree(contextSize, -1, pruneUniquePaths);
+   for(int k = 1; k < bitsPerColor; k++)
+   {
+      colorCts.push_back(new SwitchingTree(contextSize + k, -1, pruneUniquePaths));
+   }
 
    int globalContextSize = order*((bitsPerPixel - 1)*width*height + bitsPerAction);
-   rct = new SwitchingTree(globalContextSize);
-   ect = new SwitchingTree(globalContextSize);
+   rct = new SwitchingTree(globalContextSize, -1, pruneUniquePaths);
+   ect = new SwitchingTree(globalContextSize, -1, pruneUniquePaths);
+}
+
+ConvolutionalBinaryCTS::ConvolutionalBinaryCTS(const ConvolutionalBinaryCTS& other, randgen_t& uniform) :
+   SamplingModel<int>(other.numActs, other.width*other.height),
+   width(other.width),
+   height(other.height),
+   neighborhoodWidth(other.neighborhoodWidth),
+   neighborhoodHeight(other.neighborhoodHeight),
+   bitsPerAction(other.bitsPerAction),
+   bitsPerPixel(other.bitsPerPixel),
+   bitsPerColor(other.bitsPerColor),
+   numColors(other.numColors),
+   order(other.order),
+   ct(other.ct->share()),
+   rct(other.rct->share()),
+   ect(other.ect->share()),
+   frozenCt(other.frozenCt),
+   mapped(other.mapped),
+   transitionCache(other.transitionCache),
+   nodeDirectory(other.nodeDirectory),
+   pinnedDepth(other.pinnedDepth),
+   nodeBudget(other.nodeBudget),
+   pruneUniquePaths(other.pruneUniquePaths),
+   rewardHead(other.rewardHead),
+   endHead(other.endHead),
+   deferHeadTraining(other.deferHeadTraining),
+   internal_uniform(rng),
+   uniform(uniform),
+   savedHistoryLength(0),
+   actHistory(1),
+   obsHistory(1),
+   rHistory(1),
+   endHistory(1),
+   offsetToEncodedPos(other.offsetToEncodedPos),
+   pixelContexts(width*height),
+   savedPixelContexts(width*height)
+{
+   for(unsigned k = 0; k < other.colorCts.size(); k++)
+   {
+      colorCts.push_back(other.colorCts[k]->share());
+   }
 }
 
 void ConvolutionalBinaryCTS::init(int neighborhoodWidth, int neighborhoodHeight, int numActions, int numColors)
@@ -69,7 +137,12 @@ void ConvolutionalBinaryCTS::init(int neighborhoodWidth, int neighborhoodHeight,
       bitsPerAction++;
    }
 
-   bitsPerPixel = 2;
+   bitsPerColor = 0;
+   for(int i = 1; i < numColors; i *= 2)
+   {
+      bitsPerColor++;
+   }
+   bitsPerPixel = bitsPerColor + 1;
 
    vector<pair<int, pair<int, int> > > distAndOffset;
    for(int xOff = 0; xOff < neighborhoodWidth; xOff++)
@@ -92,6 +165,349 @@ ConvolutionalBinaryCTS::~ConvolutionalBinaryCTS()
    delete ct;
    delete rct;
    delete ect;
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      delete colorCts[k];
+   }
+}
+
+void ConvolutionalBinaryCTS::shareTrees(const ConvolutionalBinaryCTS& other)
+{
+   delete ct;
+   delete rct;
+   delete ect;
+
+   ct = other.ct->share();
+   rct = other.rct->share();
+   ect = other.ect->share();
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      delete colorCts[k];
+      colorCts[k] = other.colorCts[k]->share();
+   }
+   frozenCt = other.frozenCt;
+   mapped = other.mapped;
+   transitionCache = other.transitionCache;
+   nodeDirectory = other.nodeDirectory;
+   pinnedDepth = other.pinnedDepth;
+   nodeBudget = other.nodeBudget;
+   pruneUniquePaths = other.pruneUniquePaths;
+   rewardHead = other.rewardHead;
+   endHead = other.endHead;
+   deferHeadTraining = other.deferHeadTraining;
+}
+
+void ConvolutionalBinaryCTS::useFileBackedNodes(const string& directory, int pinnedDepth)
+{
+   nodeDirectory = directory;
+   this->pinnedDepth = pinnedDepth;
+   ct->useFileBackedNodes(directory, pinnedDepth);
+   rct->useFileBackedNodes(directory, pinnedDepth);
+   ect->useFileBackedNodes(directory, pinnedDepth);
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      colorCts[k]->useFileBackedNodes(directory, pinnedDepth);
+   }
+}
+
+SwitchingTree* ConvolutionalBinaryCTS::newTree(size_t depth) const
+{
+   SwitchingTree* tree = new SwitchingTree(depth, -1, pruneUniquePaths);
+   if(!nodeDirectory.empty())
+   {
+      tree->useFileBackedNodes(nodeDirectory, pinnedDepth);
+   }
+   tree->setNodeBudget(nodeBudget);
+   return tree;
+}
+
+void ConvolutionalBinaryCTS::setNodeBudget(size_t maxNodes)
+{
+   nodeBudget = maxNodes;
+   ct->setNodeBudget(maxNodes);
+   rct->setNodeBudget(maxNodes);
+   ect->setNodeBudget(maxNodes);
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      colorCts[k]->setNodeBudget(maxNodes);
+   }
+}
+
+size_t ConvolutionalBinaryCTS::nodesEvicted() const
+{
+   size_t evicted = ct->nodesEvicted() + rct->nodesEvicted() + ect->nodesEvicted();
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      evicted += colorCts[k]->nodesEvicted();
+   }
+   return evicted;
+}
+
+void ConvolutionalBinaryCTS::setHeads(bool reward, bool end, bool deferTraining)
+{
+   rewardHead = reward;
+   endHead = end;
+   deferHeadTraining = deferTraining;
+   if(!deferHeadTraining)
+   {
+      trainHeads();
+   }
+}
+
+void ConvolutionalBinaryCTS::trainHeads()
+{
+   assert(!mapped || untrainedHeadSteps.empty());
+   for(unsigned i = 0; i < untrainedHeadSteps.size();)
+   {
+      int traj = untrainedHeadSteps[i].first;
+      int step = untrainedHeadSteps[i].second;
+      int run = 1;
+      while(i + run < untrainedHeadSteps.size() && untrainedHeadSteps[i + run] == make_pair(traj, step + run))
+      {
+	 run++;
+      }
+      i += run;
+
+      //(Steps retrieveState has taken back are skipped)
+      if(traj < int(actHistory.size()))
+      {
+	 int numSteps = min(run, int(actHistory[traj].size()) - step);
+	 if(numSteps > 0)
+	 {
+	    updateREnd(traj, step, numSteps);
+	 }
+      }
+   }
+   untrainedHeadSteps.clear();
+}
+
+void ConvolutionalBinaryCTS::setTransitionCache(size_t maxBytes)
+{
+   if(maxBytes > 0)
+   {
+      transitionCache.reset(new TransitionCache(maxBytes, width*height));
+   }
+   else
+   {
+      transitionCache.reset();
+   }
+}
+
+void ConvolutionalBinaryCTS::invalidateTransitions()
+{
+   frozenCt.reset();
+   if(!transitionCache)
+   {
+      return;
+   }
+
+   if(transitionCache.use_count() > 1) //Other models still have the old trees
+   {
+      transitionCache.reset(new TransitionCache(transitionCache->getMaxBytes(), width*height));
+   }
+   else
+   {
+      transitionCache->newGeneration();
+   }
+}
+
+//The geometry a saved model has to match
+void ConvolutionalBinaryCTS::writeGeometry(ostream& out) const
+{
+   writeBinary(out, boost::int32_t(width));
+   writeBinary(out, boost::int32_t(height));
+   writeBinary(out, boost::int32_t(neighborhoodWidth));
+   writeBinary(out, boost::int32_t(neighborhoodHeight));
+   writeBinary(out, boost::int32_t(numActs));
+   writeBinary(out, boost::int32_t(numColors));
+   writeBinary(out, boost::int32_t(order));
+}
+
+bool ConvolutionalBinaryCTS::readGeometry(istream& in) const
+{
+   return readMatching(in, boost::int32_t(width)) &&
+      readMatching(in, boost::int32_t(height)) &&
+      readMatching(in, boost::int32_t(neighborhoodWidth)) &&
+      readMatching(in, boost::int32_t(neighborhoodHeight)) &&
+      readMatching(in, boost::int32_t(numActs)) &&
+      readMatching(in, boost::int32_t(numColors)) &&
+      readMatching(in, boost::int32_t(order));
+}
+
+void ConvolutionalBinaryCTS::saveRandomState(ostream& out) const
+{
+   stringstream rngState;
+   rngState << uniform.base() << " "; //(reading the last number fails at end of input)
+   writeString(out, rngState.str());
+}
+
+bool ConvolutionalBinaryCTS::readRandomState(istream& in, randsrc_t& rng)
+{
+   string state;
+   if(!readString(in, state))
+   {
+      return false;
+   }
+   stringstream rngState(state);
+   rngState >> rng;
+   return !rngState.fail();
+}
+
+bool ConvolutionalBinaryCTS::loadRandomState(istream& in)
+{
+   randsrc_t savedRng;
+   if(!readRandomState(in, savedRng))
+   {
+      return false;
+   }
+   uniform.base() = savedRng;
+   return true;
+}
+
+void ConvolutionalBinaryCTS::save(ostream& out) const
+{
+   writeCheckpointHeader(out, "CBCT");
+   writeGeometry(out);
+
+   saveRandomState(out);
+   //(whether ct is sampled from through a frozen copy, which rounds differently)
+   writeBinary(out, boost::int32_t(frozenCt != NULL));
+
+   ct->save(out);
+   rct->save(out);
+   ect->save(out);
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      colorCts[k]->save(out);
+   }
+}
+
+bool ConvolutionalBinaryCTS::load(istream& in)
+{
+   if(!readCheckpointHeader(in, "CBCT") || !readGeometry(in))
+   {
+      return false;
+   }
+
+   randsrc_t savedRng;
+   boost::int32_t frozen;
+   if(!readRandomState(in, savedRng) || !readBinary(in, frozen))
+   {
+      return false;
+   }
+
+   //Load into new trees so a bad file leaves the model alone
+   SwitchingTree* newCt = newTree(ct->depth());
+   SwitchingTree* newRct = newTree(rct->depth());
+   SwitchingTree* newEct = newTree(ect->depth());
+   bool loaded = newCt->load(in) && newRct->load(in) && newEct->load(in);
+   vector<SwitchingTree*> newColorCts;
+   for(unsigned k = 0; k < colorCts.size() && loaded; k++)
+   {
+      newColorCts.push_back(newTree(colorCts[k]->depth()));
+      loaded = newColorCts.back()->load(in);
+   }
+   if(!loaded)
+   {
+      delete newCt;
+      delete newRct;
+      delete newEct;
+      for(unsigned k = 0; k < newColorCts.size(); k++)
+      {
+	 delete newColorCts[k];
+      }
+      return false;
+   }
+
+   delete ct;
+   delete rct;
+   delete ect;
+   ct = newCt;
+   rct = newRct;
+   ect = newEct;
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      delete colorCts[k];
+      colorCts[k] = newColorCts[k];
+   }
+   uniform.base() = savedRng;
+
+   invalidateTransitions();
+   if(frozen)
+   {
+      frozenCt.reset(new FrozenTree(*ct));
+   }
+   return true;
+}
+
+void ConvolutionalBinaryCTS::saveMappable(ostream& out) const
+{
+   assert(colorCts.empty());
+   stringstream header;
+   writeCheckpointHeader(header, "CBCM");
+   writeGeometry(header);
+   string headerBytes = header.str();
+   out.write(headerBytes.data(), headerBytes.size());
+   writeAlignment(out, headerBytes.size());
+
+   MappedTree::write(*ct, out);
+   MappedTree::write(*rct, out);
+   MappedTree::write(*ect, out);
+}
+
+bool ConvolutionalBinaryCTS::mapFile(const string& filename)
+{
+   if(!colorCts.empty())
+   {
+      return false;
+   }
+
+   shared_ptr<MappedModel> model(new MappedModel(filename));
+   if(!model->file.isOpen())
+   {
+      return false;
+   }
+
+   const char* data = model->file.data();
+   size_t size = model->file.size();
+   MemoryBuffer buffer(data, size);
+   istream in(&buffer);
+   if(!readCheckpointHeader(in, "CBCM") || !readGeometry(in))
+   {
+      return false;
+   }
+
+   size_t offset = alignedLength(buffer.position());
+   size_t used;
+   if(offset > size || !model->ct.map(data + offset, size - offset, ct->depth(), -1, pruneUniquePaths, used))
+   {
+      return false;
+   }
+   offset += used;
+   if(!model->rct.map(data + offset, size - offset, rct->depth(), -1, pruneUniquePaths, used))
+   {
+      return false;
+   }
+   offset += used;
+   if(!model->ect.map(data + offset, size - offset, ect->depth(), -1, pruneUniquePaths, used))
+   {
+      return false;
+   }
+
+   //The trees are now only used to hold the context
+   size_t depth = ct->depth();
+   delete ct;
+   ct = new SwitchingTree(depth, -1, pruneUniquePaths);
+   depth = rct->depth();
+   delete rct;
+   rct = new SwitchingTree(depth, -1, pruneUniquePaths);
+   depth = ect->depth();
+   delete ect;
+   ect = new SwitchingTree(depth, -1, pruneUniquePaths);
+
+   invalidateTransitions();
+   mapped = model;
+   return true;
 }
 
 void ConvolutionalBinaryCTS::encode(const vector<int>& obs, int pos, vector<bit_t>& encoded) const
@@ -124,7 +540,7 @@ void ConvolutionalBinaryCTS::encode(const vector<int>& obs, int x, int y, vector
 	    encoded[bitsPerPixel*encodedPos + bitsPerPixel - 1] = false;
 	 }
 
-	 encoded[bitsPerPixel*encodedPos] = pix ? true : false;
+	 encodeColor(pix, encoded, bitsPerPixel*encodedPos);
       }
    }
 }
@@ -135,7 +551,7 @@ void ConvolutionalBinaryCTS::encode(const vector<int>& obs, vector<bit_t>& encod
 
    for(int p = 0; p < this->numDim; p++)
    {
-      encoded[p*(bitsPerPixel - 1)] = obs[this->numDim - 1 - p] ? true : false;
+      encodeColor(obs[this->numDim - 1 - p], encoded, p*(bitsPerPixel - 1));
    }
 }
 
@@ -149,8 +565,50 @@ void ConvolutionalBinaryCTS::encode(int act, vector<bit_t>& encoded) const
    }
 }
 
+void ConvolutionalBinaryCTS::encodeColor(int color, vector<bit_t>& encoded, int start) const
+{
+   if(bitsPerColor == 1)
+   {
+      encoded[start] = color ? true : false;
+      return;
+   }
+
+   for(int k = 0; k < bitsPerColor; k++)
+   {
+      encoded[start + k] = (color & (1 << (bitsPerColor - 1 - k))) ? true : false;
+   }
+}
+
+int ConvolutionalBinaryCTS::decodeColor(const vector<bit_t>& bits) const
+{
+   int color = 0;
+   for(int k = 0; k < bitsPerColor; k++)
+   {
+      color = 2*color + (bits[k] ? 1 : 0);
+   }
+   assert(color < numColors);
+   return color;
+}
+
+bool ConvolutionalBinaryCTS::colorBitForced(const vector<bit_t>& bits, int start, int k) const
+{
+   int prefix = 0;
+   for(int i = 0; i < k; i++)
+   {
+      prefix = 2*prefix + (bits[start + i] ? 1 : 0);
+   }
+   //The smallest code with a 1 here
+   return ((2*prefix + 1) << (bitsPerColor - 1 - k)) >= numColors;
+}
+
 void ConvolutionalBinaryCTS::setUpContext(int pos, int traj, int step) const
 {
+   if(traj == pixelContexts.traj && step == pixelContexts.step)
+   {
+      ct->setHistory(pixelContexts.contexts[pos]);
+      return;
+   }
+
    ct->resetHistory();
    
    //Set up the context for this position
@@ -166,10 +624,78 @@ void ConvolutionalBinaryCTS::setUpContext(int pos, int traj, int step) const
    }
 }
 
+void ConvolutionalBinaryCTS::setUpColorContexts() const
+{
+   for(unsigned k = 0; k < colorCts.size(); k++)
+   {
+      colorCts[k]->setHistory(ct->getHistory());
+   }
+}
+
+void ConvolutionalBinaryCTS::addColorBit(int k, bit_t b) const
+{
+   for(int i = k; i < int(colorCts.size()); i++)
+   {
+      colorCts[i]->updateHistory(b);
+   }
+}
+
+void ConvolutionalBinaryCTS::advancePixelContexts()
+{
+   int traj = actHistory.size() - 1;
+   int step = actHistory.back().size();
+   int stepBits = bitsPerAction + bitsPerPixel*neighborhoodWidth*neighborhoodHeight;
+
+   int first = step - 1;
+   if(traj != pixelContexts.traj || step != pixelContexts.step + 1)
+   {
+      //Out of step (a new trajectory, or the history was changed some other way),
+      //so start again from the steps in the context
+      for(int p = 0; p < width*height; p++)
+      {
+	 pixelContexts.contexts[p].clear();
+      }
+      first = max(step - order, 0);
+   }
+   pixelContexts.traj = traj;
+   pixelContexts.step = step;
+
+   vector<bit_t> act(bitsPerAction);
+   vector<bit_t> obs(bitsPerPixel*neighborhoodWidth*neighborhoodHeight);
+   for(int t = first; t < step; t++)
+   {
+      encode(actHistory[traj][t], act);
+      for(int p = 0; p < width*height; p++)
+      {
+	 history_t& context = pixelContexts.contexts[p];
+	 if(int(context.size()) == order*stepBits)
+	 {
+	    //The oldest step is at the start
+	    context >>= stepBits;
+	    context.resize(context.size() - stepBits);
+	 }
+
+	 encode(obsHistory[traj][t], p, obs);
+	 for(int i = 0; i < bitsPerAction; i++)
+	 {
+	    context.push_back(act[i] != 0);
+	 }
+	 for(unsigned i = 0; i < obs.size(); i++)
+	 {
+	    context.push_back(obs[i] != 0);
+	 }
+      }
+   }
+}
+
 void ConvolutionalBinaryCTS::setUpContext(int traj, int step) const
 {
    rct->resetHistory();
    ect->resetHistory();
+   if(!rewardHead && !endHead)
+   {
+      return;
+   }
    
    //Set up the context for this position
    int contextStart = max(step - order + 1, 0);
@@ -178,11 +704,17 @@ void ConvolutionalBinaryCTS::setUpContext(int traj, int step) const
    for(int t = contextStart; t < step; t++)
    {
       encode(actHistory[traj][t], act);
-      rct->updateHistory(act);
-      ect->updateHistory(act);
       encode(obsHistory[traj][t], obs);
-      rct->updateHistory(obs);
-      ect->updateHistory(obs);
+      if(rewardHead)
+      {
+	 rct->updateHistory(act);
+	 rct->updateHistory(obs);
+      }
+      if(endHead)
+      {
+	 ect->updateHistory(act);
+	 ect->updateHistory(obs);
+      }
    }
 }
 
@@ -199,13 +731,28 @@ void ConvolutionalBinaryCTS::update(int act, const vector<int>& obs, bool reward
    endHistory.back().push_back(endTraj);
    if(learn)
    {
+      assert(!mapped);
+      invalidateTransitions();
       updateActObs(actHistory.size() - 1, actHistory.back().size() - 1, 1);
-      updateREnd(actHistory.size() - 1, actHistory.back().size() - 1, 1);
+      if(deferHeadTraining)
+      {
+	 if(rewardHead || endHead)
+	 {
+	    untrainedHeadSteps.push_back(make_pair(actHistory.size() - 1, actHistory.back().size() - 1));
+	 }
+      }
+      else
+      {
+	 updateREnd(actHistory.size() - 1, actHistory.back().size() - 1, 1);
+      }
    }
+   advancePixelContexts();
 }
 
 void ConvolutionalBinaryCTS::batchUpdate(const vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& dataset)
 {
+   assert(!mapped);
+   invalidateTransitions();
    int curLength = actHistory.back().size();
 
    for(unsigned d = 0; d < dataset.size(); d++)
@@ -245,6 +792,8 @@ void ConvolutionalBinaryCTS::batchUpdate(const vector<tuple<vector<vector<int> >
       rHistory.back().resize(curLength);
       endHistory.back().resize(curLength);
    }
+
+   frozenCt.reset(new FrozenTree(*ct));
 }
 
 double ConvolutionalBinaryCTS::batchLL(const vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& dataset)
@@ -299,6 +848,7 @@ void ConvolutionalBinaryCTS::updateActObs(int traj, int step, int numUpdates)
 {
    vector<bit_t> act(bitsPerAction);
    vector<bit_t> obs(bitsPerPixel*neighborhoodWidth*neighborhoodHeight);
+   int center = bitsPerPixel*(neighborhoodWidth*neighborhoodHeight - 1); //Where the pixel's own color is encoded
    for(int p = 0; p < width*height; p++)
    {
       setUpContext(p, traj, step);
@@ -309,28 +859,46 @@ void ConvolutionalBinaryCTS::updateActObs(int traj, int step, int numUpdates)
 	 encode(actHistory[traj][step + i], act);
 	 ct->updateHistory(act);	    
 	 encode(obsHistory[traj][step + i], p, obs);
-	 ct->update(obs[bitsPerPixel*(neighborhoodWidth*neighborhoodHeight - 1)]);
+	 setUpColorContexts();
+	 ct->update(obs[center]);
+	 for(int k = 1; k < bitsPerColor; k++)
+	 {
+	    addColorBit(k - 1, obs[center + k - 1]);
+	    if(!colorBitForced(obs, center, k))
+	    {
+	       colorCts[k - 1]->update(obs[center + k]);
+	    }
+	 }
       }
    }      
 }
 
 void ConvolutionalBinaryCTS::updateREnd(int traj, int step, int numUpdates)
 {
+   if(!rewardHead && !endHead)
+   {
+      return;
+   }
+
    vector<bit_t> act(bitsPerAction);
    vector<bit_t> globalObs((bitsPerPixel - 1)*width*height);
    setUpContext(traj, step);
    for(int i = 0; i < numUpdates; i++)
    {
       encode(actHistory[traj][step + i], act);
-      rct->updateHistory(act);
-      ect->updateHistory(act);
-
       encode(obsHistory[traj][step + i], globalObs);
-      rct->updateHistory(globalObs);
-      ect->updateHistory(globalObs);
-
-      rct->update(rHistory[traj][step + i] ? true : false);
-      ect->update(endHistory[traj][step + i] ? true : false);
+      if(rewardHead)
+      {
+	 rct->updateHistory(act);
+	 rct->updateHistory(globalObs);
+	 rct->update(rHistory[traj][step + i] ? true : false);
+      }
+      if(endHead)
+      {
+	 ect->updateHistory(act);
+	 ect->updateHistory(globalObs);
+	 ect->update(endHistory[traj][step + i] ? true : false);
+      }
    }
 }
 
@@ -339,32 +907,202 @@ void ConvolutionalBinaryCTS::sample(int act, vector<int>& sampled, bool& reward,
    sample(actHistory.size() - 1, actHistory.back().size(), act, sampled, reward, endTraj);
 }
 
-void ConvolutionalBinaryCTS::sample(int traj, int step, int action, vector<int>& sampled, bool& reward, bool& endTraj)
+void ConvolutionalBinaryCTS::sample(int act, vector<int>& sampled, BitFrame& frame, vector<int>& changed, bool& reward, bool& endTraj)
+{
+   assert(numColors == 2);
+   changed.clear();
+   sample(actHistory.size() - 1, actHistory.back().size(), act, sampled, reward, endTraj, &frame, &changed);
+}
+
+void ConvolutionalBinaryCTS::sample(int traj, int step, int action, vector<int>& sampled, bool& reward, bool& endTraj, BitFrame* frame, vector<int>* changed)
 {
    sampled.resize(width*height);
 
    vector<bit_t> act(bitsPerAction);
    encode(action, act);
-   for(int p = 0; p < width*height; p++)
+   if(transitionCache && order == 1 && step > 0 && numColors == 2)
    {
-      setUpContext(p, traj, step);  
-      ct->updateHistory(act);
-      bit_t s = ct->genRandomSymbol(uniform);
-      sampled[p] = s ? 1 : 0;
-   }      
+      vector<float> probs;
+      getTransitionProbs(traj, step, action, probs, frame);
+      for(int p = 0; p < width*height; p++)
+      {
+	 sampled[p] = uniform() < probs[p] ? 1 : 0;
+	 if(frame && sampled[p] != frame->get(p))
+	 {
+	    frame->flip(p);
+	    changed->push_back(p);
+	 }
+      }
+   }
+   else
+   {
+      for(int p = 0; p < width*height; p++)
+      {
+	 setUpContext(p, traj, step);  
+	 ct->updateHistory(act);
+	 setUpColorContexts();
+	 bit_t s;
+	 if(mapped)
+	 {
+	    s = mapped->ct.genRandomSymbol(*ct, uniform);
+	 }
+	 else
+	 {
+	    s = frozenCt ? frozenCt->genRandomSymbol(*ct, uniform) : ct->genRandomSymbol(uniform);
+	 }
+	 sampled[p] = s ? 1 : 0;
+
+	 if(bitsPerColor > 1)
+	 {
+	    vector<bit_t> color(bitsPerColor);
+	    color[0] = s;
+	    for(int k = 1; k < bitsPerColor; k++)
+	    {
+	       addColorBit(k - 1, color[k - 1]);
+	       color[k] = colorBitForced(color, 0, k) ? false : colorCts[k - 1]->genRandomSymbol(uniform);
+	    }
+	    sampled[p] = decodeColor(color);
+	 }
+	 if(frame && sampled[p] != frame->get(p))
+	 {
+	    frame->flip(p);
+	    changed->push_back(p);
+	 }
+      }
+   }
+
+   reward = false;
+   endTraj = false;
+   if(!rewardHead && !endHead)
+   {
+      return;
+   }
 
    vector<bit_t> globalObs((bitsPerPixel - 1)*width*height);
    setUpContext(traj, step);
-   rct->updateHistory(act);
-   ect->updateHistory(act);
    encode(sampled, globalObs);
-   rct->updateHistory(globalObs);
-   ect->updateHistory(globalObs);
    bit_t s;
-   s = rct->genRandomSymbol(uniform);
-   reward = s;
-   s = ect->genRandomSymbol(uniform);
-   endTraj = s;
+   if(rewardHead)
+   {
+      rct->updateHistory(act);
+      rct->updateHistory(globalObs);
+      s = mapped ? mapped->rct.genRandomSymbol(*rct, uniform) : rct->genRandomSymbol(uniform);
+      reward = s;
+   }
+   if(endHead)
+   {
+      ect->updateHistory(act);
+      ect->updateHistory(globalObs);
+      s = mapped ? mapped->ect.genRandomSymbol(*ect, uniform) : ect->genRandomSymbol(uniform);
+      endTraj = s;
+   }
+}
+
+void ConvolutionalBinaryCTS::getTransitionProbs(int traj, int step, int act, vector<float>& probs, const BitFrame* last)
+{
+   //For an order 1 model, the pixel contexts only depend on the last frame and the action
+   BitFrame packed;
+   if(!last)
+   {
+      packed.pack(obsHistory[traj][step - 1]);
+      last = &packed;
+   }
+   if(transitionCache->lookup(*last, act, probs))
+   {
+      return;
+   }
+
+   //(Deep in a rollout only this action is likely to be asked for, so only it is
+   //computed; see expectEveryAction)
+   probs.resize(width*height);
+   vector<bit_t> action(bitsPerAction);
+   encode(act, action);
+   for(int p = 0; p < width*height; p++)
+   {
+      setUpContext(p, traj, step);
+      ct->updateHistory(action);
+      if(mapped)
+      {
+	 probs[p] = mapped->ct.genRandomSymbolProb(*ct);
+      }
+      else
+      {
+	 probs[p] = frozenCt ? frozenCt->genRandomSymbolProb(*ct) : ct->genRandomSymbolProb();
+      }
+   }
+   transitionCache->insert(*last, act, probs);
+}
+
+void ConvolutionalBinaryCTS::getTransitionProbs(int traj, int step, vector<vector<float> >& probs) const
+{
+   assert(numColors == 2);
+   probs.assign(this->numActs, vector<float>(width*height));
+   vector<double> actProbs;
+   for(int p = 0; p < width*height; p++)
+   {
+      //The action bits are the last ones added, so the trees can branch on them
+      setUpContext(p, traj, step);
+      if(mapped)
+      {
+	 mapped->ct.genRandomSymbolProbs(*ct, bitsPerAction, actProbs);
+      }
+      else if(frozenCt)
+      {
+	 frozenCt->genRandomSymbolProbs(*ct, bitsPerAction, actProbs);
+      }
+      else
+      {
+	 ct->genRandomSymbolProbs(bitsPerAction, actProbs);
+      }
+
+      for(int a = 0; a < this->numActs; a++)
+      {
+	 probs[a][p] = actProbs[a];
+      }
+   }
+}
+
+void ConvolutionalBinaryCTS::predictPixels(vector<vector<float> >& probs) const
+{
+   getTransitionProbs(actHistory.size() - 1, actHistory.back().size(), probs);
+}
+
+void ConvolutionalBinaryCTS::expectEveryAction()
+{
+   int step = actHistory.back().size();
+   if(!transitionCache || order != 1 || step == 0 || numColors != 2)
+   {
+      return;
+   }
+
+   expectEveryAction(BitFrame(obsHistory.back()[step - 1]));
+}
+
+void ConvolutionalBinaryCTS::expectEveryAction(const BitFrame& frame)
+{
+   int step = actHistory.back().size();
+   if(!transitionCache || order != 1 || step == 0 || numColors != 2)
+   {
+      return;
+   }
+
+   vector<float> cached;
+   int a = 0;
+   while(a < this->numActs && transitionCache->lookup(frame, a, cached))
+   {
+      a++;
+   }
+   if(a == this->numActs)
+   {
+      return;
+   }
+
+   vector<vector<float> > probs;
+   predictPixels(probs);
+   for(a = 0; a < this->numActs; a++)
+   {
+      transitionCache->insert(frame, a, probs[a]);
+   }
 }
 
 double ConvolutionalBinaryCTS::predict(int act, const vector<int>& obs, bool print) const
@@ -376,8 +1114,27 @@ double ConvolutionalBinaryCTS::predict(int act, const vector<int>& obs, bool pri
    {
       setUpContext(p, actHistory.size() - 1, actHistory.back().size());
       ct->updateHistory(action);
-      bit_t symb = obs[p] ? true : false;
-      double prob = ct->prob(symb);
+      double prob;
+      if(bitsPerColor == 1)
+      {
+	 bit_t symb = obs[p] ? true : false;
+	 prob = mapped ? mapped->ct.prob(*ct, symb) : ct->prob(symb);
+      }
+      else
+      {
+	 vector<bit_t> color(bitsPerColor);
+	 encodeColor(obs[p], color, 0);
+	 setUpColorContexts();
+	 prob = ct->prob(color[0]);
+	 for(int k = 1; k < bitsPerColor; k++)
+	 {
+	    addColorBit(k - 1, color[k - 1]);
+	    if(!colorBitForced(color, 0, k))
+	    {
+	       prob *= colorCts[k - 1]->prob(color[k]);
+	    }
+	 }
+      }
       if(print)
       {
 	 if(p%width == 0)
@@ -392,6 +1149,11 @@ double ConvolutionalBinaryCTS::predict(int act, const vector<int>& obs, bool pri
 
 double ConvolutionalBinaryCTS::predictR(int act, const vector<int>& obs, int reward) const
 {
+   if(!rewardHead)
+   {
+      return reward ? 0 : 1;
+   }
+
    vector<bit_t> action(bitsPerAction);
    vector<bit_t> globalObs((bitsPerPixel - 1)*width*height);
    encode(act, action);
@@ -400,13 +1162,18 @@ double ConvolutionalBinaryCTS::predictR(int act, const vector<int>& obs, int rew
    rct->updateHistory(action);
    rct->updateHistory(globalObs);
 
-   double prediction = rct->prob(reward ? true : false);
+   double prediction = mapped ? mapped->rct.prob(*rct, reward ? true : false) : rct->prob(reward ? true : false);
 
    return prediction;
 }
 
 double ConvolutionalBinaryCTS::predictEnd(int act, const vector<int>& obs, bool end) const
 {
+   if(!endHead)
+   {
+      return end ? 0 : 1;
+   }
+
    vector<bit_t> action(bitsPerAction);
    vector<bit_t> globalObs((bitsPerPixel - 1)*width*height);
    encode(act, action);
@@ -415,7 +1182,7 @@ double ConvolutionalBinaryCTS::predictEnd(int act, const vector<int>& obs, bool
    ect->updateHistory(action);
    ect->updateHistory(globalObs);
 
-   double prediction = ect->prob(end ? true : false);
+   double prediction = mapped ? mapped->ect.prob(*ect, end ? true : false) : ect->prob(end ? true : false);
 
    return prediction;
 }
@@ -428,6 +1195,20 @@ void ConvolutionalBinaryCTS::takeAction(int act, vector<int>& obs, int& reward,
    update(act, obs, reward, endEpisode, false);
 }
 
+void ConvolutionalBinaryCTS::takeAction(int act, vector<int>& obs, BitFrame& frame, vector<int>& changed, int& reward, bool& endEpisode)
+{
+   if(numColors != 2)
+   {
+      SamplingModel<int>::takeAction(act, obs, frame, changed, reward, endEpisode);
+      return;
+   }
+
+   bool r;
+   sample(act, obs, frame, changed, r, endEpisode);
+   reward = r;
+   update(act, obs, reward, endEpisode, false);
+}
+
 void ConvolutionalBinaryCTS::takeAction(int act, int& reward, bool& endEpisode)
 {
    vector<int> obs;
@@ -441,6 +1222,7 @@ void ConvolutionalBinaryCTS::saveState()
 {
    savedNumTraj = actHistory.size();
    savedHistoryLength = actHistory.back().size();   
+   savedPixelContexts = pixelContexts;
 }
 
 void ConvolutionalBinaryCTS::retrieveState()
@@ -453,5 +1235,6 @@ void ConvolutionalBinaryCTS::retrieveState()
    rHistory.back().resize(savedHistoryLength);
    endHistory.resize(savedNumTraj);
    endHistory.back().resize(savedHistoryLength);
+   pixelContexts = savedPixelContexts;
 }
 
@@ -8,9 +8,13 @@ Author: Erik Talvitie
 #include "cts.hpp"
 #include "common.hpp"
 #include "SamplingModel.h"
+#include "BitFrame.h"
+#include "TransitionCache.h"
+#include "MappedFile.h"
 
 #include <vector>
 #include <boost/tuple/tuple.hpp>
+#include <boost/shared_ptr.hpp>
 //#include <tuple>
 
 using namespace std;
@@ -28,7 +32,8 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    int neighborhoodWidth;     //Width of the convolutional window
    int neighborhoodHeight;    //Height of the convolutional window
    int bitsPerAction;         //How many bits are needed to encode an action
-   int bitsPerPixel;          //How many bits are needed to encode a color
+   int bitsPerPixel;          //How many bits are needed to encode a color (and whether it is in the image)
+   int bitsPerColor;          //How many bits are needed for the color itself
    int numColors;             //How many colors are possible
    int order;                 //The order of the MDP
 
@@ -39,6 +44,50 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    mutable SwitchingTree* rct;
    //This one is used for predicting the end of the episode
    mutable SwitchingTree* ect;
+   //With more than two colors, a pixel's color is predicted one bit at a time,
+   //most significant first: ct predicts the first bit and colorCts[k - 1] bit k,
+   //given the context and the bits before it (empty with two colors)
+   vector<SwitchingTree*> colorCts;
+
+   //A read-only copy of ct made after each batchUpdate, used for sampling
+   //(null if ct has changed since)
+   boost::shared_ptr<const FrozenTree> frozenCt;
+
+   //A model file written by saveMappable and mapped by mapFile
+   struct MappedModel
+   {
+      MappedFile file;
+      MappedTree ct;
+      MappedTree rct;
+      MappedTree ect;
+
+      MappedModel(const string& filename) : file(filename) {}
+   };
+   //When set, the model answers predictions and samples from it instead of the trees
+   //(which then only hold the context), and cannot learn
+   boost::shared_ptr<const MappedModel> mapped;
+
+   //Caches the per-pixel probabilities of the next frame given the previous
+   //frame and action (null if off; shared with copies that have the same trees)
+   boost::shared_ptr<TransitionCache> transitionCache;
+
+   //Where nodes below pinnedDepth go, if not in memory (see useFileBackedNodes)
+   string nodeDirectory;
+   int pinnedDepth;
+
+   //The most nodes each tree may have (0 for no limit, see setNodeBudget)
+   size_t nodeBudget;
+
+   //Whether the trees collapse unique paths into single nodes
+   bool pruneUniquePaths;
+
+   //Which of the reward and end trees are used (see setHeads)
+   bool rewardHead;
+   bool endHead;
+   //Whether learning leaves the reward and end trees for trainHeads,
+   //and the (trajectory, step) pairs they haven't learned from yet
+   bool deferHeadTraining;
+   vector<pair<int, int> > untrainedHeadSteps;
 
    //Random number generation
    randsrc_t rng;
@@ -58,6 +107,21 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    //Used to pre-calculate neighborhood offsets (just runtime optimization)
    vector<vector<int> > offsetToEncodedPos;
 
+   //The context of every position at one step of a trajectory (the encoded
+   //actions and neighborhoods of the order steps before it)
+   struct PixelContexts
+   {
+      int traj;
+      int step;
+      vector<history_t> contexts;
+
+      PixelContexts(int numPixels) : traj(0), step(0), contexts(numPixels) {}
+   };
+   //Kept at the end of the latest trajectory as steps are added, so
+   //setUpContext can copy a context instead of encoding order steps again
+   PixelContexts pixelContexts;
+   PixelContexts savedPixelContexts; //For retrieveState
+
    //Encodes the neighborhood around the given position
    //into an input vector for the CTS model
    void encode(const vector<int>& obs, int pos, vector<bit_t>& encoded) const;
@@ -70,8 +134,31 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    //Encodes the action
    void encode(int act, vector<bit_t>& encoded) const;
 
+   //Writes the bits of a color into encoded, starting at start
+   void encodeColor(int color, vector<bit_t>& encoded, int start) const;
+   //The color with the given bits
+   int decodeColor(const vector<bit_t>& bits) const;
+   //Whether bit k of a color has to be 0, given the bits before it (starting at
+   //bits[start]): the codes from numColors up aren't colors, so a bit that would
+   //only lead to them is never predicted, sampled or learned
+   bool colorBitForced(const vector<bit_t>& bits, int start, int k) const;
+
    //Samples the next observation/reward/end from the given trajectory and step
-   void sample(int traj, int step, int act, vector<int>& sampled, bool& reward, bool& endTraj);
+   //If frame is given (holding the observation before step, so it also serves as
+   //the transition cache's key), flips its pixels as they are sampled, listing
+   //them in changed
+   void sample(int traj, int step, int act, vector<int>& sampled, bool& reward, bool& endTraj, BitFrame* frame = NULL, vector<int>* changed = NULL);
+
+   //Fills in the probability that each pixel is on in the given step,
+   //if the action is taken (from the transition cache if possible)
+   //last is the observation before step, packed (packed here if not given)
+   void getTransitionProbs(int traj, int step, int act, vector<float>& probs, const BitFrame* last = NULL);
+   //Fills in probs[a] as above for every action a at once: the context of each
+   //pixel is set up once and the tree walk only splits at the action bits
+   void getTransitionProbs(int traj, int step, vector<vector<float> >& probs) const;
+   //Called whenever the trees change, so cached transitions and the frozen
+   //tree are not reused
+   void invalidateTransitions();
 
    //Updates the models with the history starting at step
    //and going for numUpdates steps
@@ -82,15 +169,40 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    //(Encodes the relevant action and neighborhood, and updates
    //the histories in the models)
    void setUpContext(int pos, int traj, int step) const;
-   //Sets up the context for the reward and end models
+   //Moves pixelContexts on to the end of the latest trajectory (after a step
+   //is added), shifting out the oldest step and adding the newest
+   void advancePixelContexts();
+   //Starts the contexts of colorCts from ct's (before ct uses it, since
+   //learning adds the symbol to the context)
+   void setUpColorContexts() const;
+   //Adds bit k of the pixel's color to the contexts of the trees after it
+   void addColorBit(int k, bit_t b) const;
+   //Sets up the context for the reward and end models (the ones in use)
    void setUpContext(int traj, int step) const;
 
+   //Write/check the settings a saved model has to match
+   void writeGeometry(ostream& out) const;
+   bool readGeometry(istream& in) const;
+
+   //Reads the state written by saveRandomState
+   static bool readRandomState(istream& in, randsrc_t& rng);
+
+   //A new tree of the given depth, file backed if the model's are
+   SwitchingTree* newTree(size_t depth) const;
+
    //Initialize the model
    void init(int neighborhoodWidth, int neighborhoodHeight, int numActions, int numColors);
 
   public:
-   ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, int seed);
-   ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, randgen_t& uniform);
+   //pruneUniquePaths saves memory (especially with large neighborhoods) without
+   //changing the predictions, but slows updates down a little
+   //Observations hold colors 0 to numColors - 1 (with more than two, each takes
+   //more bits of context and more trees to predict, see colorCts)
+   ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, int seed, bool pruneUniquePaths = true, int numColors = 2);
+   ConvolutionalBinaryCTS(int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, randgen_t& uniform, bool pruneUniquePaths = true, int numColors = 2);
+   //A copy that shares other's trees (copied on write) and draws from the given
+   //random stream, so it can be used by another thread. Starts with an empty history.
+   ConvolutionalBinaryCTS(const ConvolutionalBinaryCTS& other, randgen_t& uniform);
    ~ConvolutionalBinaryCTS();
 
    //Update the model with a new step (maybe learn from it)
@@ -98,9 +210,26 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    void update(int act, const vector<int>& obs, int reward, bool endTraj);
 
    void sample(int act, vector<int>& sampled, bool& reward, bool& endTraj);
+   //Also keeps frame (which must hold the current contents of sampled, the last
+   //observation) and its fingerprint up to date, and lists the pixels that changed
+   //(two color models only)
+   void sample(int act, vector<int>& sampled, BitFrame& frame, vector<int>& changed, bool& reward, bool& endTraj);
+
+   //Fills in probs[a][p] with the probability that pixel p is on in the next
+   //observation if action a is taken (the distribution sample draws from),
+   //for every action at once (two color models only)
+   void predictPixels(vector<vector<float> >& probs) const;
+   //Caches predictPixels' probabilities for every action not already in the transition
+   //cache (if it is on), since every action is about to be sampled from this state
+   void expectEveryAction();
+   //The same, given the last observation packed (saves packing it again)
+   void expectEveryAction(const BitFrame& last);
 
    //Give the probability of the observation
    //given the action and the model's current state
+   //(Not from the transition cache: it holds the distribution sample draws from,
+   //which comes from the frozen tree when there is one and is rounded to floats,
+   //while this is the trees' own probability)
    double predict(int act, const vector<int>& obs, bool print=false) const;
    //Give the probability of the reward
    //given the action and the model's current state
@@ -112,6 +241,8 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
    //Samples a next state and then updates using that state
    void takeAction(int act, vector<int>& obs, int& reward, bool& endEpisode);
    void takeAction(int act, int& reward, bool& endEpisode);
+   //The changed pixels are recorded as they are sampled (see sample)
+   void takeAction(int act, vector<int>& obs, BitFrame& frame, vector<int>& changed, int& reward, bool& endEpisode);
 
    //Resets to the initial state (i.e. begins a new, empty trajectory)
    void reset();
@@ -121,6 +252,59 @@ class ConvolutionalBinaryCTS : public SamplingModel<int>
 
    double batchLL(const vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& dataset); //obs context, action context, nextAct, nextObs, reward, endEpisode
 
+   //Replaces this model's trees with trees sharing the other model's nodes
+   //(nodes are copied on write, so the models can then be trained separately)
+   void shareTrees(const ConvolutionalBinaryCTS& other);
+
+   //Turns on caching of the next frame distribution for each (previous frame, action)
+   //in sample, using about maxBytes of memory (0 turns it off)
+   //Only order 1 models use it (otherwise the distribution depends on more than one frame),
+   //and only with two colors
+   void setTransitionCache(size_t maxBytes);
+
+   //Keeps the nodes of the trees below depth pinnedDepth in memory mapped files in
+   //directory, so trees larger than memory page out rather than failing (the reward and end
+   //trees are as deep as the whole frame, so they grow fastest on large images)
+   void useFileBackedNodes(const string& directory, int pinnedDepth);
+
+   //Chooses which of the reward and end trees the model uses (both, by default).
+   //A tree that is not used is never trained or sampled from: the model then
+   //predicts a reward of 0 or a trajectory that doesn't end. With deferTraining,
+   //update leaves the trees' learning for trainHeads
+   void setHeads(bool reward, bool end, bool deferTraining = false);
+   //Trains the reward and end trees on the steps update has left for them
+   //(runs of consecutive steps share one context)
+   void trainHeads();
+
+   //Limits each tree to about maxNodes nodes (0 for no limit), evicting the least
+   //visited contexts as it learns, so long runs stay in bounded memory
+   void setNodeBudget(size_t maxNodes);
+   //The number of nodes the trees have evicted to stay within the budget
+   size_t nodesEvicted() const;
+
+   //Writes the trees and the state of the random number generator in binary,
+   //along with the geometry they were trained with (see Checkpoint.h)
+   void save(ostream& out) const;
+   //Replaces the trees and random state with ones written by save
+   //Returns false (leaving the model as it was) if the file was written by
+   //a model with a different geometry or order
+   bool load(istream& in);
+
+   //Write/replace just the state of the random number generator (for models
+   //whose trees are saved elsewhere, e.g. shared with another model)
+   void saveRandomState(ostream& out) const;
+   bool loadRandomState(istream& in);
+
+   //Writes the model in a form that mapFile can use in place
+   //(the trees as MappedTrees, after the geometry; two color models only)
+   void saveMappable(ostream& out) const;
+   //Maps a file written by saveMappable read-only into memory and answers
+   //predictions and samples from it from then on (the model can no longer learn)
+   //Processes mapping the same file share its pages. Returns false (leaving the model
+   //as it was) if the file can't be mapped or was written with a different geometry,
+   //or if the model has more than two colors.
+   bool mapFile(const string& filename);
+
    //Save the state for future retrieval
    void saveState();
    //Retrieve the saved state
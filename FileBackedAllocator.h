@@ -0,0 +1,75 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef FILE_BACKED_ALLOCATOR_H
+#define FILE_BACKED_ALLOCATOR_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* An allocator (with the interface of a boost::pool user allocator) that puts
+   each block in its own memory mapped temporary file (unlinked as soon as it is
+   created). The kernel can write cold pages out to the file and drop them, so
+   storage that outgrows memory slows down instead of running out. HandleArena
+   gets its file backed chunks from it. */
+struct FileBackedAllocator
+{
+   typedef std::size_t size_type;
+   typedef std::ptrdiff_t difference_type;
+
+   //Where the temporary files go (shared by every user)
+   static string& directory()
+   {
+      static string dir = "/tmp";
+      return dir;
+   }
+
+   static char* malloc(const size_type bytes)
+   {
+      //The length of the mapping is kept in front of the block
+      const size_type header = 16;
+      size_type length = bytes + header;
+
+      string name = directory() + "/nodesXXXXXX";
+      vector<char> path(name.begin(), name.end());
+      path.push_back('\0');
+      int fd = mkstemp(&path[0]);
+      if(fd < 0)
+      {
+	 return NULL;
+      }
+      unlink(&path[0]);
+
+      void* p = MAP_FAILED;
+      if(ftruncate(fd, length) == 0)
+      {
+	 p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      }
+      close(fd); //The mapping keeps the file alive
+      if(p == MAP_FAILED)
+      {
+	 return NULL;
+      }
+
+      //Nodes are visited in no particular order, so reading ahead doesn't help
+      madvise(p, length, MADV_RANDOM);
+      *static_cast<size_type*>(p) = length;
+      return static_cast<char*>(p) + header;
+   }
+
+   static void free(char* const block)
+   {
+      const size_type header = 16;
+      char* p = block - header;
+      munmap(p, *reinterpret_cast<size_type*>(p));
+   }
+};
+
+#endif
@@ -0,0 +1,118 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef HANDLE_ARENA_H
+#define HANDLE_ARENA_H
+
+#include "FileBackedAllocator.h"
+
+#include <boost/cstdint.hpp>
+#include <cstdlib>
+#include <new>
+#include <iostream>
+
+//The index of an object in a HandleArena (0 for none)
+typedef boost::uint32_t handle_t;
+
+/* Storage for objects that are named by 32-bit handles instead of pointers
+   (so tree nodes can refer to their children in half the space).
+   Objects are allocated in chunks that never move, so finding a handle's object
+   is one table lookup. Chunks come from the heap, or from FileBackedAllocator for
+   objects allocated file backed, and freed objects are reused by new ones of the
+   same kind, but chunks are only given back when the process ends.
+   Several threads can allocate and free at once.
+   There is no constructor: a static arena starts out zeroed, which is empty. */
+template<class T>
+class HandleArena
+{
+  public:
+   static const size_t ChunkBits = 16;
+   static const size_t ChunkSize = size_t(1) << ChunkBits;
+   //(the last chunk is left out, so no handle has every bit set)
+   static const size_t MaxChunks = (size_t(1) << (32 - ChunkBits)) - 1;
+
+   T* at(handle_t h) const
+   {
+      return m_chunks[h >> ChunkBits] + (h & (ChunkSize - 1));
+   }
+
+   //Storage for a new object, which the caller constructs
+   //(exits if there are no handles or storage left)
+   handle_t alloc(bool fileBacked);
+   //Takes back the storage of an object (already destroyed)
+   void free(handle_t h);
+
+  private:
+   void lock()
+   {
+      while(__sync_lock_test_and_set(&m_lock, 1)) {}
+   }
+   void unlock()
+   {
+      __sync_lock_release(&m_lock);
+   }
+
+   T* m_chunks[MaxChunks];
+   bool m_fileBacked[MaxChunks];
+   size_t m_numChunks;
+   //For each kind of storage (in memory, file backed): the next unused handle in the
+   //kind's latest chunk, the end of that chunk, and the latest freed handle (the
+   //storage of a freed object holds the handle freed before it)
+   handle_t m_next[2];
+   handle_t m_end[2];
+   handle_t m_free[2];
+   volatile int m_lock;
+};
+
+template<class T>
+handle_t HandleArena<T>::alloc(bool fileBacked)
+{
+   lock();
+   handle_t h = m_free[fileBacked];
+   if(h != 0)
+   {
+      m_free[fileBacked] = *reinterpret_cast<handle_t*>(at(h));
+   }
+   else
+   {
+      if(m_next[fileBacked] == m_end[fileBacked])
+      {
+	 size_t bytes = ChunkSize*sizeof(T);
+	 void* chunk = NULL;
+	 if(m_numChunks < MaxChunks)
+	 {
+	    chunk = fileBacked ? static_cast<void*>(FileBackedAllocator::malloc(bytes)) : std::malloc(bytes);
+	 }
+	 if(chunk == NULL)
+	 {
+	    std::cerr << "HandleArena: could not allocate " << bytes << " more bytes" << (fileBacked ? " (file backed)" : "") << std::endl;
+	    std::exit(1);
+	 }
+	 m_chunks[m_numChunks] = static_cast<T*>(chunk);
+	 m_fileBacked[m_numChunks] = fileBacked;
+	 m_next[fileBacked] = handle_t(m_numChunks << ChunkBits);
+	 m_end[fileBacked] = handle_t((m_numChunks + 1) << ChunkBits);
+	 if(m_numChunks == 0)
+	 {
+	    m_next[fileBacked]++; //(handle 0 means none)
+	 }
+	 m_numChunks++;
+      }
+      h = m_next[fileBacked]++;
+   }
+   unlock();
+   return h;
+}
+
+template<class T>
+void HandleArena<T>::free(handle_t h)
+{
+   lock();
+   bool fileBacked = m_fileBacked[h >> ChunkBits];
+   *reinterpret_cast<handle_t*>(at(h)) = m_free[fileBacked];
+   m_free[fileBacked] = h;
+   unlock();
+}
+
+#endif
@@ -0,0 +1,92 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <streambuf>
+#include <boost/utility.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+/* A file mapped read-only into memory. The pages come from the page cache,
+   so every process that maps the same file shares one copy. */
+class MappedFile : boost::noncopyable
+{
+  private:
+   const char* addr; //NULL if the file could not be mapped
+   size_t length;
+
+  public:
+   MappedFile(const string& filename) :
+      addr(NULL),
+      length(0)
+   {
+      int fd = open(filename.c_str(), O_RDONLY);
+      if(fd < 0)
+      {
+	 return;
+      }
+
+      struct stat info;
+      if(fstat(fd, &info) == 0 && info.st_size > 0)
+      {
+	 void* p = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	 if(p != MAP_FAILED)
+	 {
+	    addr = static_cast<const char*>(p);
+	    length = info.st_size;
+	 }
+      }
+      close(fd); //The mapping stays valid
+   }
+
+   ~MappedFile()
+   {
+      if(addr)
+      {
+	 munmap(const_cast<char*>(addr), length);
+      }
+   }
+
+   bool isOpen() const
+   {
+      return addr != NULL;
+   }
+
+   //Page aligned
+   const char* data() const
+   {
+      return addr;
+   }
+
+   size_t size() const
+   {
+      return length;
+   }
+};
+
+/* A stream buffer reading from a block of memory (for parsing the headers of mapped files) */
+class MemoryBuffer : public streambuf
+{
+  public:
+   MemoryBuffer(const char* data, size_t size)
+   {
+      char* p = const_cast<char*>(data);
+      setg(p, p, p + size);
+   }
+
+   //How many bytes have been read
+   size_t position() const
+   {
+      return gptr() - eback();
+   }
+};
+
+#endif
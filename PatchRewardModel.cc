@@ -3,14 +3,30 @@ Author: Erik Talvitie
 ********************/
 
 #include "PatchRewardModel.h"
+#include "Checkpoint.h"
 
-PatchRewardModel::PatchRewardModel(int numActions, int width, int height, int patchWidth, int patchHeight, float stepSize) : numActions(numActions), width(width), height(height)
+#include <algorithm>
+#include <omp.h>
+
+//The weight of an example (for weighted regression)
+static inline float exampleWeight(const tuple<vector<int>, int, float>& example)
+{
+   return 1;
+}
+
+static inline float exampleWeight(const tuple<vector<int>, int, float, float>& example)
+{
+   return example.get<3>();
+}
+
+PatchRewardModel::PatchRewardModel(int numActions, int width, int height, int patchWidth, int patchHeight, float stepSize) : numActions(numActions), width(width), height(height), trainingMode(SERIAL), minibatchSize(64)
 {
    this->stepSize = stepSize/(width*height+1);
 
    numPatches = pow(3, patchWidth*patchHeight);   
+   numFeatures = width*height*numPatches + 1;
    
-   weights.resize(numActions);
+   weights.resize(numActions, vector<float>(numFeatures, 0));
    
    for(int r = 0; r < height; r++)
    {
@@ -35,6 +51,20 @@ PatchRewardModel::PatchRewardModel(int numActions, int width, int height, int pa
       }
    }   
 
+   pixelPatches.resize(width*height);
+   for(int p = 0; p < width*height; p++)
+   {
+      int placeValue = numPatches;
+      for(unsigned n = 0; n < neighborhoods[p].size(); n++)
+      {
+	 placeValue /= 3;
+	 if(neighborhoods[p][n] >= 0)
+	 {
+	    pixelPatches[neighborhoods[p][n]].push_back(make_pair(p, placeValue));
+	 }
+      }
+   }
+
    numExamples = 0;
 }
 
@@ -71,8 +101,15 @@ void PatchRewardModel::getActiveFeatures(int action, const vector<int>& obs, vec
    }
 }
 
+void PatchRewardModel::setTrainingMode(TrainingMode mode, int minibatchSize)
+{
+   trainingMode = mode;
+   this->minibatchSize = minibatchSize;
+}
+
 float PatchRewardModel::getReward(int action, const vector<int>& obs) const
 {
+   vector<int> activeFeatures;
    getActiveFeatures(action, obs, activeFeatures);
    return getRewardFromIndices(action, activeFeatures);
 }
@@ -83,125 +120,312 @@ float PatchRewardModel::getRewardFromIndices(int action, const vector<int>& acti
    
    for(unsigned i = 0; i < activeIndices.size(); i++)
    {
-      unordered_map<int, float>::const_iterator iter = weights[action].find(activeIndices[i]);
-      if(iter != weights[action].end())
-      {
-	 r += iter->second;
-      }
+      r += getWeight(action, activeIndices[i]);
    }
 
    return r;
 }
 
-double PatchRewardModel::batchUpdate(const vector<tuple<vector<int>, int, float> >& dataset)
+float PatchRewardModel::getWeight(int action, int index) const
 {
-   float sse = 0;
-   int count = 0;
+   return weights[action][index];
+}
 
-   for(unsigned d = 0; d < dataset.size(); d++)
+void PatchRewardModel::initFeatures(const vector<int>& obs, RewardFeatures& features) const
+{
+   features.obs = obs;
+   getActiveFeatures(0, obs, features.indices);
+   features.rewards.resize(numActions);
+   for(int a = 0; a < numActions; a++)
    {
-      count++;
-      const vector<int>& obs = dataset[d].get<0>();
-      int act = dataset[d].get<1>();
-      float r = dataset[d].get<2>();
-
-      getActiveFeatures(act, obs, activeFeatures);
-
-      float myR = getRewardFromIndices(act, activeFeatures);
+      features.rewards[a] = getRewardFromIndices(a, features.indices);
+   }
+}
 
-      float error = r - myR;
-      sse += error*error;
+void PatchRewardModel::updateFeatures(const vector<int>& obs, const vector<int>& changed, RewardFeatures& features) const
+{
+   for(unsigned i = 0; i < changed.size(); i++)
+   {
+      int pix = changed[i];
+      int delta = obs[pix] - features.obs[pix];
+      if(!delta)
+      {
+	 continue;
+      }
+      features.obs[pix] = obs[pix];
 
-      for(unsigned i = 0; i < activeFeatures.size(); i++)
+      //Shift the code of every patch that contains this pixel
+      //(indices[0] is the bias feature, so patch p is at p+1)
+      const vector<pair<int, int> >& patches = pixelPatches[pix];
+      for(unsigned n = 0; n < patches.size(); n++)
       {
-	 weights[act][activeFeatures[i]] += stepSize*error;
+	 int& index = features.indices[patches[n].first + 1];
+	 int newIndex = index + delta*patches[n].second;
+	 for(int a = 0; a < numActions; a++)
+	 {
+	    features.rewards[a] += getWeight(a, newIndex) - getWeight(a, index);
+	 }
+	 index = newIndex;
       }
    }
+}
 
-   return sse/count;
+float PatchRewardModel::getFeatureReward(int action, const RewardFeatures& features) const
+{
+   return features.rewards[action];
+}
+
+double PatchRewardModel::batchUpdate(const vector<tuple<vector<int>, int, float> >& dataset)
+{
+   return train(dataset);
 }
 
 double PatchRewardModel::batchUpdate(const vector<tuple<vector<int>, int, float, float> >& dataset)
 {
+   return train(dataset);
+}
+
+double PatchRewardModel::batchMSE(const vector<tuple<vector<int>, int, float> >& dataset)
+{
+   if(dataset.size() == 0)
+   {
+      return 0;
+   }
+
+   return squaredError(dataset)/dataset.size();
+}
+
+double PatchRewardModel::batchMSE(const vector<tuple<vector<int>, int, float, float> >& dataset)
+{
+   if(dataset.size() == 0)
+   {
+      return 0;
+   }
+
+   return squaredError(dataset)/dataset.size();
+}
+
+template<class Example>
+double PatchRewardModel::train(const vector<Example>& dataset)
+{
+   if(trainingMode == MINIBATCH)
+   {
+      return trainMinibatch(dataset);
+   }
+
    float sse = 0;
-   int count = 0;
+   int count = dataset.size();
 
-   for(unsigned d = 0; d < dataset.size(); d++)
+   if(trainingMode == SERIAL)
    {
-      count++;
-      const vector<int>& obs = dataset[d].get<0>();
-      int act = dataset[d].get<1>();
-      float r = dataset[d].get<2>();
+      vector<int> activeFeatures;
+      for(int d = 0; d < count; d++)
+      {
+	 const vector<int>& obs = dataset[d].template get<0>();
+	 int act = dataset[d].template get<1>();
+	 float r = dataset[d].template get<2>();
+	 float weight = exampleWeight(dataset[d]);
 
-      getActiveFeatures(act, obs, activeFeatures);
+	 getActiveFeatures(act, obs, activeFeatures);
 
-      float myR = getRewardFromIndices(act, activeFeatures);
+	 float myR = getRewardFromIndices(act, activeFeatures);
 
-      float error = r - myR;
-      sse += error*error*dataset[d].get<3>();
+	 float error = r - myR;
+	 sse += error*error*weight;
 
-      for(unsigned i = 0; i < activeFeatures.size(); i++)
+	 for(unsigned i = 0; i < activeFeatures.size(); i++)
+	 {
+	    weights[act][activeFeatures[i]] += stepSize*error*weight;
+	 }
+      }
+   }
+   else //Hogwild: each thread updates the shared weights without locking
+   {
+#pragma omp parallel
       {
-	 weights[act][activeFeatures[i]] += stepSize*error*dataset[d].get<3>();
+	 vector<int> activeFeatures;
+#pragma omp for schedule(dynamic, 64) reduction(+:sse)
+	 for(int d = 0; d < count; d++)
+	 {
+	    const vector<int>& obs = dataset[d].template get<0>();
+	    int act = dataset[d].template get<1>();
+	    float r = dataset[d].template get<2>();
+	    float weight = exampleWeight(dataset[d]);
+
+	    getActiveFeatures(act, obs, activeFeatures);
+
+	    float myR = getRewardFromIndices(act, activeFeatures);
+
+	    float error = r - myR;
+	    sse += error*error*weight;
+
+	    for(unsigned i = 0; i < activeFeatures.size(); i++)
+	    {
+	       weights[act][activeFeatures[i]] += stepSize*error*weight;
+	    }
+	 }
       }
    }
 
    return sse/count;
 }
 
-double PatchRewardModel::batchMSE(const vector<tuple<vector<int>, int, float> >& dataset)
+//One example's contribution to a minibatch's gradient
+struct Gradient
 {
-   float sse = 0;
-   int count = 0;
+   int action;
+   int feature;
+   float delta;
 
-   if(dataset.size() == 0)
-   {
-      return 0;
-   }
+   Gradient(int action, int feature, float delta) : action(action), feature(feature), delta(delta) {}
+};
 
-   for(unsigned d = 0; d < dataset.size(); d++)
+template<class Example>
+double PatchRewardModel::trainMinibatch(const vector<Example>& dataset)
+{
+   int count = dataset.size();
+   int numThreads = omp_get_max_threads();
+   vector<vector<Gradient> > gradients(numThreads);
+   vector<float> sqErrors(count);
+   //The summed steps and number of examples for each weight a minibatch touches
+   //(keyed by action*numFeatures + feature), and the weights in the order first touched
+   unordered_map<int, pair<float, int> > sums;
+   vector<int> touched;
+
+   for(int start = 0; start < count; start += minibatchSize)
    {
-      count++;
+      int end = min(start + minibatchSize, count);
+
+      //Each thread computes the errors of its share of the minibatch with the weights
+      //from the start of the minibatch and collects their gradients in its own buffer...
+#pragma omp parallel num_threads(numThreads)
+      {
+	 vector<Gradient>& gradient = gradients[omp_get_thread_num()];
+	 gradient.clear();
+	 vector<int> activeFeatures;
+#pragma omp for schedule(static)
+	 for(int d = start; d < end; d++)
+	 {
+	    const vector<int>& obs = dataset[d].template get<0>();
+	    int act = dataset[d].template get<1>();
+	    float r = dataset[d].template get<2>();
+	    float weight = exampleWeight(dataset[d]);
 
-      const vector<int>& obs = dataset[d].get<0>();
-      int act = dataset[d].get<1>();
-      float r = dataset[d].get<2>();
+	    getActiveFeatures(act, obs, activeFeatures);
 
-      getActiveFeatures(act, obs, activeFeatures);
+	    float error = r - getRewardFromIndices(act, activeFeatures);
+	    sqErrors[d] = error*error*weight;
+	    for(unsigned i = 0; i < activeFeatures.size(); i++)
+	    {
+	       gradient.push_back(Gradient(act, activeFeatures[i], stepSize*error*weight));
+	    }
+	 }
+      }
 
-      float myR = getRewardFromIndices(act, activeFeatures);
+      //...and then the buffers are summed per weight in thread order (the static schedule
+      //gives each thread a contiguous share, so this is example order, whatever the thread
+      //count). Each weight moves by the average of its examples' steps: summing them
+      //instead diverges, since every example moves the bias (and nearby examples share
+      //most of their patches) with the weights they were all computed from
+      for(int t = 0; t < numThreads; t++)
+      {
+	 for(unsigned g = 0; g < gradients[t].size(); g++)
+	 {
+	    int key = gradients[t][g].action*numFeatures + gradients[t][g].feature;
+	    pair<float, int>& sum = sums[key];
+	    if(sum.second == 0)
+	    {
+	       touched.push_back(key);
+	    }
+	    sum.first += gradients[t][g].delta;
+	    sum.second++;
+	 }
+      }
+      for(unsigned k = 0; k < touched.size(); k++)
+      {
+	 const pair<float, int>& sum = sums[touched[k]];
+	 weights[touched[k]/numFeatures][touched[k]%numFeatures] += sum.first/sum.second;
+      }
+      sums.clear();
+      touched.clear();
+   }
 
-      float error = r - myR;
-      sse += error*error;
+   float sse = 0;
+   for(int d = 0; d < count; d++)
+   {
+      sse += sqErrors[d];
    }
+
    return sse/count;
 }
 
-double PatchRewardModel::batchMSE(const vector<tuple<vector<int>, int, float, float> >& dataset)
+template<class Example>
+double PatchRewardModel::squaredError(const vector<Example>& dataset) const
 {
-   float sse = 0;
-   int count = 0;
+   int count = dataset.size();
+   double sse = 0;
 
-   if(dataset.size() == 0)
+#pragma omp parallel
    {
-      return 0;
-   }
+      vector<int> activeFeatures;
+#pragma omp for schedule(static) reduction(+:sse)
+      for(int d = 0; d < count; d++)
+      {
+	 const vector<int>& obs = dataset[d].template get<0>();
+	 int act = dataset[d].template get<1>();
+	 float r = dataset[d].template get<2>();
 
-   for(unsigned d = 0; d < dataset.size(); d++)
-   {
-      count++;
+	 getActiveFeatures(act, obs, activeFeatures);
 
-      const vector<int>& obs = dataset[d].get<0>();
-      int act = dataset[d].get<1>();
-      float r = dataset[d].get<2>();
+	 float myR = getRewardFromIndices(act, activeFeatures);
 
-      getActiveFeatures(act, obs, activeFeatures);
+	 float error = r - myR;
+	 sse += error*error*exampleWeight(dataset[d]);
+      }
+   }
 
-      float myR = getRewardFromIndices(act, activeFeatures);
+   return sse;
+}
 
-      float error = r - myR;
-      sse += error*error*dataset[d].get<3>();
+void PatchRewardModel::save(ostream& out) const
+{
+   writeCheckpointHeader(out, "PRWM");
+   writeBinary(out, boost::int32_t(numActions));
+   writeBinary(out, boost::int32_t(width));
+   writeBinary(out, boost::int32_t(height));
+   writeBinary(out, boost::int32_t(numPatches));
+   writeBinary(out, boost::int32_t(numFeatures));
+   writeBinary(out, boost::int32_t(numExamples));
+   for(int a = 0; a < numActions; a++)
+   {
+      writeBinary(out, &weights[a][0], numFeatures);
    }
+}
 
-   return sse/count;
+bool PatchRewardModel::load(istream& in)
+{
+   boost::int32_t savedExamples;
+   if(!readCheckpointHeader(in, "PRWM") ||
+      !readMatching(in, boost::int32_t(numActions)) ||
+      !readMatching(in, boost::int32_t(width)) ||
+      !readMatching(in, boost::int32_t(height)) ||
+      !readMatching(in, boost::int32_t(numPatches)) ||
+      !readMatching(in, boost::int32_t(numFeatures)) ||
+      !readBinary(in, savedExamples))
+   {
+      return false;
+   }
+
+   vector<vector<float> > savedWeights(numActions, vector<float>(numFeatures));
+   for(int a = 0; a < numActions; a++)
+   {
+      if(!readBinary(in, &savedWeights[a][0], numFeatures))
+      {
+	 return false;
+      }
+   }
+
+   weights.swap(savedWeights);
+   numExamples = savedExamples;
+   return true;
 }
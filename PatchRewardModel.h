@@ -21,6 +21,16 @@ using namespace boost;
  */
 class PatchRewardModel : public RewardModel
 {
+  public:
+   //How batchUpdate spreads its work across threads
+   enum TrainingMode
+   {
+      SERIAL,    //Plain stochastic gradient descent
+      HOGWILD,   //Lock-free parallel SGD (threads race on the shared weights)
+      MINIBATCH  //The gradients of each minibatch computed in parallel, then each weight moved
+                 //by the average of its examples' steps (deterministic)
+   };
+
   protected:
    int numActions;
    int width;
@@ -29,14 +39,23 @@ class PatchRewardModel : public RewardModel
 
    int numExamples;
    
+   TrainingMode trainingMode;
+   int minibatchSize;
+
    int numPatches;
-   vector<unordered_map<int, float> > weights;
+   int numFeatures;
+   vector<vector<float> > weights; //Dense, one weight per action and feature
    vector<vector<int> > neighborhoods;
-
-   mutable vector<int> activeFeatures;
+   //For each pixel, the patches it appears in and its place value in their codes
+   vector<vector<pair<int, int> > > pixelPatches;
    
    virtual void getActiveFeatures(int action, const vector<int>& obs, vector<int>& indices) const;
    virtual float getRewardFromIndices(int action, const vector<int>& activeIndices) const;
+   float getWeight(int action, int index) const;
+
+   template<class Example> double train(const vector<Example>& dataset);
+   template<class Example> double trainMinibatch(const vector<Example>& dataset);
+   template<class Example> double squaredError(const vector<Example>& dataset) const;
    
   public:
    //numActions: the number of actions
@@ -47,8 +66,17 @@ class PatchRewardModel : public RewardModel
    //stepSize: the step-size parameter to use in stochastic gradient descent
    PatchRewardModel(int numActions, int width, int height, int patchWidth, int patchHeight, float stepSize);
 
+   //Selects serial, Hogwild, or minibatch training (serial by default)
+   void setTrainingMode(TrainingMode mode, int minibatchSize = 64);
+
    virtual float getReward(int action, const vector<int>& obs) const;
 
+   //Keeps the active features and the reward for every action up to date
+   //so that each step only costs time proportional to the changed pixels
+   virtual void initFeatures(const vector<int>& obs, RewardFeatures& features) const;
+   virtual void updateFeatures(const vector<int>& obs, const vector<int>& changed, RewardFeatures& features) const;
+   virtual float getFeatureReward(int action, const RewardFeatures& features) const;
+
    //The elements of the tuple are:
    //The input features
    //The action
@@ -60,6 +88,13 @@ class PatchRewardModel : public RewardModel
 
    virtual double batchMSE(const vector<tuple<vector<int>, int, float, float> >& dataset);
    virtual double batchMSE(const vector<tuple<vector<int>, int, float> >& dataset);
+
+   //Writes the weights in binary, along with the geometry they go with (see Checkpoint.h)
+   void save(ostream& out) const;
+   //Replaces the weights with ones written by save
+   //Returns false (leaving the weights as they were) if the file was written by
+   //a model with a different number of actions, image size, or patch size
+   bool load(istream& in);
 };
 
 #endif
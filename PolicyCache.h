@@ -0,0 +1,203 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef POLICY_CACHE
+#define POLICY_CACHE
+
+#include "BitFrame.h"
+
+#include <vector>
+#include <algorithm>
+#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
+#include <omp.h>
+
+using namespace std;
+using namespace boost;
+
+/*Remembers the action assigned to each state.
+The theory is for a version of one-ply MC that generates an action
+for each state, not a new action each time a state is visited.
+States are keyed by the whole packed frame (the fingerprint is
+only used to find candidates), so collisions cannot return
+the wrong action. The cache is split into shards with their own
+locks so threads generating samples can share it.
+Each entry is tagged with the generation it was made in. Starting a new
+generation (e.g. when the models change) invalidates the old entries,
+which are then dropped lazily. The number of entries is bounded: when
+a shard is full the stale entries are dropped, then half of the others.*/
+class PolicyCache
+{
+  private:
+   struct Entry
+   {
+      BitFrame frame;
+      int action;
+      int generation;
+   };
+
+   struct Shard
+   {
+      unordered_multimap<boost::uint64_t, Entry> entries; //Keyed by fingerprint
+      omp_lock_t lock;
+   };
+
+   static const int NumShards = 64;
+
+   vector<Shard> shards;
+   int shardCapacity;
+   int generation;
+
+   Shard& getShard(boost::uint64_t fingerprint);
+   //Makes room for an entry in a full shard (the shard must be locked)
+   void evict(Shard& shard);
+
+   //Not copyable (because of the locks)
+   PolicyCache(const PolicyCache&);
+   PolicyCache& operator=(const PolicyCache&);
+
+  public:
+   PolicyCache(int maxEntries = 1 << 18);
+   ~PolicyCache();
+
+   //If the state has been assigned an action in this generation,
+   //fills it in and returns true
+   bool lookup(const BitFrame& state, int& action);
+   //Assigns the action to the state, unless another thread got there first
+   //(in which case action is replaced with the one already assigned)
+   void insert(const BitFrame& state, int& action);
+
+   //Invalidates all the current entries
+   //(not safe to call while other threads are using the cache)
+   void newGeneration();
+
+   //Number of entries stored (including stale ones not yet dropped)
+   int size() const;
+};
+
+inline PolicyCache::PolicyCache(int maxEntries) :
+   shards(NumShards),
+   shardCapacity(max(maxEntries/NumShards, 1)),
+   generation(0)
+{
+   for(int s = 0; s < NumShards; s++)
+   {
+      omp_init_lock(&shards[s].lock);
+   }
+}
+
+inline PolicyCache::~PolicyCache()
+{
+   for(int s = 0; s < NumShards; s++)
+   {
+      omp_destroy_lock(&shards[s].lock);
+   }
+}
+
+inline PolicyCache::Shard& PolicyCache::getShard(boost::uint64_t fingerprint)
+{
+   return shards[fingerprint >> 58]; //The top 6 bits pick one of the 64 shards
+}
+
+inline bool PolicyCache::lookup(const BitFrame& state, int& action)
+{
+   boost::uint64_t fingerprint = state.fingerprint();
+   Shard& shard = getShard(fingerprint);
+
+   bool found = false;
+   omp_set_lock(&shard.lock);
+   typedef unordered_multimap<boost::uint64_t, Entry>::const_iterator Iterator;
+   pair<Iterator, Iterator> range = shard.entries.equal_range(fingerprint);
+   for(Iterator it = range.first; it != range.second; ++it)
+   {
+      if(it->second.generation == generation && it->second.frame == state)
+      {
+	 action = it->second.action;
+	 found = true;
+	 break;
+      }
+   }
+   omp_unset_lock(&shard.lock);
+   return found;
+}
+
+inline void PolicyCache::insert(const BitFrame& state, int& action)
+{
+   boost::uint64_t fingerprint = state.fingerprint();
+   Shard& shard = getShard(fingerprint);
+
+   omp_set_lock(&shard.lock);
+   typedef unordered_multimap<boost::uint64_t, Entry>::iterator Iterator;
+   pair<Iterator, Iterator> range = shard.entries.equal_range(fingerprint);
+   Iterator it = range.first;
+   while(it != range.second && it->second.frame != state)
+   {
+      ++it;
+   }
+
+   if(it == range.second)
+   {
+      if(int(shard.entries.size()) >= shardCapacity)
+      {
+	 evict(shard);
+      }
+      Entry entry;
+      entry.frame = state;
+      entry.action = action;
+      entry.generation = generation;
+      shard.entries.insert(make_pair(fingerprint, entry));
+   }
+   else if(it->second.generation != generation) //Replace the stale entry
+   {
+      it->second.action = action;
+      it->second.generation = generation;
+   }
+   else
+   {
+      action = it->second.action;
+   }
+   omp_unset_lock(&shard.lock);
+}
+
+inline void PolicyCache::evict(Shard& shard)
+{
+   typedef unordered_multimap<boost::uint64_t, Entry>::iterator Iterator;
+   for(Iterator it = shard.entries.begin(); it != shard.entries.end();)
+   {
+      if(it->second.generation != generation)
+      {
+	 it = shard.entries.erase(it);
+      }
+      else
+      {
+	 ++it;
+      }
+   }
+
+   if(int(shard.entries.size()) >= shardCapacity)
+   {
+      int numEvicted = int(shard.entries.size()) - shardCapacity/2;
+      for(Iterator it = shard.entries.begin(); numEvicted > 0 && it != shard.entries.end(); numEvicted--)
+      {
+	 it = shard.entries.erase(it);
+      }
+   }
+}
+
+inline void PolicyCache::newGeneration()
+{
+   generation++;
+}
+
+inline int PolicyCache::size() const
+{
+   int total = 0;
+   for(int s = 0; s < NumShards; s++)
+   {
+      total += shards[s].entries.size();
+   }
+   return total;
+}
+
+#endif
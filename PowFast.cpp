@@ -11,6 +11,7 @@
 #include <cmath>
 
 #include "PowFast.hpp"
+#include "SIMD.h"
 
 
 
@@ -100,6 +101,46 @@ float powFastLookup
    return pun.i = it,  pun.f;
 }
 
+
+#ifdef SIMD_AVX2
+/**
+ * powFastLookup of as many multiples of 8 values as there are.
+ *
+ * @return  how many were done
+ */
+SIMD_TARGET_AVX2
+unsigned int powFastLookupAVX2
+(
+   const float*        pVals,
+   float*              pResults,
+   const unsigned int  count,
+   const float         ilog2,
+   const unsigned int* pTable,
+   const unsigned int  precision
+)
+{
+   const __m256  scale    = _mm256_set1_ps( _2p23 * ilog2 );
+   const __m256  bias     = _mm256_set1_ps( 127.0f * _2p23 );
+   const __m256i expMask  = _mm256_set1_epi32( int(0xFF800000) );
+   const __m256i manMask  = _mm256_set1_epi32( 0x7FFFFF );
+   const __m128i shift    = _mm_cvtsi32_si128( 23 - precision );
+
+   unsigned int n = 0;
+   for( ;  n + 8 <= count;  n += 8 )
+   {
+      // build float bits
+      const __m256i i = _mm256_cvttps_epi32( _mm256_add_ps(
+         _mm256_mul_ps( _mm256_loadu_ps( pVals + n ), scale ), bias ) );
+      // replace mantissa with lookup
+      const __m256i index = _mm256_srl_epi32( _mm256_and_si256( i, manMask ), shift );
+      const __m256i it    = _mm256_or_si256( _mm256_and_si256( i, expMask ),
+         _mm256_i32gather_epi32( reinterpret_cast<const int*>( pTable ), index, 4 ) );
+      _mm256_storeu_ps( pResults + n, _mm256_castsi256_ps( it ) );
+   }
+   return n;
+}
+#endif
+
 }
 
 
@@ -140,6 +181,29 @@ float PowFast::e
 }
 
 
+void PowFast::e
+(
+   const float*       pNumbers,
+   float*             pResults,
+   const unsigned int count
+) const
+{
+   const float ilog2 = 1.44269504088896f;
+
+   unsigned int n = 0;
+#ifdef SIMD_AVX2
+   if( haveAVX2() )
+   {
+      n = powFastLookupAVX2( pNumbers, pResults, count, ilog2, pTable_m, precision_m );
+   }
+#endif
+   for( ;  n < count;  ++n )
+   {
+      pResults[n] = powFastLookup( pNumbers[n], ilog2, pTable_m, precision_m );
+   }
+}
+
+
 float PowFast::ten
 (
    const float f
@@ -37,6 +37,15 @@ public:
            /** e ^ number. Number must be > -87.3ish and < +88.7ish. */
            float e  ( float )                                             const;
 
+           /**
+            * e ^ number for each of count numbers (8 at a time when the
+            * processor has AVX2). Same results as e( float ), and the
+            * results may overwrite the numbers.
+            */
+           void  e  ( const float* pNumbers,
+                      float*       pResults,
+                      unsigned int count )                                const;
+
            /** 10 ^ number. Number must be > -37.9ish and < +38.5ish. */
            float ten( float )                                             const;
 
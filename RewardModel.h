@@ -5,6 +5,8 @@ Author: Erik Talvitie
 #ifndef REWARD_MODEL_H
 #define REWARD_MODEL_H
 
+#include "BitFrame.h"
+
 #include <boost/unordered_map.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <vector>
@@ -13,11 +15,31 @@ Author: Erik Talvitie
 using namespace std;
 using namespace boost;
 
+/* Cached state for evaluating rewards along a trajectory,
+   where consecutive frames differ in only a few pixels */
+struct RewardFeatures
+{
+   vector<int> obs;        //The frame the features describe
+   vector<int> indices;    //Active feature indices (model specific)
+   vector<float> rewards;  //Running reward for each action (model specific)
+   BitFrame frame;         //The frame, packed (for models that score packed frames)
+};
+
 class RewardModel
 {
   public:
+   virtual ~RewardModel(){}
+
    virtual float getReward(int action, const vector<int>& obs) const = 0;
 
+   //Incremental evaluation along a trajectory
+   //initFeatures computes the features of obs from scratch
+   //updateFeatures moves them to obs, given the pixels that changed since the last frame
+   //By default the features are just the frame itself
+   virtual void initFeatures(const vector<int>& obs, RewardFeatures& features) const;
+   virtual void updateFeatures(const vector<int>& obs, const vector<int>& changed, RewardFeatures& features) const;
+   virtual float getFeatureReward(int action, const RewardFeatures& features) const;
+
    //The elements of the tuple are:
    //The input features
    //The action
@@ -31,4 +53,22 @@ class RewardModel
    virtual double batchMSE(const vector<tuple<vector<int>, int, float> >& dataset) = 0;
 };
 
+inline void RewardModel::initFeatures(const vector<int>& obs, RewardFeatures& features) const
+{
+   features.obs = obs;
+}
+
+inline void RewardModel::updateFeatures(const vector<int>& obs, const vector<int>& changed, RewardFeatures& features) const
+{
+   for(unsigned i = 0; i < changed.size(); i++)
+   {
+      features.obs[changed[i]] = obs[changed[i]];
+   }
+}
+
+inline float RewardModel::getFeatureReward(int action, const RewardFeatures& features) const
+{
+   return getReward(action, features.obs);
+}
+
 #endif
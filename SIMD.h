@@ -0,0 +1,31 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+/* Support for the AVX2 versions of the batch math routines (in icsilog.cpp,
+   PowFast.cpp and jacoblog.hpp). Those functions are compiled for AVX2 with
+   a target attribute, so the rest of the program keeps the default
+   instruction set, and they are only called if the processor has AVX2.
+   Elsewhere the batch routines loop over the scalar ones. */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_AVX2 1
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+//Checked once
+inline bool haveAVX2()
+{
+#ifdef SIMD_AVX2
+   static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+   return avx2;
+#else
+   return false;
+#endif
+}
+
+#endif
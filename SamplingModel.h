@@ -6,6 +6,8 @@ Date: 2016
 #ifndef SAMPLING_MODEL
 #define SAMPLING_MODEL
 
+#include "BitFrame.h"
+
 #include <vector>
 #include <set>
 
@@ -27,6 +29,9 @@ class SamplingModel
    //Should sample a transation and update the state accordingly
    //Fills in obs, reward, and endEpisode with the sampled values
    virtual void takeAction(actObs_t act, vector<actObs_t>& obs, int& reward, bool& endEpisode) = 0;
+   //Also keeps frame (which must hold the current contents of obs) up to date
+   //and lists the pixels that changed (by default, by comparing them all)
+   virtual void takeAction(actObs_t act, vector<actObs_t>& obs, BitFrame& frame, vector<int>& changed, int& reward, bool& endEpisode);
 
    //Reset the model to its initial state
    virtual void reset() = 0;
@@ -36,6 +41,12 @@ class SamplingModel
    //Reset the model to the saved state
    virtual void retrieveState() = 0;
 
+   //Called when every action is about to be taken from the current state (as
+   //in one-ply Monte Carlo), so a model can prepare for them all at once
+   virtual void expectEveryAction() {}
+   //The same, given the current observation packed
+   virtual void expectEveryAction(const BitFrame& frame) {expectEveryAction();}
+
    virtual int getNumActs();
    virtual int getObsDim();
 };
@@ -47,6 +58,21 @@ SamplingModel<actObs_t>::SamplingModel(int numActs, int numDim) :
 {
 }
 
+template <class actObs_t>
+void SamplingModel<actObs_t>::takeAction(actObs_t act, vector<actObs_t>& obs, BitFrame& frame, vector<int>& changed, int& reward, bool& endEpisode)
+{
+   takeAction(act, obs, reward, endEpisode);
+   changed.clear();
+   for(unsigned p = 0; p < obs.size(); p++)
+   {
+      if(frame.get(p) != bool(obs[p]))
+      {
+	 changed.push_back(p);
+	 frame.flip(p);
+      }
+   }
+}
+
 template <class actObs_t>
 int SamplingModel<actObs_t>::getNumActs()
 {
@@ -11,7 +11,9 @@ ShooterModel::ShooterModel(int numTargets, int height, bool movingSweetSpot) :
    width(numTargets*5),
    height(height),
    movingSweetSpot(movingSweetSpot),
-   targets(numTargets, 0)
+   targets(numTargets, 0),
+   lastObs(height*numTargets*5, 0),
+   frame(height*numTargets*5)
 {
    reset();
 }
@@ -185,9 +187,40 @@ void ShooterModel::takeAction(int act, vector<int>& obs, int& reward, bool& endE
       obs[(height - 2)*width + shipPos + 1] = 1;
    }
 
+   //Only the pixels that changed need to be rehashed
+   changedPixels.clear();
+   for(int p = 0; p < this->numDim; p++)
+   {
+      if(obs[p] != lastObs[p])
+      {
+	 changedPixels.push_back(p);
+	 frame.flip(p);
+      }
+   }
+
    lastObs = obs;
 }
 
+void ShooterModel::takeAction(int action, vector<int>& obs, BitFrame& frame, vector<int>& changed, int& reward, bool& endEpisode)
+{
+   takeAction(action, obs, reward, endEpisode);
+   changed = changedPixels;
+   for(unsigned i = 0; i < changed.size(); i++)
+   {
+      frame.flip(changed[i]);
+   }
+}
+
+const BitFrame& ShooterModel::getFrame() const
+{
+   return frame;
+}
+
+const vector<int>& ShooterModel::getChangedPixels() const
+{
+   return changedPixels;
+}
+
 void ShooterModel::saveState()
 {
    savedShipPos = shipPos;
@@ -196,6 +229,7 @@ void ShooterModel::saveState()
    savedBullets = bullets;
 
    savedLastObs = lastObs;
+   savedFrame = frame;
 }
 
 void ShooterModel::retrieveState()
@@ -206,4 +240,5 @@ void ShooterModel::retrieveState()
    bullets = savedBullets;
 
    lastObs = savedLastObs;
+   frame = savedFrame;
 }
@@ -6,6 +6,7 @@ Author: Erik Talvitie
 #define SHOOTER_MODEL
 
 #include "SamplingModel.h"
+#include "BitFrame.h"
 
 class ShooterModel : public SamplingModel<int>
 {
@@ -20,6 +21,8 @@ class ShooterModel : public SamplingModel<int>
    vector<pair<int, int> > bullets;
 
    vector<int> lastObs;
+   BitFrame frame;            //lastObs, packed (and fingerprinted) incrementally
+   vector<int> changedPixels; //The pixels that changed in the last step
 
    int savedShipPos;
    vector<int> savedTargets;
@@ -27,6 +30,7 @@ class ShooterModel : public SamplingModel<int>
    vector<pair<int, int> > savedBullets;
 
    vector<int> savedLastObs;
+   BitFrame savedFrame;
 
   public:
    ShooterModel(int numTargets, int height, bool movingSweetSpot = false);
@@ -39,10 +43,18 @@ class ShooterModel : public SamplingModel<int>
    //(In these experiments, the reward function is known and episodes have
    //fixed length so it is better to get these values externally).
    void takeAction(int action, vector<int>& obs, int& reward, bool& endEpisode);
+   //The changed pixels are the ones the game lists (see getChangedPixels)
+   void takeAction(int action, vector<int>& obs, BitFrame& frame, vector<int>& changed, int& reward, bool& endEpisode);
 
    //Reset the game to its initial state
    void reset();
 
+   //The last observation, packed
+   //(its fingerprint can be used as a key for the state)
+   const BitFrame& getFrame() const;
+   //The pixels that changed in the last call to takeAction
+   const vector<int>& getChangedPixels() const;
+
    //Save the games's state for later retrieval
    void saveState();
    //Reset the game to the saved state
@@ -4,6 +4,47 @@ Author: Erik Talvitie
 
 #include "ShooterRewardModel.h"
 
+//The 3x3 explosion patterns, read row by row from the top left,
+//with the first pixel in the highest bit
+static const int ExplosionCode = 0x155; //101 010 101
+static const int BullseyeCode = 0xAA;   //010 101 010
+
+ShooterRewardModel::ShooterRewardModel(int numTargets, int height) :
+   numTargets(numTargets),
+   width(numTargets*5),
+   targetCorners(numTargets),
+   targetMasks(numTargets)
+{
+   for(int target = 0; target < numTargets; target++)
+   {
+      //Targets occupy rows 2-4, with a blank column on either side
+      targetCorners[target] = 2*width + target*5 + 1;
+
+      for(int i = 0; i < 9; i++)
+      {
+	 int pix = targetCorners[target] + (i/3)*width + i%3;
+	 int word = pix >> 6;
+	 boost::uint64_t bit = boost::uint64_t(1) << (pix & 63);
+
+	 vector<TargetMask>& masks = targetMasks[target];
+	 if(masks.empty() || masks.back().word != word)
+	 {
+	    TargetMask m = {word, 0, 0, 0};
+	    masks.push_back(m);
+	 }
+	 masks.back().mask |= bit;
+	 if((ExplosionCode >> (8 - i)) & 1)
+	 {
+	    masks.back().explosion |= bit;
+	 }
+	 if((BullseyeCode >> (8 - i)) & 1)
+	 {
+	    masks.back().bullseye |= bit;
+	 }
+      }
+   }
+}
+
 float ShooterRewardModel::getReward(int action, const vector<int>& obs) const
 {
    int r = 0;
@@ -12,19 +53,51 @@ float ShooterRewardModel::getReward(int action, const vector<int>& obs) const
       r -= 1;
    }
 
-   for(int target = 0; target < 3; target++)
+   for(int target = 0; target < numTargets; target++)
    {
-      int bottomLeft = 4*15 + target*5 + 1;
-      if(obs[bottomLeft] && !obs[bottomLeft + 1] && obs[bottomLeft + 2] && 
-	 !obs[bottomLeft - 15] && obs[bottomLeft - 14] && !obs[bottomLeft - 13] &&
-	 obs[bottomLeft-30] && !obs[bottomLeft-29] && obs[bottomLeft-28])
+      int code = 0;
+      for(int i = 0; i < 9; i++)
+      {
+	 code = (code << 1) | (obs[targetCorners[target] + (i/3)*width + i%3] ? 1 : 0);
+      }
+
+      if(code == ExplosionCode)
       {
 	 r += 10;
       }
+      else if(code == BullseyeCode)
+      {
+	 r += 20;
+      }
+   }
+   return r;
+}
+
+float ShooterRewardModel::getReward(int action, const BitFrame& frame) const
+{
+   int r = 0;
+   if(action == 3)
+   {
+      r -= 1;
+   }
+
+   for(int target = 0; target < numTargets; target++)
+   {
+      const vector<TargetMask>& masks = targetMasks[target];
+      bool explosion = true;
+      bool bullseye = true;
+      for(unsigned m = 0; m < masks.size(); m++)
+      {
+	 boost::uint64_t box = frame.word(masks[m].word) & masks[m].mask;
+	 explosion = explosion && box == masks[m].explosion;
+	 bullseye = bullseye && box == masks[m].bullseye;
+      }
 
-      if(!obs[bottomLeft] && obs[bottomLeft + 1] && !obs[bottomLeft + 2] && 
-	 obs[bottomLeft - 15] && !obs[bottomLeft - 14] && obs[bottomLeft - 13] &&
-	 !obs[bottomLeft-30] && obs[bottomLeft-29] && !obs[bottomLeft-28])
+      if(explosion)
+      {
+	 r += 10;
+      }
+      else if(bullseye)
       {
 	 r += 20;
       }
@@ -32,10 +105,43 @@ float ShooterRewardModel::getReward(int action, const vector<int>& obs) const
    return r;
 }
 
+void ShooterRewardModel::getRewards(const vector<int>& actions, const vector<BitFrame>& frames, vector<float>& rewards) const
+{
+   int numFrames = frames.size();
+   rewards.resize(numFrames);
+
+#pragma omp parallel for schedule(static)
+   for(int f = 0; f < numFrames; f++)
+   {
+      rewards[f] = getReward(actions[f], frames[f]);
+   }
+}
+
+void ShooterRewardModel::initFeatures(const vector<int>& obs, RewardFeatures& features) const
+{
+   features.frame.pack(obs);
+}
+
+void ShooterRewardModel::updateFeatures(const vector<int>& obs, const vector<int>& changed, RewardFeatures& features) const
+{
+   for(unsigned i = 0; i < changed.size(); i++)
+   {
+      features.frame.set(changed[i], obs[changed[i]]);
+   }
+}
+
+float ShooterRewardModel::getFeatureReward(int action, const RewardFeatures& features) const
+{
+   return getReward(action, features.frame);
+}
+
 double ShooterRewardModel::batchMSE(const vector<tuple<vector<int>, int, float, float> >& dataset)
 {
+   int count = dataset.size();
    double sse = 0;
-   for(unsigned d = 0; d < dataset.size(); d++)
+
+#pragma omp parallel for schedule(static) reduction(+:sse)
+   for(int d = 0; d < count; d++)
    {
       float r = getReward(dataset[d].get<1>(), dataset[d].get<0>());
       float realR = dataset[d].get<2>();
@@ -46,8 +152,11 @@ double ShooterRewardModel::batchMSE(const vector<tuple<vector<int>, int, float,
 
 double ShooterRewardModel::batchMSE(const vector<tuple<vector<int>, int, float> >& dataset)
 {
+   int count = dataset.size();
    double sse = 0;
-   for(unsigned d = 0; d < dataset.size(); d++)
+
+#pragma omp parallel for schedule(static) reduction(+:sse)
+   for(int d = 0; d < count; d++)
    {
       float r = getReward(dataset[d].get<1>(), dataset[d].get<0>());
       float realR = dataset[d].get<2>();
@@ -6,9 +6,11 @@ Author: Erik Talvitie
 #define SHOOTER_REWARD_MODEL_H
 
 #include "RewardModel.h"
+#include "BitFrame.h"
 
 #include <boost/unordered_map.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/cstdint.hpp>
 #include <vector>
 #include <iostream>
 
@@ -18,8 +20,40 @@ using namespace boost;
 /* A perfect reward model for the Shooter problem */
 class ShooterRewardModel : public RewardModel
 {
+  private:
+   int numTargets;
+   int width;
+
+   //The pixel at the top left of each target's 3x3 box
+   vector<int> targetCorners;
+
+   //The part of a target's 3x3 box that falls in one word of a packed frame
+   struct TargetMask
+   {
+      int word;
+      boost::uint64_t mask;       //The box's pixels
+      boost::uint64_t explosion;  //The regular explosion (corners and center)
+      boost::uint64_t bullseye;   //The special explosion (edge midpoints)
+   };
+   //For each target, its masks (usually one, two if the box straddles a word boundary)
+   vector<vector<TargetMask> > targetMasks;
+
   public:
+   //numTargets and height describe the frames, as in ShooterModel
+   //(the targets always sit in rows 2-4, so only the width depends on them)
+   ShooterRewardModel(int numTargets = 3, int height = 15);
+
    virtual float getReward(int action, const vector<int>& obs) const;
+   //Scores a packed frame with one mask-and-compare per target
+   float getReward(int action, const BitFrame& frame) const;
+   //Scores many packed frames at once
+   void getRewards(const vector<int>& actions, const vector<BitFrame>& frames, vector<float>& rewards) const;
+
+   //Along a trajectory only the packed frame is kept (each step flips the changed
+   //pixels) and scored with the packed kernel
+   virtual void initFeatures(const vector<int>& obs, RewardFeatures& features) const;
+   virtual void updateFeatures(const vector<int>& obs, const vector<int>& changed, RewardFeatures& features) const;
+   virtual float getFeatureReward(int action, const RewardFeatures& features) const;
 
    virtual double batchUpdate(const vector<tuple<vector<int>, int, float> >& dataset){return 0;}
    virtual double batchUpdate(const vector<tuple<vector<int>, int, float, float> >& dataset){return 0;}
@@ -0,0 +1,217 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef TRANSITION_CACHE
+#define TRANSITION_CACHE
+
+#include "BitFrame.h"
+
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
+#include <omp.h>
+
+using namespace std;
+using namespace boost;
+
+/*Remembers the per-pixel probabilities a model samples the next frame from,
+for each (previous frame, action) pair. Frames are compared in full (the
+fingerprint is only used to find candidates).
+Entries are tagged with the generation they were computed in; starting a new
+generation (whenever the model learns) invalidates all of them. The memory used
+is bounded: once it is full the least recently used entries are dropped.
+The cache is split into shards with their own locks, so copies of a model
+used by different threads can share it.*/
+class TransitionCache
+{
+  private:
+   struct Entry
+   {
+      BitFrame frame;
+      int action;
+      int generation;
+      vector<float> probs;
+   };
+
+   struct Shard
+   {
+      list<Entry> entries; //Most recently used first
+      unordered_multimap<boost::uint64_t, list<Entry>::iterator> index;
+      omp_lock_t lock;
+   };
+
+   static const int NumShards = 16;
+
+   vector<Shard> shards;
+   size_t maxBytes;
+   int shardCapacity;
+   int generation;
+
+   static boost::uint64_t key(const BitFrame& frame, int action);
+   Shard& getShard(boost::uint64_t k);
+   //Finds the entry for the frame and action in a (locked) shard
+   list<Entry>::iterator find(Shard& shard, boost::uint64_t k, const BitFrame& frame, int action);
+   //Removes an entry from a (locked) shard
+   void erase(Shard& shard, boost::uint64_t k, list<Entry>::iterator entry);
+
+   //Not copyable (because of the locks)
+   TransitionCache(const TransitionCache&);
+   TransitionCache& operator=(const TransitionCache&);
+
+  public:
+   //numPixels is the size of the frames (and of each probability vector)
+   TransitionCache(size_t maxBytes, int numPixels);
+   ~TransitionCache();
+
+   //If the probabilities for the frame and action have been computed in this
+   //generation, copies them into probs and returns true
+   bool lookup(const BitFrame& frame, int action, vector<float>& probs);
+   void insert(const BitFrame& frame, int action, const vector<float>& probs);
+
+   //Invalidates all the current entries
+   //(not safe to call while other threads are using the cache)
+   void newGeneration();
+
+   size_t getMaxBytes() const;
+   int size() const;
+};
+
+inline TransitionCache::TransitionCache(size_t maxBytes, int numPixels) :
+   shards(NumShards),
+   maxBytes(maxBytes),
+   generation(0)
+{
+   //Approximate footprint of an entry: the probabilities, the packed frame, and list/index overhead
+   size_t entryBytes = sizeof(Entry) + numPixels*sizeof(float) + (numPixels + 63)/64*sizeof(boost::uint64_t) + 64;
+   shardCapacity = max(int(maxBytes/entryBytes/NumShards), 1);
+
+   for(int s = 0; s < NumShards; s++)
+   {
+      omp_init_lock(&shards[s].lock);
+   }
+}
+
+inline TransitionCache::~TransitionCache()
+{
+   for(int s = 0; s < NumShards; s++)
+   {
+      omp_destroy_lock(&shards[s].lock);
+   }
+}
+
+inline boost::uint64_t TransitionCache::key(const BitFrame& frame, int action)
+{
+   return frame.fingerprint() ^ (boost::uint64_t(action + 1)*0x9E3779B97F4A7C15ULL);
+}
+
+inline TransitionCache::Shard& TransitionCache::getShard(boost::uint64_t k)
+{
+   return shards[k >> 60]; //The top 4 bits pick one of the 16 shards
+}
+
+inline list<TransitionCache::Entry>::iterator TransitionCache::find(Shard& shard, boost::uint64_t k, const BitFrame& frame, int action)
+{
+   typedef unordered_multimap<boost::uint64_t, list<Entry>::iterator>::iterator Iterator;
+   pair<Iterator, Iterator> range = shard.index.equal_range(k);
+   for(Iterator it = range.first; it != range.second; ++it)
+   {
+      if(it->second->action == action && it->second->frame == frame)
+      {
+	 return it->second;
+      }
+   }
+   return shard.entries.end();
+}
+
+inline void TransitionCache::erase(Shard& shard, boost::uint64_t k, list<Entry>::iterator entry)
+{
+   typedef unordered_multimap<boost::uint64_t, list<Entry>::iterator>::iterator Iterator;
+   pair<Iterator, Iterator> range = shard.index.equal_range(k);
+   for(Iterator it = range.first; it != range.second; ++it)
+   {
+      if(it->second == entry)
+      {
+	 shard.index.erase(it);
+	 break;
+      }
+   }
+   shard.entries.erase(entry);
+}
+
+inline bool TransitionCache::lookup(const BitFrame& frame, int action, vector<float>& probs)
+{
+   boost::uint64_t k = key(frame, action);
+   Shard& shard = getShard(k);
+
+   bool found = false;
+   omp_set_lock(&shard.lock);
+   list<Entry>::iterator entry = find(shard, k, frame, action);
+   if(entry != shard.entries.end())
+   {
+      if(entry->generation == generation)
+      {
+	 probs = entry->probs;
+	 shard.entries.splice(shard.entries.begin(), shard.entries, entry); //Now the most recently used
+	 found = true;
+      }
+      else
+      {
+	 erase(shard, k, entry);
+      }
+   }
+   omp_unset_lock(&shard.lock);
+   return found;
+}
+
+inline void TransitionCache::insert(const BitFrame& frame, int action, const vector<float>& probs)
+{
+   boost::uint64_t k = key(frame, action);
+   Shard& shard = getShard(k);
+
+   omp_set_lock(&shard.lock);
+   list<Entry>::iterator entry = find(shard, k, frame, action);
+   if(entry != shard.entries.end())
+   {
+      erase(shard, k, entry);
+   }
+
+   while(int(shard.entries.size()) >= shardCapacity)
+   {
+      const Entry& last = shard.entries.back();
+      erase(shard, key(last.frame, last.action), --shard.entries.end());
+   }
+
+   shard.entries.push_front(Entry());
+   Entry& newEntry = shard.entries.front();
+   newEntry.frame = frame;
+   newEntry.action = action;
+   newEntry.generation = generation;
+   newEntry.probs = probs;
+   shard.index.insert(make_pair(k, shard.entries.begin()));
+   omp_unset_lock(&shard.lock);
+}
+
+inline void TransitionCache::newGeneration()
+{
+   generation++;
+}
+
+inline size_t TransitionCache::getMaxBytes() const
+{
+   return maxBytes;
+}
+
+inline int TransitionCache::size() const
+{
+   int total = 0;
+   for(int s = 0; s < NumShards; s++)
+   {
+      total += shards[s].entries.size();
+   }
+   return total;
+}
+
+#endif
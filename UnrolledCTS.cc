@@ -0,0 +1,247 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#include "UnrolledCTS.h"
+#include "Checkpoint.h"
+
+UnrolledCTS::UnrolledCTS(int depth, int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, int seed, bool pruneUniquePaths, int numColors) :
+   models(depth),
+   group(depth, 0)
+{
+   for(int m = 0; m < depth; m++)
+   {
+      models[m] = new ConvolutionalBinaryCTS(width, height, neighborhoodWidth, neighborhoodHeight, numActions, order, seed, pruneUniquePaths, numColors);
+      if(m > 0)
+      {
+	 models[m]->shareTrees(*models[0]);
+      }
+   }
+}
+
+UnrolledCTS::UnrolledCTS(const UnrolledCTS& other, randgen_t& uniform) :
+   models(other.size()),
+   group(other.group)
+{
+   for(int m = 0; m < size(); m++)
+   {
+      models[m] = new ConvolutionalBinaryCTS(*other.models[m], uniform);
+   }
+}
+
+UnrolledCTS::~UnrolledCTS()
+{
+   for(unsigned m = 0; m < models.size(); m++)
+   {
+      delete models[m];
+   }
+}
+
+ConvolutionalBinaryCTS* UnrolledCTS::operator[](int m) const
+{
+   return models[m];
+}
+
+int UnrolledCTS::size() const
+{
+   return models.size();
+}
+
+void UnrolledCTS::setTransitionCache(size_t maxBytes)
+{
+   for(int m = 0; m < size(); m++)
+   {
+      models[m]->setTransitionCache(maxBytes/size());
+   }
+}
+
+void UnrolledCTS::setHeads(bool reward, bool end, bool deferTraining)
+{
+   for(int m = 0; m < size(); m++)
+   {
+      models[m]->setHeads(reward, end, deferTraining);
+   }
+}
+
+void UnrolledCTS::useFileBackedNodes(const string& directory, int pinnedDepth)
+{
+   for(int m = 0; m < size(); m++)
+   {
+      models[m]->useFileBackedNodes(directory, pinnedDepth);
+   }
+}
+
+void UnrolledCTS::setNodeBudget(size_t maxNodes)
+{
+   for(int m = 0; m < size(); m++)
+   {
+      models[m]->setNodeBudget(maxNodes);
+   }
+}
+
+size_t UnrolledCTS::nodesEvicted() const
+{
+   size_t evicted = 0;
+   for(int m = 0; m < size(); m++)
+   {
+      evicted += models[m]->nodesEvicted();
+   }
+   return evicted;
+}
+
+void UnrolledCTS::regroup(const vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, int numModels, vector<int>& newGroup, vector<int>& leaders) const
+{
+   vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > none;
+
+   newGroup.resize(size());
+   leaders.clear();
+   for(int m = 0; m < size(); m++)
+   {
+      const vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& data = m < numModels ? dataset[m] : none;
+
+      newGroup[m] = m;
+      for(int l = 0; l < m; l++)
+      {
+	 if(newGroup[l] == l && group[l] == group[m] && (l < numModels ? dataset[l] : none) == data)
+	 {
+	    newGroup[m] = l;
+	    break;
+	 }
+      }
+
+      if(newGroup[m] == m && !data.empty())
+      {
+	 leaders.push_back(m);
+      }
+   }
+}
+
+void UnrolledCTS::shareGroups()
+{
+   for(int m = 0; m < size(); m++)
+   {
+      if(group[m] != m)
+      {
+	 models[m]->shareTrees(*models[group[m]]);
+      }
+   }
+}
+
+void UnrolledCTS::batchUpdate(const vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, int numModels)
+{
+   if(numModels < 0 || numModels > size())
+   {
+      numModels = size();
+   }
+
+   vector<int> newGroup;
+   vector<int> leaders;
+   regroup(dataset, numModels, newGroup, leaders);
+
+   //Each model only touches its own trees and history
+   //(shared nodes are copied before they are modified)
+#pragma omp parallel for schedule(dynamic, 1)
+   for(int l = 0; l < int(leaders.size()); l++)
+   {
+      models[leaders[l]]->batchUpdate(dataset[leaders[l]]);
+   }
+
+   group = newGroup;
+   shareGroups();
+}
+
+void UnrolledCTS::batchLL(const vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, vector<double>& ll, int numModels)
+{
+   if(numModels < 0 || numModels > size())
+   {
+      numModels = size();
+   }
+
+   //Evaluation leaves the trees as they are, so the groups are kept: each model that
+   //shares its trees and its data with an earlier one gets that model's LL
+   vector<int> same(numModels);
+   vector<int> evaluated;
+   for(int m = 0; m < numModels; m++)
+   {
+      same[m] = m;
+      for(int l = 0; l < m; l++)
+      {
+	 if(same[l] == l && group[l] == group[m] && dataset[l] == dataset[m])
+	 {
+	    same[m] = l;
+	    break;
+	 }
+      }
+
+      if(same[m] == m && !dataset[m].empty())
+      {
+	 evaluated.push_back(m);
+      }
+   }
+
+   ll.assign(numModels, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+   for(int e = 0; e < int(evaluated.size()); e++)
+   {
+      ll[evaluated[e]] = models[evaluated[e]]->batchLL(dataset[evaluated[e]]);
+   }
+
+   for(int m = 0; m < numModels; m++)
+   {
+      ll[m] = ll[same[m]];
+   }
+}
+
+void UnrolledCTS::save(ostream& out) const
+{
+   writeCheckpointHeader(out, "UCTS");
+   writeBinary(out, boost::int32_t(size()));
+   for(int m = 0; m < size(); m++)
+   {
+      writeBinary(out, boost::int32_t(group[m]));
+   }
+
+   for(int m = 0; m < size(); m++)
+   {
+      if(group[m] == m)
+      {
+	 models[m]->save(out);
+      }
+      else
+      {
+	 models[m]->saveRandomState(out);
+      }
+   }
+}
+
+bool UnrolledCTS::load(istream& in)
+{
+   if(!readCheckpointHeader(in, "UCTS") || !readMatching(in, boost::int32_t(size())))
+   {
+      return false;
+   }
+
+   vector<int> savedGroup(size());
+   for(int m = 0; m < size(); m++)
+   {
+      boost::int32_t g;
+      if(!readBinary(in, g) || g < 0 || g > m || (g < m && savedGroup[g] != g))
+      {
+	 return false;
+      }
+      savedGroup[m] = g;
+   }
+
+   for(int m = 0; m < size(); m++)
+   {
+      bool loaded = savedGroup[m] == m ? models[m]->load(in) : models[m]->loadRandomState(in);
+      if(!loaded)
+      {
+	 return false;
+      }
+   }
+
+   group = savedGroup;
+   shareGroups();
+   return true;
+}
@@ -0,0 +1,81 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#ifndef UNROLLED_CTS
+#define UNROLLED_CTS
+
+#include "ConvolutionalBinaryCTS.h"
+
+#include <vector>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+using namespace std;
+using namespace boost;
+
+/*An "unrolled" model: a separate ConvolutionalBinaryCTS for each
+step of a rollout, each responsible for predicting the observation
+at that step given the output of the previous model.
+The models have separate trees and datasets, so they are trained
+(and evaluated) concurrently. Models that have seen identical data
+share one set of trees, and models whose data diverges keep sharing
+the nodes neither has modified (the trees copy nodes on write).*/
+class UnrolledCTS
+{
+  private:
+   vector<ConvolutionalBinaryCTS*> models;
+   //group[m] is the first model that has been trained on exactly
+   //the same data as model m (model m shares its trees)
+   vector<int> group;
+
+   //Models that were identical and see the same data (or none) stay identical:
+   //fills in the new groups and the first model of each group with data
+   void regroup(const vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, int numModels, vector<int>& newGroup, vector<int>& leaders) const;
+   //Makes each model share the trees of the first model in its group
+   void shareGroups();
+
+  public:
+   //depth is the number of models, the rest are passed to each model
+   UnrolledCTS(int depth, int width, int height, int neighborhoodWidth, int neighborhoodHeight, int numActions, int order, int seed, bool pruneUniquePaths = true, int numColors = 2);
+   //A copy for another thread: shares other's trees (copied on write),
+   //has its own (empty) histories and draws from the given random stream
+   UnrolledCTS(const UnrolledCTS& other, randgen_t& uniform);
+   ~UnrolledCTS();
+
+   ConvolutionalBinaryCTS* operator[](int m) const;
+   int size() const;
+
+   //Turns on the transition cache of each model (see ConvolutionalBinaryCTS),
+   //using about maxBytes of memory in total (0 turns them off)
+   void setTransitionCache(size_t maxBytes);
+
+   //Chooses the reward and end trees each model uses (see ConvolutionalBinaryCTS)
+   void setHeads(bool reward, bool end, bool deferTraining = false);
+
+   //Keeps the tree nodes below depth pinnedDepth of each model in memory mapped
+   //files in directory (see ConvolutionalBinaryCTS)
+   void useFileBackedNodes(const string& directory, int pinnedDepth);
+
+   //Limits each tree of each model to about maxNodes nodes (see ConvolutionalBinaryCTS)
+   void setNodeBudget(size_t maxNodes);
+   //The number of nodes evicted by all of the models
+   size_t nodesEvicted() const;
+
+   //Trains model m with dataset[m], for the first numModels models (-1 for all)
+   void batchUpdate(const vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, int numModels = -1); //obs context, action context, nextAct, nextObs, reward, endEpisode
+
+   //Writes the models in binary (see Checkpoint.h): the trees of each group
+   //once, and the random state of every model
+   void save(ostream& out) const;
+   //Replaces the models with ones written by save
+   //Returns false if the file was written by models with a different depth or
+   //geometry (the models may then be left partly replaced)
+   bool load(istream& in);
+
+   //Fills in ll[m] with the average log likelihood of dataset[m] under model m
+   //for the first numModels models (-1 for all); empty datasets get 0
+   void batchLL(const vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, vector<double>& ll, int numModels = -1);
+};
+
+#endif
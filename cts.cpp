@@ -7,6 +7,8 @@ Minor edits by: Erik Talvitie, 2016
 ******************************/
 
 #include "cts.hpp"
+#include "Checkpoint.h"
+#include "MappedFile.h"
 
 // fast, approximate floating point math operations
 #include "icsilogw.hpp"
@@ -14,30 +16,29 @@ Minor edits by: Erik Talvitie, 2016
 #include "jacoblog.hpp"
 
 #include <vector>
+#include <algorithm>
 #include <cassert>
 #include <stack>
 #include <iostream>
+#include <sstream>
 #include <cmath>
 
 // boost includes
 #include <boost/utility.hpp>
 
 
-// for maximum compression, disable UseFastLog, UseFastJacobianLog and UseFastExp,
+// for maximum compression, use the ExactMath policy (see CTSMath.h),
 // however this is not recommended as the additional compression performance is
 // in the order of 0.01 bits on the Calgary Corpus, for a significant slowdown.
 
-// do we use an approximation to std::log for efficiency over accuracy
-static const bool UseFastLog       = true;
+// approximation to std::log for efficiency over accuracy (if Math::UseFastLog)
 static const int  FastLogPrecision = 14;  // higher is better, but uses more memory
 ICSILog icsilog(FastLogPrecision);
 
-// do we use an approximation to std::exp for efficiency over accuracy
-static const bool UseFastExp = true;
+// approximation to std::exp for efficiency over accuracy (if Math::UseFastExp)
 PowFast powfast(14);
 
-// do we use a fast approximation to the jacobian logarithm?
-static const bool UseFastJacobianLog = true;
+// fast approximation to the jacobian logarithm (if Math::UseFastJacobianLog)
 JacobianLogTable jacoblog_tbl(2048);
 
 // do we use discounting with the KT-estimator?
@@ -47,6 +48,11 @@ static const count_t Discount    = count_t(1.0) - Gamma;
 static const count_t KT_Alpha = 0.0625f;
 static const count_t KT_Alpha2 = KT_Alpha + KT_Alpha;
 
+// do we look up the KT multipliers of small counts in a table? (without
+// discounting the counts are whole numbers, so they can index the table)
+static const bool UseKTTable  = !UseDiscounting;
+static const int  KTTableSize = 4096;  // nodes with fewer symbols than this use the table
+
 // initialise weight for switching model
 static const double SwitchPrior        = 0.925;
 
@@ -54,29 +60,31 @@ static const double SwitchPrior        = 0.925;
 static const double log_switch_prior   = std::log(SwitchPrior);
 static const double log_kt_prior       = std::log(1.0 - SwitchPrior);
 
-// do we use unique path pruning?
-static const bool UseUniquePathPruning       = false;//true;
+// do we use strict unique path pruning? (pruning itself is chosen per tree)
 static const bool StrictModePathPruning      = true;
 
 
 
 /* compute a natural logarithm */
+template<class Math>
 inline double ctsLog(double x) {
-    return UseFastLog ? icsilog.log(float(x)) : std::log(x);
+    return Math::UseFastLog ? icsilog.log(float(x)) : std::log(x);
 }
 
 
 /* compute an exponential */
+template<class Math>
 inline double ctsExp(double x) {
-    return UseFastExp ? powfast.e(float(x)) : std::exp(x);
+    return Math::UseFastExp ? powfast.e(float(x)) : std::exp(x);
 }
 
 
 /* given log(x) and log(y), compute log(x+y). uses the following identity:
    log(x + y) = log(x) + log(1 + y/x) = log(x) + log(1+exp(log(y)-log(x))) */
+template<class Math>
 inline double ctsLogAdd(double log_x, double log_y) {
 
-    if (UseFastJacobianLog) {
+    if (Math::UseFastJacobianLog) {
 
         if (log_x < log_y) {
             return jacoblog_tbl.jacobianLog(log_y - log_x) + log_x;
@@ -94,143 +102,371 @@ inline double ctsLogAdd(double log_x, double log_y) {
 }
 
 
+/* ET: batch versions of ctsLog, ctsExp and ctsLogAdd on float arrays (working
+   8 at a time when the processor has AVX2). The output may be an input. */
+template<class Math>
+inline void ctsLog(const float *x, float *out, size_t n) {
+    if (Math::UseFastLog) {
+        icsilog.log(x, out, n);
+    } else {
+        for (size_t i=0; i < n; i++) out[i] = std::log(x[i]);
+    }
+}
+
+
+template<class Math>
+inline void ctsExp(const float *x, float *out, size_t n) {
+    if (Math::UseFastExp) {
+        powfast.e(x, out, n);
+    } else {
+        for (size_t i=0; i < n; i++) out[i] = std::exp(x[i]);
+    }
+}
+
+
+template<class Math>
+inline void ctsLogAdd(const float *log_x, const float *log_y, float *out, size_t n) {
+
+    // the differences and smaller values are worked out a block at a time
+    const size_t Block = 64;
+    float diff[Block], low[Block];
+
+    for (size_t start=0; start < n; start += Block) {
+        size_t m = std::min(Block, n - start);
+        for (size_t i=0; i < m; i++) {
+            float x = log_x[start + i], y = log_y[start + i];
+            low[i] = x < y ? x : y;
+            diff[i] = x < y ? y - x : x - y;
+        }
+
+        if (Math::UseFastJacobianLog) {
+            jacoblog_tbl.jacobianLog(diff, diff, m);
+        } else {
+            for (size_t i=0; i < m; i++) diff[i] = std::log(1.0 + std::exp(diff[i]));
+        }
+
+        for (size_t i=0; i < m; i++) out[start + i] = diff[i] + low[i];
+    }
+}
+
+
+/** Caches the logarithms in the KT-estimator multiplier (n_b + alpha) / (n + 2 alpha)
+    for whole counts below KTTableSize. */
+class KTLogTable : private boost::noncopyable {
+
+    public:
+
+        /** Precompute cache. */
+        KTLogTable() {
+            for (int n=0; n < KTTableSize; n++) {
+                m_numer[n] = std::log(double(n) + KT_Alpha);
+                m_denom[n] = std::log(double(n) + KT_Alpha2);
+            }
+        }
+
+        /** Look up the multiplier for n_b of n symbols. */
+        double logMul(int n_b, int n) const {
+            return m_numer[n_b] - m_denom[n];
+        }
+
+    private:
+
+        double m_numer[KTTableSize];
+        double m_denom[KTTableSize];
+};
+
+KTLogTable ktlog_tbl;
+
+
+/* compute the logarithm of the KT-estimator multiplier for a symbol
+   seen count_b times out of count_total */
+template<class Math, class Count>
+inline double ctsLogKT(Count count_b, Count count_total) {
+
+    if (UseKTTable && count_total < Count(KTTableSize)) {
+        return ktlog_tbl.logMul(int(count_b), int(count_total));
+    }
+
+    Count kt_mul_numer = count_b + KT_Alpha;
+    Count kt_mul_denom = count_total + KT_Alpha2;
+
+    return ctsLog<Math>(kt_mul_numer / kt_mul_denom);
+}
+
+
+/* ET: ctsLogKT for n nodes at once, given their counts of the symbol and in total.
+   With the fast log, the ratios are worked out in scratch and their logs taken
+   together. The results are the same as ctsLogKT's. */
+template<class Math, class Count>
+inline void ctsLogKT(const Count *count_b, const Count *count_total, float *scratch, double *out, size_t n) {
+
+    if (!Math::UseFastLog) {
+        for (size_t i=0; i < n; i++) out[i] = ctsLogKT<Math>(count_b[i], count_total[i]);
+        return;
+    }
+
+    for (size_t i=0; i < n; i++) {
+        Count kt_mul_numer = count_b[i] + KT_Alpha;
+        Count kt_mul_denom = count_total[i] + KT_Alpha2;
+        scratch[i] = kt_mul_numer / kt_mul_denom;
+    }
+    ctsLog<Math>(scratch, scratch, n);
+
+    for (size_t i=0; i < n; i++) {
+        if (UseKTTable && count_total[i] < Count(KTTableSize)) {
+            out[i] = ktlog_tbl.logMul(int(count_b[i]), int(count_total[i]));
+        } else {
+            out[i] = scratch[i];
+        }
+    }
+}
+
+
 /* display an SNode */
-std::ostream &operator<<(std::ostream &o, const SNode &sn) {
-
-    o << "(est: " << sn.m_log_prob_est
-      << ", weighted: " << sn.m_log_prob_weighted
-      << ", b: " << sn.m_log_b
-      << ", s: " << sn.m_log_s
-      << ", counts: " << sn.m_count[0] << "/" << sn.m_count[1]
-      << ", pidx: " << sn.m_pruned_idx
-      << ", children: " << sn.m_child[0] << "/" << sn.m_child[1]
+template<class Precision, class Math>
+std::ostream &operator<<(std::ostream &o, const SNodeT<Precision, Math> &sn) {
+
+    o << "(est: " << sn.m_stats.logEst()
+      << ", weighted: " << sn.m_stats.logWeighted()
+      << ", b: " << sn.m_stats.logB()
+      << ", s: " << sn.m_stats.logS()
+      << ", counts: " << sn.m_stats.count(0) << "/" << sn.m_stats.count(1)
+      << ", pruned: " << (sn.pruned() != NULL)
+      << ", children: " << sn.child(0) << "/" << sn.child(1)
       << ")";
 
     return o;
 }
 
 
+/*ET: the nodes of each kind of tree */
+template<class Precision, class Math>
+HandleArena<SNodeT<Precision, Math> > SNodeT<Precision, Math>::s_arena;
+
+
+/*ET: the pruned contexts of every tree */
+static HandleArena<PrunedContext> prunedContexts;
+
+
 /* create a new switching node */
-SNode::SNode(int depth) :
-    m_log_prob_est(0.0),
-    m_log_prob_weighted(0.0),
-    m_log_b(log_kt_prior),
-    m_log_s(log_switch_prior),
-    m_pruned_idx(-1)
+template<class Precision, class Math>
+SNodeT<Precision, Math>::SNodeT(int depth) :
+    m_stats(),
+    m_refs(1)
 {
-    m_count[0] = 0;    m_count[1] = 0;
-    m_child[0] = NULL; m_child[1] = NULL;
+    m_stats.setLogEst(0.0);
+    m_stats.setLogWeighted(0.0);
+    m_stats.setLogB(log_kt_prior);
+    m_stats.setLogS(log_switch_prior);
+    m_stats.setCount(0, 0); m_stats.setCount(1, 0);
+    m_child[0] = 0; m_child[1] = 0;
+}
+
+
+/*ET: take a reference to a pruned context */
+static inline handle_t acquireContext(handle_t pc) {
+
+    if (pc != 0) __sync_add_and_fetch(&prunedContexts.at(pc)->refs, 1);
+    return pc;
+}
+
+
+/*ET: drop a reference to a pruned context, deleting it once unreferenced */
+static inline void releaseContext(handle_t pc) {
+
+    if (pc != 0 && __sync_sub_and_fetch(&prunedContexts.at(pc)->refs, 1) == 0) {
+        prunedContexts.at(pc)->~PrunedContext();
+        prunedContexts.free(pc);
+    }
+}
+
+
+/*ET: a new pruned context holding the given context */
+static handle_t newContext(const context_t &context) {
+
+    handle_t h = prunedContexts.alloc(false);
+    PrunedContext *pc = new (prunedContexts.at(h)) PrunedContext();
+    pc->bits.resize(context.size());
+    for (size_t i = 0; i < context.size(); i++) pc->bits[i] = context[i] != 0;
+    pc->refs = 1;
+    return h;
 }
 
 
 /* create a new switching node from a pruned node */
-SNode::SNode(const SNode &rhs, int pindx) :
-    m_log_prob_est(rhs.m_log_prob_est),
-    m_log_prob_weighted(rhs.m_log_prob_weighted),
-    m_log_b(rhs.m_log_b),
-    m_log_s(rhs.m_log_s),
-    m_pruned_idx(pindx)
+template<class Precision, class Math>
+SNodeT<Precision, Math>::SNodeT(const SNode &rhs, handle_t pruned) :
+    m_stats(rhs.m_stats),
+    m_refs(1)
+{
+    m_child[0] = 0;
+    m_child[1] = 0;
+    setPruned(acquireContext(pruned));
+}
+
+
+/* an unshared copy of a node, sharing its children */
+template<class Precision, class Math>
+SNodeT<Precision, Math>::SNodeT(const SNode &rhs) :
+    m_stats(rhs.m_stats),
+    m_refs(1)
 {
-    m_count[0] = rhs.m_count[0];
-    m_count[1] = rhs.m_count[1];
-    m_child[0] = NULL;
-    m_child[1] = NULL;
+    m_child[0] = rhs.m_child[0];
+    m_child[1] = rhs.m_child[1];
+    if (m_child[1] == Pruned) {
+        acquireContext(m_child[0]);
+        return;
+    }
+    if (m_child[0] != 0) __sync_add_and_fetch(&node(m_child[0])->m_refs, 1);
+    if (m_child[1] != 0) __sync_add_and_fetch(&node(m_child[1])->m_refs, 1);
 }
 
 
 /* process a new binary symbol, with switching rate alpha, and blend 1-2*alpha */
-void SNode::update(bit_t b, double log_alpha, double log_blend, double log_split_mul) {
+template<class Precision, class Math>
+void SNodeT<Precision, Math>::update(bit_t b, double log_est_mul, double log_alpha, double log_blend, double log_split_mul) {
 
     // update the KT estimate and counts
-    double log_est_mul = logKTMul(b);
-    m_log_prob_est += log_est_mul;
+    m_stats.setLogEst(m_stats.logEst() + log_est_mul);
     if (UseDiscounting) {
-        m_count[0] *= Discount;
-        m_count[1] *= Discount;
+        m_stats.discount(Discount);
     }
-    m_count[b]++;
+    m_stats.increment(b);
 
     if (isLeaf()) {
 
-        if (m_pruned_idx >= 0) {
+        if (m_child[1] == Pruned) {
             // if we have pruned, we know weighted_pr == estimated_pr
-            m_log_prob_weighted = logProbEstimated();
-            m_log_b = ctsLogAdd(log_alpha + m_log_prob_weighted, log_blend + m_log_b + log_est_mul);
-            m_log_s = ctsLogAdd(log_alpha + m_log_prob_weighted, log_blend + m_log_s + log_est_mul);
+            double log_b = m_stats.logB(), log_s = m_stats.logS();
+            m_stats.setLogWeighted(logProbEstimated());
+            m_stats.setLogB(ctsLogAdd<Math>(log_alpha + m_stats.logWeighted(), log_blend + log_b + log_est_mul));
+            m_stats.setLogS(ctsLogAdd<Math>(log_alpha + m_stats.logWeighted(), log_blend + log_s + log_est_mul));
         } else {
-            m_log_prob_weighted = logProbEstimated();
+            m_stats.setLogWeighted(logProbEstimated());
         }
 
         return;
     }
 
-    m_log_prob_weighted = ctsLogAdd(m_log_b + log_est_mul, m_log_s + log_split_mul);
-    m_log_b = ctsLogAdd(log_alpha + m_log_prob_weighted, log_blend + m_log_b + log_est_mul);
-    m_log_s = ctsLogAdd(log_alpha + m_log_prob_weighted, log_blend + m_log_s + log_split_mul);
+    double log_b = m_stats.logB(), log_s = m_stats.logS();
+    m_stats.setLogWeighted(ctsLogAdd<Math>(log_b + log_est_mul, log_s + log_split_mul));
+    m_stats.setLogB(ctsLogAdd<Math>(log_alpha + m_stats.logWeighted(), log_blend + log_b + log_est_mul));
+    m_stats.setLogS(ctsLogAdd<Math>(log_alpha + m_stats.logWeighted(), log_blend + log_s + log_split_mul));
 }
 
 
 /* compute the result of an update call non-destructively */
-double SNode::updateNonDestructive(bit_t b, double c_weighted, double c_weighted_old) const {
+template<class Precision, class Math>
+double SNodeT<Precision, Math>::updateNonDestructive(double log_est_mul, double c_weighted, double c_weighted_old, bool leaf) const {
 
     // compute the KT estimate
-    double log_est_mul = logKTMul(b);
-    double log_prob_est = m_log_prob_est;
+    double log_prob_est = m_stats.logEst();
     log_prob_est += log_est_mul;
 
-    if (isLeaf()) return log_prob_est;
+    if (leaf) return log_prob_est;
 
     double log_split_mul = c_weighted - c_weighted_old;
-    return ctsLogAdd(m_log_b + log_est_mul, m_log_s + log_split_mul);
+    return ctsLogAdd<Math>(m_stats.logB() + log_est_mul, m_stats.logS() + log_split_mul);
 }
 
 
 /* is the current node a leaf node? */
-bool SNode::isLeaf() const {
+template<class Precision, class Math>
+bool SNodeT<Precision, Math>::isLeaf() const {
+
+    return m_child[1] == Pruned || (m_child[0] == 0 && m_child[1] == 0);
+}
+
+
+/*ET: the node with a given handle */
+template<class Precision, class Math>
+inline SNodeT<Precision, Math> *SNodeT<Precision, Math>::node(handle_t h) {
+
+    return h != 0 ? s_arena.at(h) : NULL;
+}
+
+
+/*ET: the context the node was pruned in */
+template<class Precision, class Math>
+inline const PrunedContext *SNodeT<Precision, Math>::pruned() const {
+
+    return m_child[1] == Pruned ? prunedContexts.at(m_child[0]) : NULL;
+}
+
+
+/*ET: marks the node as pruned in a context (or not) */
+template<class Precision, class Math>
+inline void SNodeT<Precision, Math>::setPruned(handle_t context) {
+
+    m_child[0] = context;
+    m_child[1] = context != 0 ? Pruned : 0;
+}
+
 
-    return child(0) == NULL && child(1) == NULL;
+/*ET: make a node whose children were evicted predict with its KT estimate.
+  Parents only use the change in a child's weighted probability, so it can be
+  reset; the switching weights are rescaled to sum to it, as they do in a leaf. */
+template<class Precision, class Math>
+void SNodeT<Precision, Math>::collapse() {
+
+    double log_norm = m_stats.logEst() - ctsLogAdd<Math>(m_stats.logB(), m_stats.logS());
+    double log_b = m_stats.logB() + log_norm, log_s = m_stats.logS() + log_norm;
+    m_stats.setLogWeighted(m_stats.logEst());
+    m_stats.setLogB(log_b);
+    m_stats.setLogS(log_s);
 }
 
 
 /* Krichevski-Trofimov estimated log probability accessor */
-weight_t SNode::logProbEstimated() const {
+template<class Precision, class Math>
+typename Precision::weight_t SNodeT<Precision, Math>::logProbEstimated() const {
 
-    return m_log_prob_est;
+    return m_stats.logEst();
 }
 
 
 /* logarithmic weighted probability estimate accessor */
-weight_t SNode::logProbWeighted() const {
-    return m_log_prob_weighted;
+template<class Precision, class Math>
+typename Precision::weight_t SNodeT<Precision, Math>::logProbWeighted() const {
+    return m_stats.logWeighted();
 }
 
 
 /* child corresponding to a particular symbol */
-const SNode *SNode::child(bit_t b) const {
+template<class Precision, class Math>
+inline const SNodeT<Precision, Math> *SNodeT<Precision, Math>::child(bit_t b) const {
+
+    return m_child[1] != Pruned ? node(m_child[b]) : NULL;
+}
+
 
-    return m_child[b];
+/*ET: child corresponding to a particular symbol, for changing it */
+template<class Precision, class Math>
+inline SNodeT<Precision, Math> *SNodeT<Precision, Math>::child(bit_t b) {
+
+    return m_child[1] != Pruned ? node(m_child[b]) : NULL;
 }
 
 
 /* the number of times this context been visited */
-count_t SNode::visits() const {
+template<class Precision, class Math>
+typename Precision::count_t SNodeT<Precision, Math>::visits() const {
 
-    return m_count[0] + m_count[1];
+    return m_stats.count(0) + m_stats.count(1);
 }
 
 
 /* compute the logarithm of the KT-estimator update multiplier */
-inline double SNode::logKTMul(bit_t b) const {
-
-    count_t kt_mul_numer = m_count[b] + KT_Alpha;
-    count_t kt_mul_denom = m_count[0] + m_count[1] + KT_Alpha2;
+template<class Precision, class Math>
+inline double SNodeT<Precision, Math>::logKTMul(bit_t b) const {
 
-    return ctsLog(kt_mul_numer / kt_mul_denom);
+    return ctsLogKT<Math>(m_stats.count(b), count_t(m_stats.count(0) + m_stats.count(1)));
 }
 
 
 /* number of descendents of a node in the context tree */
-size_t SNode::size() const {
+template<class Precision, class Math>
+size_t SNodeT<Precision, Math>::size() const {
 
     size_t rval = 1;
     rval += child(0) ? child(0)->size() : 0;
@@ -240,7 +476,8 @@ size_t SNode::size() const {
 
 
 /* determine whether two contexts are identical */
-bool SwitchingTree::contextsEqual(const context_t &lhs, const context_t &rhs) {
+template<class Precision, class Math>
+bool SwitchingTreeT<Precision, Math>::contextsEqual(const context_t &lhs, const context_t &rhs) {
 
     assert(lhs.size() == rhs.size());
 
@@ -253,18 +490,23 @@ bool SwitchingTree::contextsEqual(const context_t &lhs, const context_t &rhs) {
 
 
 /* create (if necessary) all of the nodes in the current context */
-void SwitchingTree::createNodesInCurrentContext(const context_t &context) {
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::createNodesInCurrentContext(const context_t &context) {
 
-    SNode **ctn = &m_root;
+    handle_t *ctn = &m_root;
+    unshare(ctn, 0);
 
-    if (!UseUniquePathPruning) {
+    if (!m_prune_unique_paths) {
 
         for (size_t i = 0; i < context.size(); i++) {
-            ctn = &((*ctn)->m_child[context[i]]);
-            if (*ctn == NULL) {
-                void *p = m_ctnode_pool.malloc();
-                assert(p != NULL);  // TODO: make more robust
-                *ctn = new (p) SNode(static_cast<int>(i));
+            ctn = &(SNode::node(*ctn)->m_child[context[i]]);
+            if (*ctn == 0) {
+                handle_t h = allocNode(i+1);
+                new (SNode::node(h)) SNode(static_cast<int>(i));
+                *ctn = h;
+                m_size++;
+            } else {
+                unshare(ctn, i+1);
             }
         }
         return;
@@ -273,12 +515,16 @@ void SwitchingTree::createNodesInCurrentContext(const context_t &context) {
     // unique path pruning - only create nodes that are needed!
     for (size_t i = 0; i < context.size(); i++) {
 
-        SNode *n = *ctn;
+        unshare(ctn, i);
+        SNode *n = SNode::node(*ctn);
         // if we encountered a node with pruning, restore the statistics
-        if (n->m_pruned_idx >= 0) {
+        if (n->pruned() != NULL) {
 
             // get the pruned context
-            getContext(m_history, m_pcontext, n->m_pruned_idx);
+            // ET: (stored in the node, since the history may have been reset since)
+            const PrunedContext *pc = n->pruned();
+            m_pcontext.resize(pc->bits.size());
+            for (size_t j=0; j < m_pcontext.size(); j++) m_pcontext[j] = pc->bits[j];
 
             // strict unique path pruning check: if contexts are identical,
             // don't create _any_ more new nodes!
@@ -286,78 +532,167 @@ void SwitchingTree::createNodesInCurrentContext(const context_t &context) {
 
             // now expand the old context out till it is unique again,
             // copying in the old relevant information
-            SNode **pctn = ctn;
-            int pidx = n->m_pruned_idx;
+            // ET: (the nodes on the way, made from n, are pruned in the same
+            // context until they get children)
+            SNode *pn = n;
+            handle_t pctx = n->m_child[0];  // (taking over n's reference)
+            n->setPruned(0);
             for (size_t j=i; j < m_pcontext.size(); j++) {
 
-                (*pctn)->m_pruned_idx = -1;
+                if (pn != n) {
+                    releaseContext(pn->m_child[0]);
+                    pn->setPruned(0);
+                }
 
-                pctn = &((*pctn)->m_child[m_pcontext[j]]);
-                void *p = m_ctnode_pool.malloc();
-                assert(p != NULL);  // TODO: make more robust
-                *pctn = new (p) SNode(*n, j == m_pcontext.size()-1 ? -1 : pidx);
+                handle_t h = allocNode(j+1);
+                SNode *c = new (SNode::node(h)) SNode(*n, j == m_pcontext.size()-1 ? 0 : pctx);
+                pn->m_child[m_pcontext[j]] = h;
+                pn = c;
+                m_size++;
 
                 if (m_pcontext[j] != context[j]) break;
             }
+            releaseContext(pctx);
         }
 
         // create new node
-        ctn = &((*ctn)->m_child[context[i]]);
-        if (*ctn == NULL) {
-            void *p = m_ctnode_pool.malloc();
-            assert(p != NULL);  // TODO: make more robust
-            *ctn = new (p) SNode(static_cast<int>(i));
+        ctn = &(n->m_child[context[i]]);
+        if (*ctn == 0) {
+            handle_t h = allocNode(i+1);
+            SNode *c = new (SNode::node(h)) SNode(static_cast<int>(i));
+            *ctn = h;
+            m_size++;
             if (i+1 < m_context.size())
-                (*ctn)->m_pruned_idx = static_cast<int>(m_history.size());
-            break;
+                c->setPruned(newContext(m_context));
+            return;
         }
     }
+    unshare(ctn, context.size());
 }
 
 
 /* create a context tree of specified maximum depth and size */
-SwitchingTree::SwitchingTree(history_t &history, size_t depth, int phase/*=-1*/) :
-    m_ctnode_pool(sizeof(SNode)),
-    m_root(new (m_ctnode_pool.malloc()) SNode(0)),
+template<class Precision, class Math>
+SwitchingTreeT<Precision, Math>::SwitchingTreeT(history_t &history, size_t depth, int phase/*=-1*/, bool pruneUniquePaths/*=true*/) :
+    m_file_backed(false),
+    m_pinned_depth(0),
+    m_root(allocNode(0)),
     m_phase(phase),
     m_depth(depth),
+    m_prune_unique_paths(pruneUniquePaths),
+    m_size(1),
+    m_node_budget(0),
+    m_num_evicted(0),
+    m_path_length(0),
     m_history(history),
     m_prob_cache(-1),
     m_num_symbols(0)
 {
+   new (root()) SNode(0);
+   freshWeights(m_depth, m_fresh_weighted);
 }
 
 /*ET: same as above, but constructs a default history*/
-SwitchingTree::SwitchingTree(size_t depth, int phase/*=-1*/) :
-    m_ctnode_pool(sizeof(SNode)),
-    m_root(new (m_ctnode_pool.malloc()) SNode(0)),
+template<class Precision, class Math>
+SwitchingTreeT<Precision, Math>::SwitchingTreeT(size_t depth, int phase/*=-1*/, bool pruneUniquePaths/*=true*/) :
+    m_file_backed(false),
+    m_pinned_depth(0),
+    m_root(allocNode(0)),
     m_phase(phase),
     m_depth(depth),
+    m_prune_unique_paths(pruneUniquePaths),
+    m_size(1),
+    m_node_budget(0),
+    m_num_evicted(0),
+    m_path_length(0),
     m_prob_cache(-1),
     m_num_symbols(0)
 {
+   new (root()) SNode(0);
+   freshWeights(m_depth, m_fresh_weighted);
+}
+
+/*ET: creates a tree sharing the nodes of base*/
+template<class Precision, class Math>
+SwitchingTreeT<Precision, Math>::SwitchingTreeT(const SwitchingTreeT *base) :
+    m_file_backed(base->m_file_backed),
+    m_pinned_depth(base->m_pinned_depth),
+    m_root(base->m_root),
+    m_phase(base->m_phase),
+    m_depth(base->m_depth),
+    m_prune_unique_paths(base->m_prune_unique_paths),
+    m_size(base->m_size),
+    m_node_budget(base->m_node_budget),
+    m_num_evicted(0),
+    m_path_length(0),
+    m_fresh_weighted(base->m_fresh_weighted),
+    m_history(base->m_history),
+    m_prob_cache(-1),
+    m_num_symbols(base->m_num_symbols)
+{
+    __sync_add_and_fetch(&root()->m_refs, 1);
 }
 
 /* delete the context tree */
-SwitchingTree::~SwitchingTree(void) {
-    deleteCT(m_root);
+template<class Precision, class Math>
+SwitchingTreeT<Precision, Math>::~SwitchingTreeT(void) {
+    release(m_root);
 }
 
 
-/* recursively deletes the nodes in a context tree */
-void SwitchingTree::deleteCT(SNode *n) {
+/* drop a reference to a node, recursively deleting it once unreferenced */
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::release(handle_t h) {
 
+    SNode *n = SNode::node(h);
     if (n == NULL) return;
 
-    if (n->m_child[0] != NULL) deleteCT(n->m_child[0]);
-    if (n->m_child[1] != NULL) deleteCT(n->m_child[1]);
+    if (__sync_sub_and_fetch(&n->m_refs, 1) > 0) return;
+
+    if (n->pruned() != NULL) {
+        releaseContext(n->m_child[0]);
+    } else {
+        release(n->m_child[0]);
+        release(n->m_child[1]);
+    }
+
+    reclaimMemory(h);
+}
+
+
+/*ET: allocate memory for a node at the given depth */
+template<class Precision, class Math>
+handle_t SwitchingTreeT<Precision, Math>::allocNode(size_t depth) {
+
+    return SNode::s_arena.alloc(m_file_backed && depth >= m_pinned_depth);
+}
+
+
+/* make the node in a slot private to this tree, copying it if it is shared */
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::unshare(handle_t *slot, size_t depth) {
+
+    handle_t h = *slot;
+    SNode *n = SNode::node(h);
+    if (n->m_refs == 1) return;
 
-    m_ctnode_pool.free(n);
+    *slot = allocNode(depth);
+    new (SNode::node(*slot)) SNode(*n);
+    release(h);
+}
+
+
+/* a new tree that shares this one's nodes */
+template<class Precision, class Math>
+SwitchingTreeT<Precision, Math> *SwitchingTreeT<Precision, Math>::share() const {
+
+    return new SwitchingTreeT(this);
 }
 
 
 /* compute the current binary context */
-void SwitchingTree::getContext(const history_t &h, context_t &context, int idx /* = -1 */) {
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::getContext(const history_t &h, context_t &context, int idx /* = -1 */) {
 
     size_t offset = idx < 0 ? h.size() : size_t(idx);
     context.clear();
@@ -369,7 +704,8 @@ void SwitchingTree::getContext(const history_t &h, context_t &context, int idx /
 
 
 /* computes the context, creates relevant nodes and determine the path to update */
-void SwitchingTree::makeContextAndPath() {
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::makeContextAndPath() {
 
     // compute the current context
     getContext(m_history, m_context);
@@ -378,29 +714,112 @@ void SwitchingTree::makeContextAndPath() {
     createNodesInCurrentContext(m_context);
 
     // 2. walk down the tree to the relevant leaf, saving the path as we go
-    m_path.clear(); m_log_old_weights.clear();
-    SNode *ctn = m_root;
-    m_log_old_weights.push_back(m_root->logProbWeighted());
-    m_path.push_back(m_root); // add the empty context
+    // ET: (the path buffers are made big enough for any path the first time)
+    if (m_path.size() < m_context.size() + 1) {
+        size_t room = m_context.size() + 1;
+        m_path.resize(room); m_log_old_weights.resize(room);
+        m_log_est_muls.resize(room); m_path_counts.resize(room);
+        m_path_totals.resize(room); m_kt_scratch.resize(room);
+    }
+    SNode *ctn = root();
+    m_log_old_weights[0] = ctn->logProbWeighted();
+    m_path[0] = ctn; // add the empty context
+    m_path_length = 1;
 
     for (size_t i = 0; i < m_context.size(); i++) {
-        ctn = ctn->m_child[m_context[i]];
+        ctn = ctn->child(m_context[i]);
         if (ctn == NULL) break;
-        m_log_old_weights.push_back(ctn->logProbWeighted());
-        m_path.push_back(ctn);
+        m_log_old_weights[m_path_length] = ctn->logProbWeighted();
+        m_path[m_path_length++] = ctn;
+    }
+}
+
+
+/* ET: determines the path prob computes with, without changing the tree */
+template<class Precision, class Math>
+bool SwitchingTreeT<Precision, Math>::findPath(const context_t &context, double &tail) {
+
+    if (m_path.size() < context.size() + 1) {
+        size_t room = context.size() + 1;
+        m_path.resize(room); m_log_old_weights.resize(room);
+        m_log_est_muls.resize(room); m_path_counts.resize(room);
+        m_path_totals.resize(room); m_kt_scratch.resize(room);
+    }
+    m_path_length = 0;
+
+    SNode *ctn = root();
+    for (size_t i = 0; ; i++) {
+        m_log_old_weights[m_path_length] = ctn->logProbWeighted();
+        m_path[m_path_length++] = ctn;
+        if (i == context.size()) return true;
+
+        const PrunedContext *pc = ctn->pruned();
+        if (pc != NULL && StrictModePathPruning) {
+            // update leaves a pruned node alone if the rest of the context matches
+            size_t j = i;
+            while (j < context.size() && pc->bits[j] == (context[j] != 0)) j++;
+            if (j == context.size()) return true;
+        }
+
+        SNode *c = ctn->child(context[i]);
+        // (the copies update makes of a pruned node have its statistics)
+        if (c == NULL && pc != NULL && pc->bits[i] == (context[i] != 0)) c = ctn;
+        if (c == NULL) {
+            // update would add a pruned leaf, or the rest of the path
+            tail = m_fresh_weighted[m_prune_unique_paths ? 1 : context.size() - i];
+            return false;
+        }
+        ctn = c;
+    }
+}
+
+
+/* ET: the weighted log probabilities of paths of new nodes */
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::freshWeights(size_t depth, std::vector<double> &fresh) {
+
+    // the same computation update does on the nodes it creates
+    SNode n(0);
+    double log_est_mul = n.logKTMul(0);
+    fresh.resize(depth + 1);
+    fresh[0] = 0.0;
+    if (depth == 0) return;
+    fresh[1] = n.m_stats.logEst() + log_est_mul;
+    for (size_t k = 2; k <= depth; k++) {
+        fresh[k] = ctsLogAdd<Math>(n.m_stats.logB() + log_est_mul, n.m_stats.logS() + fresh[k-1]);
+    }
+}
+
+
+/* ET: computes the KT multipliers of the nodes on the path for symbol b */
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::computeLogKTMuls(bit_t b) {
+
+    for (size_t i = 0; i < m_path_length; i++) {
+        const typename Precision::Stats &stats = m_path[i]->m_stats;
+        m_path_counts[i] = stats.count(b);
+        m_path_totals[i] = stats.count(0) + stats.count(1);
     }
+
+    ctsLogKT<Math>(&m_path_counts[0], &m_path_totals[0], &m_kt_scratch[0], &m_log_est_muls[0], m_path_length);
 }
 
 
 /* compute the switching rate for a given time t */
-double SwitchingTree::switchRate(size_t t) const {
+template<class Precision, class Math>
+double SwitchingTreeT<Precision, Math>::switchRate(size_t t) const {
 
     return 1.0 / double(t - m_depth + 3);
 }
 
 
 /* updates the context tree with a single bit */
-void SwitchingTree::update(bit_t b) {
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::update(bit_t b) {
+
+    // ET: make room for the new nodes if the tree is over budget
+    // (only here, so prob() never changes the predictions)
+    if (m_node_budget > 0 && m_size > m_node_budget) evict();
 
     // avoid recomputing context and path if prob() just called
    /*if (m_prob_cache != static_cast<int>(m_history.size()))*/ makeContextAndPath();
@@ -408,21 +827,17 @@ void SwitchingTree::update(bit_t b) {
     // 3. update the probability estimates from the leaf node back up to the root
    double alpha = switchRate(m_num_symbols);//m_history.size());
 
-    double log_alpha = ctsLog(alpha);
-    double log_blend = ctsLog(1.0 - 2.0*alpha);
+    double log_alpha = ctsLog<Math>(alpha);
+    double log_blend = ctsLog<Math>(1.0 - 2.0*alpha);
     double log_split_mul = 0.0;
 
-    SNode **sn = &m_path[m_path.size()-1];
-    SNode *snc = NULL;
-    size_t c = m_path.size()-1;
-
-    while (!m_path.empty()) {
-        (*sn)->update(b, log_alpha, log_blend, log_split_mul);
-        log_split_mul = (*sn)->logProbWeighted() - m_log_old_weights[c];
-        snc = *sn;
-        sn--;
-        c--;
-        m_path.pop_back();
+    // ET: (the KT multipliers don't depend on each other, so they are done first)
+    computeLogKTMuls(b);
+
+    for (size_t c = m_path_length; c-- > 0;) {
+        SNode *sn = m_path[c];
+        sn->update(b, m_log_est_muls[c], log_alpha, log_blend, log_split_mul);
+        log_split_mul = sn->logProbWeighted() - m_log_old_weights[c];
     }
 
     // 4. update the history
@@ -432,73 +847,93 @@ void SwitchingTree::update(bit_t b) {
 
 
 /* the probability of seeing a particular symbol next */
-double SwitchingTree::prob(bit_t b) {
+template<class Precision, class Math>
+double SwitchingTreeT<Precision, Math>::prob(bit_t b) {
 
     double before = logBlockProbability();
 
-    makeContextAndPath();
-
-    // remember for later so we can avoid calling makeContextAndPath
-    // if update() is called immediately after this
-    m_prob_cache = static_cast<int>(m_history.size());
+    // ET: (the nodes update would create are accounted for without creating
+    // them, so asking never changes the answers)
+    getContext(m_history, m_context);
+    double c_weighted = 0.0, c_old_weighted = 0.0;
+    bool leaf = findPath(m_context, c_weighted);
 
      // 3. compute the probability estimates from the leaf node back up to the root
-    double c_weighted = 0.0, c_old_weighted = 0.0;
-    SNode *snc = NULL;
-    SNode **sn = &m_path[m_path.size()-1];
-    size_t c = 0;
-    while (c < m_path.size()) {
-        c_weighted = (*sn)->updateNonDestructive(b, c_weighted, c_old_weighted);
-        c_old_weighted =  m_log_old_weights[m_path.size()-c-1];
-        snc = *sn;
-        sn--;
-        c++;
+    computeLogKTMuls(b);
+    for (size_t c = m_path_length; c-- > 0;) {
+        c_weighted = m_path[c]->updateNonDestructive(m_log_est_muls[c], c_weighted, c_old_weighted, leaf);
+        c_old_weighted = m_log_old_weights[c];
+        leaf = false;
     }
 
-    return ctsExp(c_weighted - before);
+    return ctsExp<Math>(c_weighted - before);
 }
 
 
 /* the depth of the context tree */
-size_t SwitchingTree::depth() const {
+template<class Precision, class Math>
+size_t SwitchingTreeT<Precision, Math>::depth() const {
 
     return m_depth;
 }
 
 
 /* number of nodes in the context tree */
-size_t SwitchingTree::size(void) const {
+template<class Precision, class Math>
+size_t SwitchingTreeT<Precision, Math>::size(void) const {
 
-    return m_root->size();
+    return m_size;
+}
+
+
+/*ET: whether unique paths are collapsed into single nodes */
+template<class Precision, class Math>
+bool SwitchingTreeT<Precision, Math>::prunesUniquePaths() const {
+
+    return m_prune_unique_paths;
 }
 
 
 /* recover the memory used by a node */
-void SwitchingTree::reclaimMemory(SNode *n) {
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::reclaimMemory(handle_t n) {
+
+    // ET: (back into the arena's memory or file backed storage, whichever it came from)
+    SNode::s_arena.free(n);
+}
+
+
+/*ET: the root node */
+template<class Precision, class Math>
+inline SNodeT<Precision, Math> *SwitchingTreeT<Precision, Math>::root() const {
 
-    m_ctnode_pool.free(n);
+    return SNode::node(m_root);
 }
 
 
 /* the logarithm of the block probability of the whole sequence */
-double SwitchingTree::logBlockProbability(void) const {
+template<class Precision, class Math>
+double SwitchingTreeT<Precision, Math>::logBlockProbability(void) const {
 
-    return m_root->logProbWeighted();
+    return root()->logProbWeighted();
 }
 
 /*All the below added by ET*/
-void SwitchingTree::resetHistory()
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::resetHistory()
 {
    m_history.resize(0);
 }
 
-void SwitchingTree::updateHistory(bit_t b)
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::updateHistory(bit_t b)
 {
    m_history.push_back(b != 0);
    m_num_symbols++;
 }
 
-void SwitchingTree::updateHistory(const std::vector<bit_t>& bits)
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::updateHistory(const std::vector<bit_t>& bits)
 {
    for(unsigned i = 0; i < bits.size(); i++)
    {
@@ -507,19 +942,33 @@ void SwitchingTree::updateHistory(const std::vector<bit_t>& bits)
    m_num_symbols += bits.size();
 }
 
-bit_t SwitchingTree::genRandomSymbol(randgen_t& rng, bool print/*=false*/)
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::setHistory(const history_t& history)
 {
-   SNode* n = m_root;
+   m_history = history;
+   m_num_symbols += history.size();
+}
+
+template<class Precision, class Math>
+const history_t& SwitchingTreeT<Precision, Math>::getHistory() const
+{
+   return m_history;
+}
+
+template<class Precision, class Math>
+bit_t SwitchingTreeT<Precision, Math>::genRandomSymbol(randgen_t& rng, bool print/*=false*/)
+{
+   SNode* n = root();
    for(size_t i = 0; i < m_depth - 1; i++)
    {
       if(print)
       {
 	 std::cout << "Level " << i << ": ";
       }
-      double splitProb = ctsExp(n->m_log_s - n->m_log_prob_weighted);
+      double splitProb = ctsExp<Math>(n->m_stats.logS() - n->m_stats.logWeighted());
       if(rng() > splitProb)
       {
-	 double oneProb = ctsExp(n->logKTMul(1));
+	 double oneProb = ctsExp<Math>(n->logKTMul(1));
 	 bit_t b = rng() < oneProb;
 	 if(print)
 	 {
@@ -535,13 +984,21 @@ bit_t SwitchingTree::genRandomSymbol(randgen_t& rng, bool print/*=false*/)
 	 {
 	    std::cout << "Splitting with prob " << splitProb << ", symbol = " << (int)symb;
 	 }
-	 if(n->m_child[symb])
+	 if(n->child(symb))
 	 {
 	    if(print)
 	    {
 	       std::cout << std::endl;
 	    }
-	    n = n->m_child[symb];
+	    n = n->child(symb);
+	 }
+	 else if(n->pruned() && n->pruned()->bits[i] == symb)
+	 {
+	    //Still on the pruned path (whose nodes all have n's statistics)
+	    if(print)
+	    {
+	       std::cout << ", pruned path" << std::endl;
+	    }
 	 }
 	 else
 	 {
@@ -556,7 +1013,7 @@ bit_t SwitchingTree::genRandomSymbol(randgen_t& rng, bool print/*=false*/)
       }
    }
 
-   double oneProb = ctsExp(n->logKTMul(1));
+   double oneProb = ctsExp<Math>(n->logKTMul(1));
    bit_t b = rng() < oneProb;
    if(print)
    {
@@ -564,3 +1021,889 @@ bit_t SwitchingTree::genRandomSymbol(randgen_t& rng, bool print/*=false*/)
    }
    return b;
 }
+
+/*ET: The probability that genRandomSymbol returns 1: the same walk,
+  summing over the points where it could stop*/
+template<class Precision, class Math>
+double SwitchingTreeT<Precision, Math>::genRandomSymbolProb() const
+{
+   const SNode* n = root();
+   double reachProb = 1;
+   double prob = 0;
+   for(size_t i = 0; i < m_depth - 1; i++)
+   {
+      double splitProb = std::min(ctsExp<Math>(n->m_stats.logS() - n->m_stats.logWeighted()), 1.0);
+      prob += reachProb*(1 - splitProb)*ctsExp<Math>(n->logKTMul(1));
+      reachProb *= splitProb;
+
+      bit_t symb = m_history[m_history.size() - 1 - i];
+      if(n->child(symb))
+      {
+	 n = n->child(symb);
+      }
+      else if(!n->pruned() || n->pruned()->bits[i] != symb)
+      {
+	 return prob + reachProb*0.5;
+      }
+   }
+
+   return prob + reachProb*ctsExp<Math>(n->logKTMul(1));
+}
+
+/*ET: Sets probs[v] to p for the values v whose low knownBits bits are value
+  (the ways the rest of the added bits could go, see genRandomSymbolProbs)*/
+static void fillBranchProbs(size_t value, size_t knownBits, double p, std::vector<double>& probs)
+{
+   for(size_t v = value; v < probs.size(); v += size_t(1) << knownBits)
+   {
+      probs[v] = p;
+   }
+}
+
+/*ET: The walk of genRandomSymbolProb, splitting in two at each of the first
+  branchBits levels (the added bits, most recent first)*/
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::genRandomSymbolProbs(size_t branchBits, std::vector<double>& probs) const
+{
+   probs.assign(size_t(1) << branchBits, 0);
+   genRandomSymbolProbsFrom(root(), 0, 0, 1, 0, branchBits, probs);
+}
+
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::genRandomSymbolProbsFrom(const SNode* n, size_t i, size_t value, double reachProb, double prob, size_t branchBits, std::vector<double>& probs) const
+{
+   for(; i < m_depth - 1; i++)
+   {
+      double splitProb = std::min(ctsExp<Math>(n->m_stats.logS() - n->m_stats.logWeighted()), 1.0);
+      prob += reachProb*(1 - splitProb)*ctsExp<Math>(n->logKTMul(1));
+      reachProb *= splitProb;
+
+      if(i < branchBits)
+      {
+	 for(int b = 0; b < 2; b++)
+	 {
+	    size_t branchValue = value | (size_t(b) << i);
+	    if(n->child(b))
+	    {
+	       genRandomSymbolProbsFrom(n->child(b), i + 1, branchValue, reachProb, prob, branchBits, probs);
+	    }
+	    else if(n->pruned() && n->pruned()->bits[i] == bit_t(b))
+	    {
+	       genRandomSymbolProbsFrom(n, i + 1, branchValue, reachProb, prob, branchBits, probs);
+	    }
+	    else
+	    {
+	       fillBranchProbs(branchValue, i + 1, prob + reachProb*0.5, probs);
+	    }
+	 }
+	 return;
+      }
+
+      bit_t symb = m_history[m_history.size() - 1 - (i - branchBits)];
+      if(n->child(symb))
+      {
+	 n = n->child(symb);
+      }
+      else if(!n->pruned() || n->pruned()->bits[i] != symb)
+      {
+	 fillBranchProbs(value, i, prob + reachProb*0.5, probs);
+	 return;
+      }
+   }
+
+   fillBranchProbs(value, std::min(i, branchBits), prob + reachProb*ctsExp<Math>(n->logKTMul(1)), probs);
+}
+
+/*ET: Probabilities are stored as fixed point fractions of 2^32, compared
+  against raw 32-bit draws from the generator*/
+static boost::uint32_t quantize(double p)
+{
+   if(p <= 0)
+   {
+      return 0;
+   }
+   else if(p >= 1)
+   {
+      return 0xFFFFFFFFu;
+   }
+   else
+   {
+      return boost::uint32_t(std::min(p*4294967296.0, 4294967295.0));
+   }
+}
+
+/*ET: Appends a pruned context to a packed array of contexts*/
+static void appendContext(const PrunedContext* pc, size_t contextWords, std::vector<boost::uint64_t>& prunedBits)
+{
+   size_t start = prunedBits.size();
+   prunedBits.resize(start + contextWords, 0);
+   for(size_t i = 0; i < pc->bits.size(); i++)
+   {
+      if(pc->bits[i])
+      {
+	 prunedBits[start + i/64] |= boost::uint64_t(1) << (i%64);
+      }
+   }
+}
+
+static inline bit_t contextBit(const boost::uint64_t* context, size_t i)
+{
+   return (context[i/64] >> (i%64)) & 1;
+}
+
+FrozenTree::FrozenTree(const SwitchingTree& tree) :
+   m_depth(tree.m_depth),
+   m_context_words((tree.m_depth + 63)/64)
+{
+   m_nodes.reserve(tree.size());
+   compile(tree.root());
+}
+
+boost::uint32_t FrozenTree::compile(const SNode* n)
+{
+   boost::uint32_t idx = m_nodes.size();
+   m_nodes.push_back(Node());
+   double splitProb = ctsExp<Math>(n->m_stats.logS() - n->m_stats.logWeighted());
+   m_nodes[idx].stop = quantize(1 - splitProb);
+   m_nodes[idx].one = quantize(ctsExp<Math>(n->logKTMul(1)));
+   m_nodes[idx].pruned = 0;
+   if(n->pruned())
+   {
+      m_nodes[idx].pruned = 1 + m_pruned_bits.size()/m_context_words;
+      appendContext(n->pruned(), m_context_words, m_pruned_bits);
+   }
+   for(int b = 0; b < 2; b++)
+   {
+      //m_nodes may reallocate, so assign after the recursive call
+      boost::uint32_t c = n->child(b) ? compile(n->child(b)) : 0;
+      m_nodes[idx].child[b] = c;
+   }
+   return idx;
+}
+
+bit_t FrozenTree::genRandomSymbol(const SwitchingTree& tree, randgen_t& rng) const
+{
+   const history_t& history = tree.m_history;
+   randsrc_t& bits = rng.base();
+   const Node* n = &m_nodes[0];
+   for(size_t i = 0; i < m_depth - 1; i++)
+   {
+      if(bits() < n->stop)
+      {
+	 return bits() < n->one;
+      }
+
+      bit_t symb = history[history.size() - 1 - i];
+      boost::uint32_t c = n->child[symb];
+      if(c != 0)
+      {
+	 n = &m_nodes[c];
+      }
+      else if(!prunedPathContinues(n, i, symb)) //unfamiliar context
+      {
+	 return bits() < 0x80000000u;
+      }
+   }
+
+   return bits() < n->one;
+}
+
+double FrozenTree::genRandomSymbolProb(const SwitchingTree& tree) const
+{
+   const history_t& history = tree.m_history;
+   const double scale = 1.0/4294967296.0;
+   const Node* n = &m_nodes[0];
+   double reachProb = 1;
+   double prob = 0;
+   for(size_t i = 0; i < m_depth - 1; i++)
+   {
+      double stopProb = n->stop*scale;
+      prob += reachProb*stopProb*(n->one*scale);
+      reachProb *= 1 - stopProb;
+
+      bit_t symb = history[history.size() - 1 - i];
+      boost::uint32_t c = n->child[symb];
+      if(c != 0)
+      {
+	 n = &m_nodes[c];
+      }
+      else if(!prunedPathContinues(n, i, symb))
+      {
+	 return prob + reachProb*0.5;
+      }
+   }
+
+   return prob + reachProb*(n->one*scale);
+}
+
+void FrozenTree::genRandomSymbolProbs(const SwitchingTree& tree, size_t branchBits, std::vector<double>& probs) const
+{
+   probs.assign(size_t(1) << branchBits, 0);
+   genRandomSymbolProbsFrom(&m_nodes[0], 0, 0, 1, 0, tree.m_history, branchBits, probs);
+}
+
+void FrozenTree::genRandomSymbolProbsFrom(const Node* n, size_t i, size_t value, double reachProb, double prob, const history_t& history, size_t branchBits, std::vector<double>& probs) const
+{
+   const double scale = 1.0/4294967296.0;
+   for(; i < m_depth - 1; i++)
+   {
+      double stopProb = n->stop*scale;
+      prob += reachProb*stopProb*(n->one*scale);
+      reachProb *= 1 - stopProb;
+
+      if(i < branchBits)
+      {
+	 for(int b = 0; b < 2; b++)
+	 {
+	    size_t branchValue = value | (size_t(b) << i);
+	    boost::uint32_t c = n->child[b];
+	    if(c != 0)
+	    {
+	       genRandomSymbolProbsFrom(&m_nodes[c], i + 1, branchValue, reachProb, prob, history, branchBits, probs);
+	    }
+	    else if(prunedPathContinues(n, i, b))
+	    {
+	       genRandomSymbolProbsFrom(n, i + 1, branchValue, reachProb, prob, history, branchBits, probs);
+	    }
+	    else
+	    {
+	       fillBranchProbs(branchValue, i + 1, prob + reachProb*0.5, probs);
+	    }
+	 }
+	 return;
+      }
+
+      bit_t symb = history[history.size() - 1 - (i - branchBits)];
+      boost::uint32_t c = n->child[symb];
+      if(c != 0)
+      {
+	 n = &m_nodes[c];
+      }
+      else if(!prunedPathContinues(n, i, symb))
+      {
+	 fillBranchProbs(value, i, prob + reachProb*0.5, probs);
+	 return;
+      }
+   }
+
+   fillBranchProbs(value, std::min(i, branchBits), prob + reachProb*(n->one*scale), probs);
+}
+
+bool FrozenTree::prunedPathContinues(const Node* n, size_t i, bit_t symb) const
+{
+   return n->pruned && contextBit(&m_pruned_bits[(n->pruned - 1)*m_context_words], i) == symb;
+}
+
+size_t FrozenTree::size() const
+{
+   return m_nodes.size();
+}
+
+/*ET: A node as written by SwitchingTree::save (in depth first order,
+  with the 0 child first)*/
+template<class Precision>
+struct SavedNode
+{
+   typename Precision::Stats stats;
+   boost::int32_t pruned; //index of the node's pruned context (-1 if it isn't pruned)
+   boost::int32_t children; //bit b is set if there is a b child
+};
+
+/*ET: The settings the node statistics depend on*/
+template<class Precision, class Math>
+static void writeTreeSettings(std::ostream& out, size_t depth, int phase, bool pruneUniquePaths)
+{
+   writeBinary(out, boost::uint8_t(Precision::id));
+   writeBinary(out, boost::uint32_t(sizeof(typename Precision::Stats)));
+   writeBinary(out, boost::uint8_t(Math::UseFastLog));
+   writeBinary(out, boost::int32_t(FastLogPrecision));
+   writeBinary(out, boost::uint8_t(Math::UseFastExp));
+   writeBinary(out, boost::uint8_t(Math::UseFastJacobianLog));
+   writeBinary(out, boost::uint8_t(UseDiscounting));
+   writeBinary(out, Gamma);
+   writeBinary(out, KT_Alpha);
+   writeBinary(out, SwitchPrior);
+   writeBinary(out, boost::uint8_t(pruneUniquePaths));
+   writeBinary(out, boost::uint8_t(StrictModePathPruning));
+   writeBinary(out, boost::uint64_t(depth));
+   writeBinary(out, boost::int32_t(phase));
+}
+
+template<class Precision, class Math>
+static bool readTreeSettings(std::istream& in, size_t depth, int phase, bool pruneUniquePaths)
+{
+   return readMatching(in, boost::uint8_t(Precision::id)) &&
+      readMatching(in, boost::uint32_t(sizeof(typename Precision::Stats))) &&
+      readMatching(in, boost::uint8_t(Math::UseFastLog)) &&
+      readMatching(in, boost::int32_t(FastLogPrecision)) &&
+      readMatching(in, boost::uint8_t(Math::UseFastExp)) &&
+      readMatching(in, boost::uint8_t(Math::UseFastJacobianLog)) &&
+      readMatching(in, boost::uint8_t(UseDiscounting)) &&
+      readMatching(in, Gamma) &&
+      readMatching(in, KT_Alpha) &&
+      readMatching(in, SwitchPrior) &&
+      readMatching(in, boost::uint8_t(pruneUniquePaths)) &&
+      readMatching(in, boost::uint8_t(StrictModePathPruning)) &&
+      readMatching(in, boost::uint64_t(depth)) &&
+      readMatching(in, boost::int32_t(phase));
+}
+
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::save(std::ostream& out) const
+{
+   writeCheckpointHeader(out, "CTS ");
+   writeTreeSettings<Precision, Math>(out, m_depth, m_phase, m_prune_unique_paths);
+   writeBinary(out, boost::uint64_t(m_num_symbols));
+
+   std::vector<SavedNode<Precision> > nodes;
+   nodes.reserve(size());
+   size_t contextWords = (m_depth + 63)/64;
+   std::vector<boost::uint64_t> prunedBits;
+   std::stack<const SNode*> toVisit;
+   toVisit.push(root());
+   while(!toVisit.empty())
+   {
+      const SNode* n = toVisit.top();
+      toVisit.pop();
+
+      SavedNode<Precision> saved;
+      saved.stats = n->m_stats;
+      saved.pruned = -1;
+      if(n->pruned())
+      {
+	 saved.pruned = prunedBits.size()/contextWords;
+	 appendContext(n->pruned(), contextWords, prunedBits);
+      }
+      saved.children = (n->child(0) ? 1 : 0) | (n->child(1) ? 2 : 0);
+      nodes.push_back(saved);
+
+      if(n->child(1))
+      {
+	 toVisit.push(n->child(1));
+      }
+      if(n->child(0))
+      {
+	 toVisit.push(n->child(0));
+      }
+   }
+
+   writeBinary(out, boost::uint64_t(nodes.size()));
+   writeBinary(out, &nodes[0], nodes.size());
+   writeBinary(out, boost::uint64_t(prunedBits.size()/contextWords));
+   if(!prunedBits.empty())
+   {
+      writeBinary(out, &prunedBits[0], prunedBits.size());
+   }
+}
+
+template<class Precision, class Math>
+bool SwitchingTreeT<Precision, Math>::load(std::istream& in)
+{
+   boost::uint64_t numSymbols;
+   boost::uint64_t numNodes;
+   if(!readCheckpointHeader(in, "CTS ") || !readTreeSettings<Precision, Math>(in, m_depth, m_phase, m_prune_unique_paths) ||
+      !readBinary(in, numSymbols) || !readBinary(in, numNodes) || numNodes == 0)
+   {
+      return false;
+   }
+
+   std::vector<SavedNode<Precision> > nodes(numNodes);
+   boost::uint64_t numContexts;
+   if(!readBinary(in, &nodes[0], nodes.size()) || !readBinary(in, numContexts))
+   {
+      return false;
+   }
+   size_t contextWords = (m_depth + 63)/64;
+   std::vector<boost::uint64_t> prunedBits(numContexts*contextWords);
+   if(!prunedBits.empty() && !readBinary(in, &prunedBits[0], prunedBits.size()))
+   {
+      return false;
+   }
+
+   //Check that the child flags describe exactly one tree
+   //(in which pruned nodes have no children)
+   std::vector<size_t> depths;
+   depths.push_back(0);
+   for(size_t i = 0; i < nodes.size(); i++)
+   {
+      if(depths.empty())
+      {
+	 return false;
+      }
+      size_t d = depths.back();
+      depths.pop_back();
+      if(nodes[i].pruned < -1 || nodes[i].pruned >= boost::int64_t(numContexts) ||
+	 (nodes[i].pruned >= 0 && nodes[i].children != 0))
+      {
+	 return false;
+      }
+      for(int b = 0; b < 2; b++)
+      {
+	 if(nodes[i].children & (1 << b))
+	 {
+	    depths.push_back(d + 1);
+	 }
+      }
+   }
+   if(!depths.empty())
+   {
+      return false;
+   }
+
+   handle_t root = 0;
+   std::stack<std::pair<handle_t*, size_t> > slots;
+   slots.push(std::make_pair(&root, size_t(0)));
+   for(size_t i = 0; i < nodes.size(); i++)
+   {
+      handle_t* slot = slots.top().first;
+      size_t d = slots.top().second;
+      slots.pop();
+
+      handle_t h = allocNode(d);
+      SNode* n = new (SNode::node(h)) SNode(0);
+      n->m_stats = nodes[i].stats;
+      if(nodes[i].pruned >= 0)
+      {
+	 const boost::uint64_t* context = &prunedBits[nodes[i].pruned*contextWords];
+	 handle_t pc = prunedContexts.alloc(false);
+	 PrunedContext* pruned = new (prunedContexts.at(pc)) PrunedContext();
+	 pruned->bits.resize(m_depth);
+	 for(size_t j = 0; j < m_depth; j++)
+	 {
+	    pruned->bits[j] = contextBit(context, j);
+	 }
+	 pruned->refs = 1;
+	 n->setPruned(pc);
+      }
+      *slot = h;
+
+      if(nodes[i].children & 2)
+      {
+	 slots.push(std::make_pair(&n->m_child[1], d + 1));
+      }
+      if(nodes[i].children & 1)
+      {
+	 slots.push(std::make_pair(&n->m_child[0], d + 1));
+      }
+   }
+
+   release(m_root);
+   m_root = root;
+   m_size = nodes.size();
+   m_num_symbols = numSymbols;
+   m_prob_cache = -1;
+   return true;
+}
+
+MappedTree::MappedTree() :
+   m_nodes(NULL),
+   m_num_nodes(0),
+   m_depth(0),
+   m_prune_unique_paths(false),
+   m_pruned_bits(NULL),
+   m_num_contexts(0),
+   m_context_words(0)
+{
+}
+
+boost::uint32_t MappedTree::compile(const SNode* n, std::vector<Node>& nodes, std::vector<boost::uint64_t>& prunedBits, size_t contextWords)
+{
+   boost::uint32_t idx = nodes.size();
+   nodes.push_back(Node());
+   Node& node = nodes.back();
+   node.log_prob_est = n->m_stats.logEst();
+   node.log_prob_weighted = n->m_stats.logWeighted();
+   node.log_b = n->m_stats.logB();
+   node.log_s = n->m_stats.logS();
+   node.count[0] = n->m_stats.count(0);
+   node.count[1] = n->m_stats.count(1);
+   node.stop = quantize(1 - ctsExp<Math>(n->m_stats.logS() - n->m_stats.logWeighted()));
+   node.one = quantize(ctsExp<Math>(n->logKTMul(1)));
+   node.pruned = 0;
+   if(n->pruned())
+   {
+      node.pruned = 1 + prunedBits.size()/contextWords;
+      appendContext(n->pruned(), contextWords, prunedBits);
+   }
+   for(int b = 0; b < 2; b++)
+   {
+      //nodes may reallocate, so assign after the recursive call
+      boost::uint32_t c = n->child(b) ? compile(n->child(b), nodes, prunedBits, contextWords) : 0;
+      nodes[idx].child[b] = c;
+   }
+   return idx;
+}
+
+void MappedTree::write(const SwitchingTree& tree, std::ostream& out)
+{
+   std::vector<Node> nodes;
+   nodes.reserve(tree.size());
+   size_t contextWords = (tree.m_depth + 63)/64;
+   std::vector<boost::uint64_t> prunedBits;
+   compile(tree.root(), nodes, prunedBits, contextWords);
+
+   std::stringstream header;
+   writeCheckpointHeader(header, "CTSM");
+   writeTreeSettings<FloatPrecision, Math>(header, tree.m_depth, tree.m_phase, tree.m_prune_unique_paths);
+   writeBinary(header, boost::uint64_t(nodes.size()));
+   writeBinary(header, boost::uint64_t(prunedBits.size()/contextWords));
+   std::string headerBytes = header.str();
+   out.write(headerBytes.data(), headerBytes.size());
+   writeAlignment(out, headerBytes.size());
+
+   writeBinary(out, &nodes[0], nodes.size());
+   writeAlignment(out, nodes.size()*sizeof(Node));
+   if(!prunedBits.empty())
+   {
+      writeBinary(out, &prunedBits[0], prunedBits.size());
+   }
+}
+
+bool MappedTree::map(const char* data, size_t size, size_t depth, int phase, bool pruneUniquePaths, size_t& used)
+{
+   MemoryBuffer buffer(data, size);
+   std::istream in(&buffer);
+   boost::uint64_t numNodes;
+   boost::uint64_t numContexts;
+   if(!readCheckpointHeader(in, "CTSM") || !readTreeSettings<FloatPrecision, Math>(in, depth, phase, pruneUniquePaths) ||
+      !readBinary(in, numNodes) || numNodes == 0 || !readBinary(in, numContexts))
+   {
+      return false;
+   }
+
+   size_t contextWords = (depth + 63)/64;
+   size_t offset = alignedLength(buffer.position());
+   if(offset > size || numNodes > (size - offset)/sizeof(Node))
+   {
+      return false;
+   }
+   size_t contextOffset = offset + alignedLength(numNodes*sizeof(Node));
+   if(contextOffset > size || numContexts > (size - contextOffset)/(contextWords*sizeof(boost::uint64_t)))
+   {
+      return false;
+   }
+
+   m_nodes = reinterpret_cast<const Node*>(data + offset);
+   m_num_nodes = numNodes;
+   m_depth = depth;
+   m_prune_unique_paths = pruneUniquePaths;
+   m_pruned_bits = reinterpret_cast<const boost::uint64_t*>(data + contextOffset);
+   m_num_contexts = numContexts;
+   m_context_words = contextWords;
+   used = contextOffset + numContexts*contextWords*sizeof(boost::uint64_t);
+
+   SwitchingTree::freshWeights(m_depth, m_fresh_weighted);
+   return true;
+}
+
+const MappedTree::Node* MappedTree::child(const Node* n, const history_t& history, size_t i) const
+{
+   return child(n, history[history.size() - 1 - i], i);
+}
+
+const MappedTree::Node* MappedTree::child(const Node* n, bit_t symb, size_t i) const
+{
+   boost::uint32_t c = n->child[symb];
+   if(c > 0 && c < m_num_nodes)
+   {
+      return m_nodes + c;
+   }
+   //a pruned node stands for the nodes on its path
+   return prunedPathContinues(n, i, symb) ? n : NULL;
+}
+
+const boost::uint64_t* MappedTree::prunedContext(const Node* n) const
+{
+   if(n->pruned == 0 || n->pruned > m_num_contexts)
+   {
+      return NULL;
+   }
+   return m_pruned_bits + (n->pruned - 1)*m_context_words;
+}
+
+bool MappedTree::prunedPathContinues(const Node* n, size_t i, bit_t symb) const
+{
+   const boost::uint64_t* context = prunedContext(n);
+   return context && contextBit(context, i) == symb;
+}
+
+/*ET: SNode::logKTMul for a mapped node*/
+static inline double mappedKTMul(const count_t* count, bit_t b)
+{
+   return ctsLogKT<MappedTree::Math>(count[b], count_t(count[0] + count[1]));
+}
+
+double MappedTree::probFrom(const Node* n, size_t i, const history_t& history, bit_t b) const
+{
+   double log_est_mul = mappedKTMul(n->count, b);
+   if(i == m_depth) //the leaf
+   {
+      return n->log_prob_est + log_est_mul;
+   }
+
+   const boost::uint64_t* pruned = prunedContext(n);
+   if(pruned && m_prune_unique_paths && StrictModePathPruning)
+   {
+      //tree.prob leaves a pruned node alone if the context matches
+      size_t j = i;
+      while(j < m_depth && contextBit(pruned, j) == history[history.size() - 1 - j])
+      {
+	 j++;
+      }
+      if(j == m_depth)
+      {
+	 return n->log_prob_est + log_est_mul;
+      }
+   }
+
+   double c_weighted;
+   double c_weighted_old;
+   const Node* c = child(n, history, i);
+   if(c) //(c == n for the copies tree.prob makes of a pruned node)
+   {
+      c_weighted = probFrom(c, i + 1, history, b);
+      c_weighted_old = c->log_prob_weighted;
+   }
+   else if(m_prune_unique_paths) //the child would be a new pruned leaf
+   {
+      c_weighted = m_fresh_weighted[1];
+      c_weighted_old = 0;
+   }
+   else //the rest of the path would be new nodes
+   {
+      c_weighted = m_fresh_weighted[m_depth - i];
+      c_weighted_old = 0;
+   }
+   return ctsLogAdd<Math>(n->log_b + log_est_mul, n->log_s + (c_weighted - c_weighted_old));
+}
+
+double MappedTree::prob(const SwitchingTree& tree, bit_t b) const
+{
+   double before = m_nodes[0].log_prob_weighted;
+   return ctsExp<Math>(probFrom(m_nodes, 0, tree.m_history, b) - before);
+}
+
+bit_t MappedTree::genRandomSymbol(const SwitchingTree& tree, randgen_t& rng) const
+{
+   const history_t& history = tree.m_history;
+   randsrc_t& bits = rng.base();
+   const Node* n = m_nodes;
+   for(size_t i = 0; i < m_depth - 1; i++)
+   {
+      if(bits() < n->stop)
+      {
+	 return bits() < n->one;
+      }
+
+      n = child(n, history, i);
+      if(n == NULL) //unfamiliar context
+      {
+	 return bits() < 0x80000000u;
+      }
+   }
+
+   return bits() < n->one;
+}
+
+double MappedTree::genRandomSymbolProb(const SwitchingTree& tree) const
+{
+   const history_t& history = tree.m_history;
+   const double scale = 1.0/4294967296.0;
+   const Node* n = m_nodes;
+   double reachProb = 1;
+   double prob = 0;
+   for(size_t i = 0; i < m_depth - 1; i++)
+   {
+      double stopProb = n->stop*scale;
+      prob += reachProb*stopProb*(n->one*scale);
+      reachProb *= 1 - stopProb;
+
+      n = child(n, history, i);
+      if(n == NULL)
+      {
+	 return prob + reachProb*0.5;
+      }
+   }
+
+   return prob + reachProb*(n->one*scale);
+}
+
+void MappedTree::genRandomSymbolProbs(const SwitchingTree& tree, size_t branchBits, std::vector<double>& probs) const
+{
+   probs.assign(size_t(1) << branchBits, 0);
+   genRandomSymbolProbsFrom(m_nodes, 0, 0, 1, 0, tree.m_history, branchBits, probs);
+}
+
+void MappedTree::genRandomSymbolProbsFrom(const Node* n, size_t i, size_t value, double reachProb, double prob, const history_t& history, size_t branchBits, std::vector<double>& probs) const
+{
+   const double scale = 1.0/4294967296.0;
+   for(; i < m_depth - 1; i++)
+   {
+      double stopProb = n->stop*scale;
+      prob += reachProb*stopProb*(n->one*scale);
+      reachProb *= 1 - stopProb;
+
+      if(i < branchBits)
+      {
+	 for(int b = 0; b < 2; b++)
+	 {
+	    size_t branchValue = value | (size_t(b) << i);
+	    const Node* c = child(n, bit_t(b), i);
+	    if(c)
+	    {
+	       genRandomSymbolProbsFrom(c, i + 1, branchValue, reachProb, prob, history, branchBits, probs);
+	    }
+	    else
+	    {
+	       fillBranchProbs(branchValue, i + 1, prob + reachProb*0.5, probs);
+	    }
+	 }
+	 return;
+      }
+
+      n = child(n, history[history.size() - 1 - (i - branchBits)], i);
+      if(n == NULL)
+      {
+	 fillBranchProbs(value, i, prob + reachProb*0.5, probs);
+	 return;
+      }
+   }
+
+   fillBranchProbs(value, std::min(i, branchBits), prob + reachProb*(n->one*scale), probs);
+}
+
+size_t MappedTree::size() const
+{
+   return m_num_nodes;
+}
+
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::useFileBackedNodes(const std::string& directory, size_t pinnedDepth)
+{
+   FileBackedAllocator::directory() = directory;
+   m_file_backed = true;
+   m_pinned_depth = pinnedDepth;
+}
+
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::setNodeBudget(size_t maxNodes)
+{
+   m_node_budget = maxNodes;
+}
+
+template<class Precision, class Math>
+size_t SwitchingTreeT<Precision, Math>::nodesEvicted() const
+{
+   return m_num_evicted;
+}
+
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::evict()
+{
+   //A node goes if any node on its path has been visited too little, so the
+   //threshold comes from the fewest visits on each node's path
+   std::vector<count_t> visits;
+   visits.reserve(m_size);
+   collectPathVisits(root(), root()->visits(), visits);
+
+   size_t target = m_node_budget - m_node_budget/4;
+   size_t numToEvict = m_size - std::min(target, m_size);
+   if(numToEvict == 0 || visits.empty())
+   {
+      return;
+   }
+   numToEvict = std::min(numToEvict, visits.size());
+   std::nth_element(visits.begin(), visits.begin() + (numToEvict - 1), visits.end());
+   handle_t root = evictBelow(m_root, 0, false, visits[numToEvict - 1], target);
+   if(root != m_root)
+   {
+      release(m_root);
+      m_root = root;
+   }
+}
+
+template<class Precision, class Math>
+void SwitchingTreeT<Precision, Math>::collectPathVisits(const SNode* n, count_t pathVisits, std::vector<count_t>& visits)
+{
+   for(int b = 0; b < 2; b++)
+   {
+      const SNode* c = n->child(b);
+      if(c)
+      {
+	 count_t cVisits = std::min(pathVisits, c->visits());
+	 visits.push_back(cVisits);
+	 collectPathVisits(c, cVisits, visits);
+      }
+   }
+}
+
+template<class Precision, class Math>
+handle_t SwitchingTreeT<Precision, Math>::evictBelow(handle_t n, size_t depth, bool shared, count_t threshold, size_t target)
+{
+   SNode* node = SNode::node(n);
+   if(node->pruned()) //(no children)
+   {
+      return n;
+   }
+   shared = shared || node->m_refs > 1;
+   handle_t m = n; //(or the copy of n, once a child changes)
+   bool evicted = false;
+   for(int b = 0; b < 2; b++)
+   {
+      handle_t c = SNode::node(m)->m_child[b];
+      if(c == 0)
+      {
+	 continue;
+      }
+      handle_t replacement = 0;
+      const SNode* child = SNode::node(c);
+      if(child->visits() < threshold || (child->visits() == threshold && m_size > target))
+      {
+	 size_t freed = child->size();
+	 m_size -= freed;
+	 m_num_evicted += freed;
+	 evicted = true;
+      }
+      else
+      {
+	 replacement = evictBelow(c, depth + 1, shared, threshold, target);
+	 if(replacement == c)
+	 {
+	    continue;
+	 }
+      }
+
+      if(shared && m == n)
+      {
+	 m = allocNode(depth);
+	 new (SNode::node(m)) SNode(*node);
+      }
+      SNode::node(m)->m_child[b] = replacement;
+      release(c);
+   }
+   if(evicted && SNode::node(m)->isLeaf())
+   {
+      SNode::node(m)->collapse();
+   }
+   return m;
+}
+
+/*ET: The precisions and math the trees can be built with (see CTSPrecision.h and CTSMath.h)*/
+template class SNodeT<FloatPrecision, FastMath>;
+template class SwitchingTreeT<FloatPrecision, FastMath>;
+template std::ostream &operator<<(std::ostream &o, const SNodeT<FloatPrecision, FastMath> &sn);
+template class SNodeT<DoublePrecision, FastMath>;
+template class SwitchingTreeT<DoublePrecision, FastMath>;
+template std::ostream &operator<<(std::ostream &o, const SNodeT<DoublePrecision, FastMath> &sn);
+template class SNodeT<CompactPrecision, FastMath>;
+template class SwitchingTreeT<CompactPrecision, FastMath>;
+template std::ostream &operator<<(std::ostream &o, const SNodeT<CompactPrecision, FastMath> &sn);
+template class SNodeT<FloatPrecision, ExactMath>;
+template class SwitchingTreeT<FloatPrecision, ExactMath>;
+template std::ostream &operator<<(std::ostream &o, const SNodeT<FloatPrecision, ExactMath> &sn);
+template class SNodeT<DoublePrecision, ExactMath>;
+template class SwitchingTreeT<DoublePrecision, ExactMath>;
+template std::ostream &operator<<(std::ostream &o, const SNodeT<DoublePrecision, ExactMath> &sn);
+template class SNodeT<CompactPrecision, ExactMath>;
+template class SwitchingTreeT<CompactPrecision, ExactMath>;
+template std::ostream &operator<<(std::ostream &o, const SNodeT<CompactPrecision, ExactMath> &sn);
@@ -10,30 +10,58 @@ Minor edits by: Erik Talvitie, 2016
 *****************************************************************/
 
 #include "common.hpp"
+#include "CTSPrecision.h"
+#include "CTSMath.h"
+#include "HandleArena.h"
 
 #include <vector>
 // boost includes
 #include <boost/utility.hpp>
-#include <boost/pool/pool.hpp>
 #include <boost/random.hpp>
+#include <boost/cstdint.hpp>
 
 // random number generator to supply noise
 typedef boost::mt19937 randsrc_t;
 typedef boost::uniform_01<randsrc_t> randgen_t;
 
+/*ET: The context a pruned node was created in (unique path pruning), so the
+  path below it can be restored after the history has been reset.
+  Bit i is the symbol at depth i of the context. Shared by the copies of
+  the node and freed along with the last of them.*/
+struct PrunedContext {
+    history_t bits;
+    int refs;
+};
+
+template<class Precision, class Math = FastMath> class SwitchingTreeT;
+
 // context tree node
-class SNode {
+// ET: (storing its statistics as the Precision policy says, see CTSPrecision.h,
+// and doing its arithmetic as the Math policy says, see CTSMath.h)
+template<class Precision, class Math = FastMath>
+class SNodeT {
+
+    typedef SNodeT<Precision, Math> SNode;
+    typedef typename Precision::weight_t weight_t;
+    typedef typename Precision::count_t count_t;
 
-    friend class SwitchingTree;
-    friend std::ostream &operator<<(std::ostream &o, const SNode &);
+    friend class SwitchingTreeT<Precision, Math>;
+    friend class FrozenTree;
+    friend class MappedTree;
+    template<class P, class M> friend std::ostream &operator<<(std::ostream &o, const SNodeT<P, M> &);
 
     public:
 
-        SNode(int depth);
-        explicit SNode(const SNode &rhs, int pindx);
+        SNodeT(int depth);
+        // ET: (pruned is the handle of a pruned context, or 0)
+        explicit SNodeT(const SNode &rhs, handle_t pruned);
+
+        /// an unshared copy of a node, sharing its children
+        SNodeT(const SNode &rhs);
 
         /// process a new binary symbol, with switching rate alpha, and blend 1-2*alpha
-        void update(bit_t b, double log_alpha, double log_blend, double log_split_mul);
+        /// ET: (log_est_mul is the node's logKTMul(b), see SwitchingTreeT::computeLogKTMuls)
+        void update(bit_t b, double log_est_mul, double log_alpha, double log_blend, double log_split_mul);
 
         /// log weighted blocked probability
         weight_t logProbWeighted() const;
@@ -53,47 +81,80 @@ class SNode {
     private:
 
         // compute the result of an update call non-destructively
-        double updateNonDestructive(bit_t b, double c_weighted, double c_weighted_old) const;
+        // ET: (leaf says whether the node would be a leaf on the path update makes)
+        double updateNonDestructive(double log_est_mul, double c_weighted, double c_weighted_old, bool leaf) const;
 
         // is the current node a leaf node?
         bool isLeaf() const;
 
+        // ET: the node with a given handle (NULL for 0)
+        static SNode *node(handle_t h);
+
+        // ET: child(b), for changing it
+        SNode *child(bit_t b);
+
+        // ET: the context the node was pruned in (NULL if it wasn't)
+        const PrunedContext *pruned() const;
+
+        // ET: marks the node as pruned in the context with the given handle
+        // (taking over a reference to it), or as not pruned if it is 0
+        void setPruned(handle_t context);
+
+        // make a node whose children were evicted predict with its KT estimate
+        void collapse();
+
         // compute the logarithm of the KT-estimator update multiplier
         double logKTMul(bit_t b) const;
 
-        weight_t m_log_prob_est;
-        weight_t m_log_prob_weighted;
-
-        // switching weights
-        weight_t m_log_b;
-        weight_t m_log_s;
+        // log estimated and weighted probabilities, switching weights
+        // and symbol counts
+        typename Precision::Stats m_stats;
 
         // one slot for each binary value
-        count_t m_count[2];
-        SNode *m_child[2];
+        // ET: (the handle of the child in s_arena, or 0). When the unique path
+        // below this node was pruned (the node then stands for every node on that
+        // path), it has no children: m_child[0] is the handle of the PrunedContext
+        // and m_child[1] is Pruned
+        handle_t m_child[2];
+
+        // number of parents (or tree roots) pointing at this node,
+        // greater than one when trees share structure (copy on write)
+        int m_refs;
 
-        // m_backidx >= 0 when a previous symbol's context was pruned
-        int m_pruned_idx;
+        static const handle_t Pruned = ~handle_t(0);
+
+        // ET: where the nodes of every tree with this precision and math are
+        // (so a handle means the same node in the trees that share it)
+        static HandleArena<SNode> s_arena;
 };
 
-extern std::ostream &operator<<(std::ostream &o, const SNode &sn);
+template<class Precision, class Math>
+std::ostream &operator<<(std::ostream &o, const SNodeT<Precision, Math> &sn);
 
 
 // a context tree used for CTW mixing
-class SwitchingTree : public Compressor, boost::noncopyable {
+template<class Precision, class Math>
+class SwitchingTreeT : public Compressor, boost::noncopyable {
+
+    friend class FrozenTree;
+    friend class MappedTree;
 
+    typedef SNodeT<Precision, Math> SNode;
+    typedef typename Precision::weight_t weight_t;
+    typedef typename Precision::count_t count_t;
     typedef std::pair<SNode *, SNode> ctpair_t;
 
     public:
 
         /// create a context tree of specified maximum depth and size
-        SwitchingTree(history_t &history, size_t depth, int phase=-1);
+        /// (collapsing unique paths into single nodes if pruneUniquePaths)
+        SwitchingTreeT(history_t &history, size_t depth, int phase=-1, bool pruneUniquePaths=true);
 
    /*ET: same as above, but constructs a default history*/
-   SwitchingTree(size_t depth, int phase=-1);
+   SwitchingTreeT(size_t depth, int phase=-1, bool pruneUniquePaths=true);
 
         /// delete the context tree
-        ~SwitchingTree();
+        ~SwitchingTreeT();
 
         /// file extension
         const char *fileExtension() const { return "cts"; }
@@ -113,23 +174,84 @@ class SwitchingTree : public Compressor, boost::noncopyable {
         /// number of nodes in the context tree
         size_t size() const;
 
+        /// whether unique paths are collapsed into single nodes
+        bool prunesUniquePaths() const;
+
+        /// a new tree that shares this one's nodes, copying them only when
+        /// either tree modifies them (safe to update the trees concurrently)
+        SwitchingTreeT *share() const;
+
    //ET: Added methods below
    void resetHistory();
    void updateHistory(bit_t b);
    void updateHistory(const std::vector<bit_t>& bits);
+   //Same as resetHistory then adding the bits of history (oldest first)
+   void setHistory(const history_t& history);
+   const history_t& getHistory() const;
    bit_t genRandomSymbol(randgen_t& rng, bool print=false);   
+   //The probability that genRandomSymbol returns 1 in the current context
+   double genRandomSymbolProb() const;
+   //genRandomSymbolProb after each way of adding branchBits more bits to the history:
+   //probs[v] is for the bits of v, most significant first (2^branchBits of them).
+   //The walk is shared until the added bits differ
+   void genRandomSymbolProbs(size_t branchBits, std::vector<double>& probs) const;
+
+   //Writes the nodes, depth and symbol count in binary (see Checkpoint.h)
+   void save(std::ostream& out) const;
+   //Replaces the nodes and symbol count with ones written by save
+   //Returns false (leaving the tree as it was) if they were saved
+   //with a different depth or CTS settings
+   bool load(std::istream& in);
+
+   //Puts nodes at depth pinnedDepth and below in memory mapped files in directory
+   //(see FileBackedAllocator), so cold parts of a large tree can be paged out while
+   //the upper levels stay in memory. Affects nodes created from then on.
+   //(Every tree uses the latest directory given, so call it before trees are used concurrently.)
+   void useFileBackedNodes(const std::string& directory, size_t pinnedDepth);
+
+   //Keeps the tree to about maxNodes nodes (0 for no limit): when update finds it
+   //has grown past that, the least visited subtrees are evicted (their parents predict
+   //with their own KT estimates on those branches) until it is down to 3/4 of maxNodes
+   void setNodeBudget(size_t maxNodes);
+   //The number of nodes evicted to stay within the budget
+   size_t nodesEvicted() const;
 
     private:
 
+        // creates a tree sharing the nodes of base
+        explicit SwitchingTreeT(const SwitchingTreeT *base);
+
         // compute the switching rate for a given time t
         double switchRate(size_t t) const;
 
         // recover the memory used by a node
-        void reclaimMemory(SNode *n);
+        void reclaimMemory(handle_t n);
+
+        // ET: the root node
+        SNode *root() const;
 
         // computes the context, creates relevant nodes and determine the path to update
         void makeContextAndPath();
 
+        // ET: determines the path prob computes with without changing the tree:
+        // a pruned node stands for each of the nodes update would expand it into,
+        // and if the path ends above a leaf, tail is set to the weighted log
+        // probability the nodes update would create below it would give.
+        // Returns whether it ends in a leaf.
+        bool findPath(const context_t &context, double &tail);
+
+        // ET: sets fresh[k] to the weighted log probability that the bottom k
+        // nodes of a path would give if they were all new
+        static void freshWeights(size_t depth, std::vector<double> &fresh);
+
+        // ET: genRandomSymbolProbs from node n at depth i, with the added bits
+        // below i being value and the walk so far as given
+        void genRandomSymbolProbsFrom(const SNode *n, size_t i, size_t value, double reachProb, double prob, size_t branchBits, std::vector<double>& probs) const;
+
+        // ET: computes the KT multipliers of the nodes on the path for symbol b
+        // together (so the logs can be taken several at a time)
+        void computeLogKTMuls(bit_t b);
+
         // determine whether two contexts are identical
         static bool contextsEqual(const context_t &lhs, const context_t &rhs);
 
@@ -139,20 +261,59 @@ class SwitchingTree : public Compressor, boost::noncopyable {
         // create (if necessary) all of the nodes in the current context
         void createNodesInCurrentContext(const context_t &context);
 
-        // recursively deletes the nodes in a context tree
-        void deleteCT(SNode *root);
+        // allocate memory for a node at the given depth
+        // ET: (returning its handle; the node is at SNode::node of it)
+        handle_t allocNode(size_t depth);
+
+        // make the node (at the given depth) in a slot private to this tree,
+        // copying it if it is shared
+        void unshare(handle_t *slot, size_t depth);
+
+        // drop a reference to a node, recursively deleting it once unreferenced
+        void release(handle_t n);
 
-        boost::pool<> m_ctnode_pool;
+        // evict the least visited subtrees until the tree is 3/4 of its budget
+        void evict();
 
-        SNode *m_root;
+        // collect the fewest visits on the path to each node below n
+        static void collectPathVisits(const SNode *n, count_t pathVisits, std::vector<count_t> &visits);
+
+        // evict the subtrees below n (at depth) visited fewer than threshold times
+        // (or exactly threshold times, while the tree is bigger than target).
+        // n is shared with other trees if shared is set or it has other parents; only
+        // the nodes on the way to an evicted subtree are then copied. Returns n, or
+        // the copy of it to put in its place (the caller then releases n).
+        handle_t evictBelow(handle_t n, size_t depth, bool shared, count_t threshold, size_t target);
+
+        // ET: whether nodes at depth m_pinned_depth and below are file backed
+        bool m_file_backed;
+        size_t m_pinned_depth;
+
+        handle_t m_root;
         int m_phase;
         size_t m_depth;
+        bool m_prune_unique_paths;
+        // number of nodes in the tree, the most allowed (0 for no limit)
+        // and the number evicted to stay under it
+        size_t m_size;
+        size_t m_node_budget;
+        size_t m_num_evicted;
         context_t m_context;
         context_t m_pcontext;
         std::vector<SNode *> m_created;
         std::vector<ctpair_t> m_modified;
         std::vector<SNode *> m_path;
         std::vector<weight_t> m_log_old_weights;
+        // ET: how much of m_path is in use (the path buffers have room for a
+        // whole context), then the KT multipliers of the nodes on the path
+        // for the symbol being predicted and the counts they are computed from
+        size_t m_path_length;
+        std::vector<double> m_log_est_muls;
+        std::vector<count_t> m_path_counts;
+        std::vector<count_t> m_path_totals;
+        std::vector<float> m_kt_scratch;
+        // ET: (see freshWeights)
+        std::vector<double> m_fresh_weighted;
    
         //history_t &m_history;
    //ET: making this not a reference!
@@ -166,5 +327,139 @@ class SwitchingTree : public Compressor, boost::noncopyable {
    size_t m_num_symbols;
 };
 
+/*ET: The trees everything else uses (single precision and fast math)*/
+typedef SNodeT<FloatPrecision> SNode;
+typedef SwitchingTreeT<FloatPrecision> SwitchingTree;
+
+/*ET: A read-only copy of a SwitchingTree for sampling (see genRandomSymbol).
+  Each node stores the probability of stopping there and the KT probability of a 1
+  as fixed point integers, so a sample is a walk of integer comparisons.
+  Nodes are laid out depth first (a node's 0 child follows it directly).*/
+class FrozenTree : boost::noncopyable {
+
+  public:
+   typedef FastMath Math; //the math of the trees it is made from
+
+   FrozenTree(const SwitchingTree& tree);
+
+   //Same as tree.genRandomSymbol, using the context in the history of tree
+   //(the tree this was made from, or one sharing its nodes)
+   bit_t genRandomSymbol(const SwitchingTree& tree, randgen_t& rng) const;
+   //The probability that genRandomSymbol returns 1 in the current context of tree
+   double genRandomSymbolProb(const SwitchingTree& tree) const;
+   //Same as tree.genRandomSymbolProbs
+   void genRandomSymbolProbs(const SwitchingTree& tree, size_t branchBits, std::vector<double>& probs) const;
+
+   size_t size() const;
+
+  private:
+   struct Node
+   {
+      //probabilities scaled by 2^32
+      boost::uint32_t stop;
+      boost::uint32_t one;
+      //index of the child for each bit (0 if none, since the root is no one's child)
+      boost::uint32_t child[2];
+      //1 + the index of the context the node was pruned in (0 if it wasn't)
+      boost::uint32_t pruned;
+   };
+
+   //appends n and its descendants, returning n's index
+   boost::uint32_t compile(const SNode* n);
+
+   //whether the pruned path below n (at depth i) follows symb
+   bool prunedPathContinues(const Node* n, size_t i, bit_t symb) const;
+
+   //genRandomSymbolProbs from n at depth i (as in SwitchingTree)
+   void genRandomSymbolProbsFrom(const Node* n, size_t i, size_t value, double reachProb, double prob, const history_t& history, size_t branchBits, std::vector<double>& probs) const;
+
+   std::vector<Node> m_nodes;
+   size_t m_depth;
+   //the contexts of the pruned nodes, packed into m_context_words words each
+   std::vector<boost::uint64_t> m_pruned_bits;
+   size_t m_context_words;
+};
+
+/*ET: A read-only tree used in place from a block of memory (e.g. a memory mapped
+  file, so processes using the same model share one copy in the page cache).
+  write lays a SwitchingTree out as a header followed by an array of fixed size nodes
+  (depth first, children by index) holding the node statistics for prob and
+  fixed point sampling probabilities as in FrozenTree.
+  Child indices are checked as they are followed, so mapping a tree reads only its header.*/
+class MappedTree : boost::noncopyable {
+
+  public:
+   typedef FastMath Math; //the math of the trees it is made from
+
+   MappedTree();
+
+   //Writes the image of tree (a multiple of 8 bytes long)
+   static void write(const SwitchingTree& tree, std::ostream& out);
+
+   //Uses the image at data (8 byte aligned, which must outlive this), setting used
+   //to its length. Returns false if it is not an image of a tree with the
+   //given depth, phase and pruning and the same CTS settings.
+   bool map(const char* data, size_t size, size_t depth, int phase, bool pruneUniquePaths, size_t& used);
+
+   //Same as tree.prob, using the context in the history of tree
+   //(without creating nodes: missing nodes count as new ones)
+   double prob(const SwitchingTree& tree, bit_t b) const;
+   //Same as FrozenTree's
+   bit_t genRandomSymbol(const SwitchingTree& tree, randgen_t& rng) const;
+   double genRandomSymbolProb(const SwitchingTree& tree) const;
+   void genRandomSymbolProbs(const SwitchingTree& tree, size_t branchBits, std::vector<double>& probs) const;
+
+   size_t size() const;
+
+  private:
+   struct Node
+   {
+      weight_t log_prob_est;
+      weight_t log_prob_weighted;
+      weight_t log_b;
+      weight_t log_s;
+      count_t count[2];
+      //index of the child for each bit (0 if none)
+      boost::uint32_t child[2];
+      //probabilities scaled by 2^32
+      boost::uint32_t stop;
+      boost::uint32_t one;
+      //1 + the index of the context the node was pruned in (0 if it wasn't)
+      boost::uint32_t pruned;
+   };
+
+   //appends n and its descendants to nodes (and the contexts of pruned nodes
+   //to prunedBits, in words of contextWords), returning n's index
+   static boost::uint32_t compile(const SNode* n, std::vector<Node>& nodes, std::vector<boost::uint64_t>& prunedBits, size_t contextWords);
+
+   //the context n was pruned in (NULL if it wasn't)
+   const boost::uint64_t* prunedContext(const Node* n) const;
+
+   //whether the path below n (at depth i) follows symb because n is pruned
+   bool prunedPathContinues(const Node* n, size_t i, bit_t symb) const;
+
+   //tree.prob's weighted log probability for the node n at depth i of the path
+   double probFrom(const Node* n, size_t i, const history_t& history, bit_t b) const;
+
+   //The child of n in the context at depth i of history (NULL if there isn't one)
+   const Node* child(const Node* n, const history_t& history, size_t i) const;
+   //The child of n (at depth i) for symb
+   const Node* child(const Node* n, bit_t symb, size_t i) const;
+
+   //genRandomSymbolProbs from n at depth i (as in SwitchingTree)
+   void genRandomSymbolProbsFrom(const Node* n, size_t i, size_t value, double reachProb, double prob, const history_t& history, size_t branchBits, std::vector<double>& probs) const;
+
+   const Node* m_nodes;
+   size_t m_num_nodes;
+   size_t m_depth;
+   bool m_prune_unique_paths;
+   const boost::uint64_t* m_pruned_bits;
+   size_t m_num_contexts;
+   size_t m_context_words;
+   //m_fresh_weighted[k] is the weighted log probability that the bottom k
+   //nodes of a path would give if they were all new
+   std::vector<double> m_fresh_weighted;
+};
+
 #endif // __CTS_HPP__
 
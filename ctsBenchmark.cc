@@ -0,0 +1,225 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#include "cts.hpp"
+#include "ShooterModel.h"
+
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cmath>
+#include <sys/time.h>
+
+using namespace std;
+
+/*Compares the precision and math policies (see CTSPrecision.h and CTSMath.h)
+  on the same data: the per-pixel contexts a ConvolutionalBinaryCTS would see
+  in Shooter games played with random actions. Each tree learns the whole
+  sequence, predicting each pixel before learning it: the log-probability of
+  the sequence is the sum of those predictions' (against the double precision,
+  exact math tree's), and the largest |P(0) + P(1) - 1| shows how far the
+  lossy policies' predictions are from being normalized (a tree whose
+  predictions sum to more than 1 can seem to beat the exact one, so the extra
+  bits are also given with each prediction normalized). (The block
+  log-probability the tree stores at its root is not used, since with lossy
+  precisions it drifts from the predictions actually made.) Another tree of
+  the same kind then learns the sequence without predicting, reporting the time
+  per update, and predicts every pixel again, reporting the time per prob.
+  Times leave out setting the context.*/
+
+/*A pixel to predict and the bits of its context*/
+struct Example
+{
+   vector<bit_t> context;
+   bit_t pixel;
+};
+
+/*Encodes the neighborhood of (x, y) in the previous frame (with a bit for
+  whether each position is on the screen) and the action*/
+void encodeContext(const vector<int>& prevObs, int act, int x, int y, int width, int height, int neighborhoodWidth, int neighborhoodHeight, vector<bit_t>& context)
+{
+   context.clear();
+   for(int b = 0; b < 2; b++)
+   {
+      context.push_back((act >> b) & 1);
+   }
+   for(int xOff = 0; xOff < neighborhoodWidth; xOff++)
+   {
+      for(int yOff = 0; yOff < neighborhoodHeight; yOff++)
+      {
+	 int actualX = x + xOff - neighborhoodWidth/2;
+	 int actualY = y + yOff - neighborhoodHeight/2;
+	 bool onScreen = actualX >= 0 && actualX < width && actualY >= 0 && actualY < height;
+	 context.push_back(onScreen && prevObs[actualX*height + actualY]);
+	 context.push_back(onScreen);
+      }
+   }
+}
+
+void generateExamples(int numSteps, int neighborhoodWidth, int neighborhoodHeight, int trial, vector<Example>& examples)
+{
+   const int numTargets = 3;
+   const int height = 15;
+   const int width = numTargets*5;
+   srand(trial);
+
+   ShooterModel world(numTargets, height);
+   vector<int> obs;
+   int reward;
+   bool end;
+   world.reset();
+   world.takeAction(0, obs, reward, end);
+   for(int t = 0; t < numSteps; t++)
+   {
+      vector<int> prevObs = obs;
+      int act = rand()%4;
+      world.takeAction(act, obs, reward, end);
+      for(int x = 0; x < width; x++)
+      {
+	 for(int y = 0; y < height; y++)
+	 {
+	    Example ex;
+	    encodeContext(prevObs, act, x, y, width, height, neighborhoodWidth, neighborhoodHeight, ex.context);
+	    ex.pixel = obs[x*height + y] != 0;
+	    examples.push_back(ex);
+	 }
+      }
+      if(end)
+      {
+	 world.reset();
+	 world.takeAction(0, obs, reward, end);
+      }
+   }
+}
+
+double seconds()
+{
+   struct timeval t;
+   gettimeofday(&t, NULL);
+   return t.tv_sec + t.tv_usec*1e-6;
+}
+
+struct Result
+{
+   double logProb; //of the whole sequence (in bits), predicted a pixel at a time
+   double normalizedLogProb; //the same, with P(0) + P(1) scaled to 1
+   double maxNormError; //the largest |P(0) + P(1) - 1|
+   double updateTime; //per example (in ns)
+   double probTime;
+   size_t numNodes;
+};
+
+/*The time per example (in ns) spent setting the context (to leave out of the other times)*/
+double contextTime(const vector<Example>& examples)
+{
+   SwitchingTree tree(examples[0].context.size());
+   double start = seconds();
+   for(size_t i = 0; i < examples.size(); i++)
+   {
+      tree.resetHistory();
+      tree.updateHistory(examples[i].context);
+   }
+   return (seconds() - start)*1e9/examples.size();
+}
+
+/*Trains a tree with the given policies on the examples, predicting each before
+  learning it, then times training another tree and predicting the examples*/
+template<class Precision, class Math> Result run(const vector<Example>& examples, double contextNs)
+{
+   Result result;
+   result.logProb = 0;
+   result.normalizedLogProb = 0;
+   result.maxNormError = 0;
+   {
+      SwitchingTreeT<Precision, Math> predictor(examples[0].context.size());
+      for(size_t i = 0; i < examples.size(); i++)
+      {
+	 predictor.resetHistory();
+	 predictor.updateHistory(examples[i].context);
+	 double p = predictor.prob(examples[i].pixel);
+	 double other = predictor.prob(!examples[i].pixel);
+	 result.logProb += log(p)/log(2.0);
+	 result.normalizedLogProb += log(p/(p + other))/log(2.0);
+	 result.maxNormError = max(result.maxNormError, fabs(p + other - 1));
+	 predictor.update(examples[i].pixel);
+      }
+   }
+
+   SwitchingTreeT<Precision, Math> tree(examples[0].context.size());
+   double start = seconds();
+   for(size_t i = 0; i < examples.size(); i++)
+   {
+      tree.resetHistory();
+      tree.updateHistory(examples[i].context);
+      tree.update(examples[i].pixel);
+   }
+   result.updateTime = (seconds() - start)*1e9/examples.size() - contextNs;
+   result.numNodes = tree.size();
+
+   //Keeps the compiler from skipping the predictions
+   double total = 0;
+   start = seconds();
+   for(size_t i = 0; i < examples.size(); i++)
+   {
+      tree.resetHistory();
+      tree.updateHistory(examples[i].context);
+      total += tree.prob(examples[i].pixel);
+   }
+   result.probTime = (seconds() - start)*1e9/examples.size() - contextNs;
+   if(total < 0)
+   {
+      cout << total << endl;
+   }
+   return result;
+}
+
+template<class Precision, class Math> void report(const string& name, const vector<Example>& examples, double contextNs, const Result& reference)
+{
+   Result result = run<Precision, Math>(examples, contextNs);
+   size_t nodeBytes = sizeof(SNodeT<Precision, Math>);
+   cout << setw(14) << name
+	<< setw(10) << result.updateTime
+	<< setw(10) << result.probTime
+	<< setw(14) << -result.logProb/examples.size()
+	<< setw(14) << (reference.logProb - result.logProb)/examples.size()
+	<< setw(14) << (reference.normalizedLogProb - result.normalizedLogProb)/examples.size()
+	<< setw(14) << result.maxNormError
+	<< setw(10) << result.numNodes
+	<< setw(12) << nodeBytes
+	<< setw(12) << result.numNodes*nodeBytes/1048576.0 << endl;
+}
+
+int main(int argc, char** argv)
+{
+   if(argc <= 4)
+   {
+      cout << "Usage: ./ctsBenchmark numSteps neighborhoodWidth neighborhoodHeight trial" << endl;
+      cout << "numSteps -- the number of frames to learn" << endl;
+      cout << "neighborhoodWidth -- the width of the convolutional neighborhood" << endl;
+      cout << "neighborhoodHeight -- the height of the convolutional neighborhood" << endl;
+      cout << "trial -- the trial number (determines the random seed)" << endl;
+      exit(1);
+   }
+
+   int numSteps = atoi(argv[1]);
+   int neighborhoodWidth = atoi(argv[2]);
+   int neighborhoodHeight = atoi(argv[3]);
+   int trial = atoi(argv[4]);
+
+   vector<Example> examples;
+   generateExamples(numSteps, neighborhoodWidth, neighborhoodHeight, trial, examples);
+
+   double contextNs = contextTime(examples);
+   Result reference = run<DoublePrecision, ExactMath>(examples, contextNs);
+
+   cout << examples.size() << " pixels, " << examples[0].context.size() << " context bits" << endl;
+   cout << setw(14) << "policy" << setw(10) << "ns/update" << setw(10) << "ns/prob" << setw(14) << "bits/pixel" << setw(14) << "extra bits" << setw(14) << "(normalized)" << setw(14) << "max|P0+P1-1|" << setw(10) << "nodes" << setw(12) << "bytes/node" << setw(12) << "MB" << endl;
+   report<DoublePrecision, ExactMath>("double/exact", examples, contextNs, reference);
+   report<DoublePrecision, FastMath>("double/fast", examples, contextNs, reference);
+   report<FloatPrecision, ExactMath>("float/exact", examples, contextNs, reference);
+   report<FloatPrecision, FastMath>("float/fast", examples, contextNs, reference);
+   report<CompactPrecision, ExactMath>("compact/exact", examples, contextNs, reference);
+   report<CompactPrecision, FastMath>("compact/fast", examples, contextNs, reference);
+}
@@ -0,0 +1,599 @@
+/********************
+Author: Erik Talvitie
+********************/
+
+#include "cts.hpp"
+#include "ConvolutionalBinaryCTS.h"
+#include "UnrolledCTS.h"
+#include "ShooterModel.h"
+#include "ShooterRewardModel.h"
+#include "PatchRewardModel.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <unistd.h>
+#include <omp.h>
+
+using namespace std;
+
+/*Checks that the ways of storing and querying the CTS trees give the answers
+  they should, on the data a ConvolutionalBinaryCTS sees in Shooter games played
+  with random actions (each pixel's context is set by resetting the history):
+  - with unique path pruning, a tree predicts what the unpruned tree does
+    (up to rounding with double precision and exact math, and closely with the
+    float trees and fast math the models use)
+  - asking for a probability doesn't change the tree (asking again, after asking
+    about another context, gives exactly the same answer)
+  - a model answers exactly the same from a file it has mapped (see
+    ConvolutionalBinaryCTS::mapFile) as from its own trees
+  - a model (or an UnrolledCTS) saved and loaded again predicts, samples and
+    learns exactly as the one saved
+  - sampling into a packed frame samples the same frames, and lists the pixels
+    that changed
+  - evaluating an UnrolledCTS gives each model its own LL without splitting
+    the models that share trees
+  - the learned reward model converges in each training mode, at step sizes
+    where plain SGD does
+  - the Shooter reward model scores packed frames exactly as pixel vectors,
+    for 1-6 targets and heights 6-20
+  Exits with a nonzero status if any check fails.*/
+
+const int numTargets = 3;
+const int height = 15;
+const int width = numTargets*5;
+const int numActions = 4;
+const int neighborhoodSize = 3;
+
+int numFailures = 0;
+
+void check(bool ok, const string& what, double difference)
+{
+   cout << (ok ? "ok    " : "FAIL  ") << what << " (largest difference " << difference << ")" << endl;
+   if(!ok)
+   {
+      numFailures++;
+   }
+}
+
+/*A game played with random actions: the action before each frame and the frame*/
+struct Game
+{
+   vector<int> acts;
+   vector<vector<int> > frames;
+};
+
+void play(int numSteps, int seed, vector<Game>& games)
+{
+   srand(seed);
+   ShooterModel world(numTargets, height);
+   vector<int> obs;
+   int reward;
+   bool end = true;
+   for(int t = 0; t < numSteps; t++)
+   {
+      if(end)
+      {
+	 world.reset();
+	 world.takeAction(0, obs, reward, end);
+	 games.push_back(Game());
+	 games.back().acts.push_back(0);
+	 games.back().frames.push_back(obs);
+      }
+      int act = rand()%numActions;
+      world.takeAction(act, obs, reward, end);
+      games.back().acts.push_back(act);
+      games.back().frames.push_back(obs);
+   }
+}
+
+/*The context of pixel (x, y) as an order 1 ConvolutionalBinaryCTS encodes it:
+  the action, then the neighborhood in the previous frame (each position's
+  color and whether it is on the screen)*/
+void encodeContext(const vector<int>& prevObs, int act, int x, int y, vector<bit_t>& context)
+{
+   context.clear();
+   for(int b = 1; b >= 0; b--)
+   {
+      context.push_back((act >> b) & 1);
+   }
+   for(int xOff = 0; xOff < neighborhoodSize; xOff++)
+   {
+      for(int yOff = 0; yOff < neighborhoodSize; yOff++)
+      {
+	 int actualX = x + xOff - neighborhoodSize/2;
+	 int actualY = y + yOff - neighborhoodSize/2;
+	 bool onScreen = actualX >= 0 && actualX < width && actualY >= 0 && actualY < height;
+	 context.push_back(onScreen && prevObs[actualX*height + actualY]);
+	 context.push_back(onScreen);
+      }
+   }
+}
+
+/*Sets the context of the tree and asks for the probability of pixel*/
+template<class Tree> double ask(Tree& tree, const vector<bit_t>& context, bit_t pixel)
+{
+   tree.resetHistory();
+   tree.updateHistory(context);
+   return tree.prob(pixel);
+}
+
+/*Trains a pruned and an unpruned tree on every pixel of the games, comparing
+  their predictions before each update and asking each tree twice (the trees
+  are asked the same things, since setting the context moves the switching rate)*/
+template<class Precision, class Math> void checkTrees(const vector<Game>& games, const string& name, double tolerance)
+{
+   vector<bit_t> context;
+   vector<bit_t> otherContext;
+   encodeContext(games[0].frames[0], 0, 0, 0, context);
+   SwitchingTreeT<Precision, Math> pruned(context.size(), -1, true);
+   SwitchingTreeT<Precision, Math> unpruned(context.size(), -1, false);
+
+   double prunedDifference = 0;
+   double repeatDifference = 0;
+   for(size_t g = 0; g < games.size(); g++)
+   {
+      for(size_t t = 1; t < games[g].frames.size(); t++)
+      {
+	 const vector<int>& prevObs = games[g].frames[t - 1];
+	 for(int pos = 0; pos < width*height; pos++)
+	 {
+	    bit_t pixel = games[g].frames[t][pos] != 0;
+	    encodeContext(prevObs, games[g].acts[t], pos/height, pos%height, context);
+	    double prunedProb = ask(pruned, context, pixel);
+	    double unprunedProb = ask(unpruned, context, pixel);
+	    prunedDifference = max(prunedDifference, fabs(log(prunedProb) - log(unprunedProb)));
+
+	    //Ask about a neighboring pixel's context, then again
+	    int other = (pos + 1)%(width*height);
+	    bit_t otherPixel = games[g].frames[t][other] != 0;
+	    encodeContext(prevObs, games[g].acts[t], other/height, other%height, otherContext);
+	    ask(pruned, otherContext, otherPixel);
+	    ask(unpruned, otherContext, otherPixel);
+	    repeatDifference = max(repeatDifference, fabs(log(prunedProb) - log(ask(pruned, context, pixel))));
+	    repeatDifference = max(repeatDifference, fabs(log(unprunedProb) - log(ask(unpruned, context, pixel))));
+
+	    pruned.update(pixel);
+	    unpruned.update(pixel);
+	 }
+      }
+   }
+
+   check(prunedDifference <= tolerance, name + ": pruned tree predicts what the unpruned tree does", prunedDifference);
+   check(repeatDifference == 0, name + ": asking again gives the same answer", repeatDifference);
+}
+
+/*Plays the games through a model, learning from them*/
+void train(ConvolutionalBinaryCTS& model, const vector<Game>& games)
+{
+   for(size_t g = 0; g < games.size(); g++)
+   {
+      model.reset();
+      model.update(games[g].acts[0], games[g].frames[0], false, false, false);
+      for(size_t t = 1; t < games[g].frames.size(); t++)
+      {
+	 model.update(games[g].acts[t], games[g].frames[t], false, t + 1 == games[g].frames.size());
+      }
+   }
+}
+
+/*Compares the log probabilities models give the frames of the games (without learning
+  from them), returning the largest difference between the first model and each other.
+  Each model is asked twice, setting repeatDifference to the largest difference between
+  its answers.*/
+double compare(vector<ConvolutionalBinaryCTS*>& models, const vector<Game>& games, double& repeatDifference)
+{
+   double difference = 0;
+   repeatDifference = 0;
+   for(size_t g = 0; g < games.size(); g++)
+   {
+      for(size_t m = 0; m < models.size(); m++)
+      {
+	 models[m]->reset();
+	 models[m]->update(games[g].acts[0], games[g].frames[0], false, false, false);
+      }
+      for(size_t t = 1; t < games[g].frames.size(); t++)
+      {
+	 double first = 0;
+	 for(size_t m = 0; m < models.size(); m++)
+	 {
+	    double logProb = log(models[m]->predict(games[g].acts[t], games[g].frames[t]));
+	    double again = log(models[m]->predict(games[g].acts[t], games[g].frames[t]));
+	    repeatDifference = max(repeatDifference, fabs(logProb - again));
+	    if(m == 0)
+	    {
+	       first = logProb;
+	    }
+	    difference = max(difference, fabs(first - logProb));
+	 }
+	 for(size_t m = 0; m < models.size(); m++)
+	 {
+	    models[m]->update(games[g].acts[t], games[g].frames[t], false, false, false);
+	 }
+      }
+   }
+   return difference;
+}
+
+/*Whether two models sample the same frames when taking the actions of a game
+  from its first frame (so whether their random streams are the same)
+  If trackFrame, b keeps a packed frame as it samples, which has to end up
+  holding the sample, with the pixels that changed listed*/
+bool sampleSame(ConvolutionalBinaryCTS& a, ConvolutionalBinaryCTS& b, const Game& game, bool trackFrame = false)
+{
+   a.reset();
+   b.reset();
+   a.update(game.acts[0], game.frames[0], false, false, false);
+   b.update(game.acts[0], game.frames[0], false, false, false);
+   vector<int> sampledB = game.frames[0];
+   BitFrame frame(sampledB);
+   vector<int> changed;
+   for(size_t t = 1; t < game.frames.size(); t++)
+   {
+      vector<int> sampledA;
+      vector<int> lastB = sampledB;
+      int rewardA, rewardB;
+      bool endA, endB;
+      a.takeAction(game.acts[t], sampledA, rewardA, endA);
+      if(trackFrame)
+      {
+	 b.takeAction(game.acts[t], sampledB, frame, changed, rewardB, endB);
+	 vector<int> expected;
+	 for(unsigned p = 0; p < sampledB.size(); p++)
+	 {
+	    if(sampledB[p] != lastB[p])
+	    {
+	       expected.push_back(p);
+	    }
+	 }
+	 if(frame != BitFrame(sampledB) || changed != expected)
+	 {
+	    return false;
+	 }
+      }
+      else
+      {
+	 b.takeAction(game.acts[t], sampledB, rewardB, endB);
+      }
+      if(sampledA != sampledB || rewardA != rewardB || endA != endB)
+      {
+	 return false;
+      }
+   }
+   return true;
+}
+
+/*The steps of the games as batchUpdate takes them (each frame given the one before)*/
+void gameData(const vector<Game>& games, vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& data)
+{
+   for(size_t g = 0; g < games.size(); g++)
+   {
+      for(size_t t = 1; t < games[g].frames.size(); t++)
+      {
+	 data.push_back(make_tuple(vector<vector<int> >(1, games[g].frames[t - 1]), vector<int>(1, games[g].acts[t - 1]), games[g].acts[t], games[g].frames[t], 0, false));
+      }
+   }
+}
+
+/*A name for a temporary file (which the caller removes)*/
+string temporaryFile()
+{
+   char name[] = "/tmp/ctsTestXXXXXX";
+   int fd = mkstemp(name);
+   if(fd < 0)
+   {
+      cerr << "Could not create a temporary file" << endl;
+      exit(1);
+   }
+   close(fd);
+   return name;
+}
+
+void checkModels(const vector<Game>& trainGames, const vector<Game>& testGames)
+{
+   ConvolutionalBinaryCTS pruned(width, height, neighborhoodSize, neighborhoodSize, numActions, 1, 1, true);
+   ConvolutionalBinaryCTS unpruned(width, height, neighborhoodSize, neighborhoodSize, numActions, 1, 1, false);
+   train(pruned, trainGames);
+   train(unpruned, trainGames);
+
+   //(Fast math rounds differently on the pruned and unpruned paths)
+   vector<ConvolutionalBinaryCTS*> models;
+   models.push_back(&pruned);
+   models.push_back(&unpruned);
+   double repeatDifference;
+   double difference = compare(models, testGames, repeatDifference);
+   check(difference < 0.1, "model: pruned model predicts what the unpruned model does (nats per frame)", difference);
+   check(repeatDifference == 0, "model: predicting again gives the same answer", repeatDifference);
+
+   string filename = temporaryFile();
+   {
+      ofstream out(filename.c_str(), ios::binary);
+      pruned.saveMappable(out);
+   }
+   ConvolutionalBinaryCTS mapped(width, height, neighborhoodSize, neighborhoodSize, numActions, 1, 2, true);
+   bool mappedOk = mapped.mapFile(filename);
+   check(mappedOk, "model: mapFile maps the file saveMappable wrote", 0);
+   if(mappedOk)
+   {
+      models[1] = &mapped;
+      difference = compare(models, testGames, repeatDifference);
+      check(difference == 0, "model: mapped model predicts what the live model does", difference);
+   }
+   remove(filename.c_str());
+
+   filename = temporaryFile();
+   {
+      ofstream out(filename.c_str(), ios::binary);
+      pruned.save(out);
+   }
+   ConvolutionalBinaryCTS loaded(width, height, neighborhoodSize, neighborhoodSize, numActions, 1, 3, true);
+   ifstream in(filename.c_str(), ios::binary);
+   bool loadedOk = loaded.load(in);
+   check(loadedOk, "model: load reads the file save wrote", 0);
+   if(loadedOk)
+   {
+      models[1] = &loaded;
+      difference = compare(models, testGames, repeatDifference);
+      check(difference == 0, "model: loaded model predicts what the saved model does", difference);
+      check(sampleSame(pruned, loaded, testGames[0]), "model: loaded model samples what the saved model does", 0);
+      check(sampleSame(pruned, loaded, testGames[0], true), "model: sampling into a packed frame samples the same, and lists the pixels that changed", 0);
+      pruned.setTransitionCache(size_t(16) << 20);
+      loaded.setTransitionCache(size_t(16) << 20);
+      check(sampleSame(pruned, loaded, testGames[0], true), "model: sampling into a packed frame from the transition cache does too", 0);
+      pruned.setTransitionCache(0);
+      loaded.setTransitionCache(0);
+      train(pruned, testGames);
+      train(loaded, testGames);
+      difference = compare(models, trainGames, repeatDifference);
+      check(difference == 0, "model: loaded model learns what the saved model does", difference);
+   }
+   remove(filename.c_str());
+}
+
+/*Models trained on the same data share their trees, so an UnrolledCTS saves
+  them once: models 0 and 1 are trained on the same data and model 2 on other data*/
+void checkUnrolled(const vector<Game>& trainGames, const vector<Game>& testGames)
+{
+   vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > > data(3);
+   gameData(trainGames, data[0]);
+   data[1] = data[0];
+   gameData(testGames, data[2]);
+   UnrolledCTS saved(3, width, height, neighborhoodSize, neighborhoodSize, numActions, 1, 1);
+   saved.batchUpdate(data);
+
+   string filename = temporaryFile();
+   {
+      ofstream out(filename.c_str(), ios::binary);
+      saved.save(out);
+   }
+   UnrolledCTS loaded(3, width, height, neighborhoodSize, neighborhoodSize, numActions, 1, 2);
+   ifstream in(filename.c_str(), ios::binary);
+   bool loadedOk = loaded.load(in);
+   check(loadedOk, "unrolled: load reads the file save wrote", 0);
+   if(loadedOk)
+   {
+      for(int m = 0; m < saved.size(); m++)
+      {
+	 vector<ConvolutionalBinaryCTS*> models;
+	 models.push_back(saved[m]);
+	 models.push_back(loaded[m]);
+	 double repeatDifference;
+	 double difference = compare(models, testGames, repeatDifference);
+	 check(difference == 0, "unrolled: each loaded model predicts what the saved one does", difference);
+	 check(sampleSame(*saved[m], *loaded[m], testGames[0]), "unrolled: each loaded model samples what the saved one does", 0);
+      }
+   }
+   remove(filename.c_str());
+
+   //Models 0 and 1 learned from the same data, so they share their trees; evaluating
+   //them on different data has to keep them shared and give each its own LL
+   stringstream before;
+   saved.save(before);
+   vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > > testData(3);
+   testData[0] = data[2];
+   testData[1] = data[0];
+   testData[2] = data[2];
+   vector<double> ll;
+   saved.batchLL(testData, ll);
+   stringstream after;
+   saved.save(after);
+   //(a split group's trees would be written once more)
+   check(after.str().size() == before.str().size(), "unrolled: batchLL keeps models that share trees sharing them", 0);
+   double llDifference = 0;
+   for(int m = 0; m < saved.size(); m++)
+   {
+      llDifference = max(llDifference, fabs(ll[m] - saved[m]->batchLL(testData[m])));
+   }
+   check(llDifference == 0, "unrolled: batchLL gives each model its own LL", llDifference);
+}
+
+/*Labels the frames of Shooter games with their rewards, as the drivers do. Half the
+  actions follow the optimal policy (so targets get hit) and the rest are random.*/
+void rewardData(int numSteps, int seed, vector<tuple<vector<int>, int, float, float> >& data)
+{
+   srand(seed);
+   ShooterModel world(numTargets, height);
+   ShooterRewardModel worldReward(numTargets, height);
+   vector<int> obs;
+   int reward;
+   bool end = true;
+   int t = 0;
+   for(int step = 0; step < numSteps; step++)
+   {
+      if(end || t == 30)
+      {
+	 world.reset();
+	 world.takeAction(0, obs, reward, end);
+	 t = 0;
+      }
+      int act = t == 1 || t == 7 || t == 13 ? 3 : 2;
+      if(rand()%2)
+      {
+	 act = rand()%numActions;
+      }
+      data.push_back(make_tuple(obs, act, worldReward.getReward(act, obs), 1.0f));
+      world.takeAction(act, obs, reward, end);
+      t++;
+   }
+}
+
+/*Trains a reward model in each mode for a few passes over the data, on several threads.
+  Serial SGD's error has to fall, and the parallel modes' has to end up near it.*/
+void checkRewardModels(const vector<tuple<vector<int>, int, float, float> >& data)
+{
+   const int numPasses = 5;
+   const char* modeNames[] = {"serial", "hogwild", "minibatch"};
+   int numThreads = omp_get_max_threads();
+   omp_set_num_threads(4);
+
+   const float stepSizes[] = {0.3, 1};
+   for(int s = 0; s < 2; s++)
+   {
+      double serialMSE = 0;
+      for(int mode = PatchRewardModel::SERIAL; mode <= PatchRewardModel::MINIBATCH; mode++)
+      {
+	 PatchRewardModel model(numActions, width, height, 3, 3, stepSizes[s]);
+	 model.setTrainingMode(PatchRewardModel::TrainingMode(mode));
+	 double firstMSE = model.batchMSE(data);
+	 for(int pass = 0; pass < numPasses; pass++)
+	 {
+	    model.batchUpdate(data);
+	 }
+	 double mse = model.batchMSE(data);
+
+	 stringstream name;
+	 name << "reward model (" << modeNames[mode] << ", step size " << stepSizes[s] << ")";
+	 if(mode == PatchRewardModel::SERIAL)
+	 {
+	    serialMSE = mse;
+	    check(mse < firstMSE/2, name.str() + ": training reduces the error (to this fraction)", mse/firstMSE);
+	 }
+	 else
+	 {
+	    check(mse < 2*serialMSE + 1e-3, name.str() + ": error ends up near serial SGD's (this much higher)", mse - serialMSE);
+	 }
+      }
+   }
+
+   omp_set_num_threads(numThreads);
+}
+
+/*Checks that ShooterRewardModel's packed kernel (one frame at a time, a batch of
+  frames, and frames kept up to date along a trajectory) gives the rewards the pixel
+  vector version does, for every size of game. The frames are played with a policy
+  that is half optimal (so targets get hit), plus copies with an explosion, a
+  bullseye, or random pixels drawn over a random target.*/
+void checkRewardKernel(int numSteps)
+{
+   srand(4);
+   double largest = 0;
+   int numRewarding = 0;
+   for(int targets = 1; targets <= 6; targets++)
+   {
+      for(int rows = 6; rows <= 20; rows++)
+      {
+	 int cols = targets*5;
+	 ShooterModel world(targets, rows);
+	 ShooterRewardModel rewardModel(targets, rows);
+	 vector<int> obs;
+	 vector<int> changed;
+	 int reward;
+	 bool end = true;
+	 int t = 0;
+	 BitFrame frame;
+	 RewardFeatures features;
+	 vector<int> actions;
+	 vector<BitFrame> frames;
+	 vector<float> vectorRewards;
+	 for(int step = 0; step < numSteps; step++)
+	 {
+	    if(end || t == 30)
+	    {
+	       world.reset();
+	       world.takeAction(0, obs, reward, end);
+	       frame.pack(obs);
+	       rewardModel.initFeatures(obs, features);
+	       t = 0;
+	    }
+	    int act = t == 1 || t == 7 || t == 13 ? 3 : 2;
+	    if(rand()%2)
+	    {
+	       act = rand()%numActions;
+	    }
+
+	    float r = rewardModel.getReward(act, obs);
+	    largest = max(largest, double(fabs(rewardModel.getFeatureReward(act, features) - r)));
+	    actions.push_back(act);
+	    frames.push_back(BitFrame(obs));
+	    vectorRewards.push_back(r);
+
+	    for(int drawn = 0; drawn < 3; drawn++)
+	    {
+	       const int codes[] = {0x155, 0xAA, rand()%512};
+	       vector<int> stamped = obs;
+	       int corner = 2*cols + (rand()%targets)*5 + 1;
+	       for(int i = 0; i < 9; i++)
+	       {
+		  stamped[corner + (i/3)*cols + i%3] = (codes[drawn] >> (8 - i)) & 1;
+	       }
+	       actions.push_back(act);
+	       frames.push_back(BitFrame(stamped));
+	       vectorRewards.push_back(rewardModel.getReward(act, stamped));
+	    }
+
+	    world.takeAction(act, obs, frame, changed, reward, end);
+	    rewardModel.updateFeatures(obs, changed, features);
+	    t++;
+	 }
+
+	 vector<float> batchRewards;
+	 rewardModel.getRewards(actions, frames, batchRewards);
+	 for(unsigned f = 0; f < frames.size(); f++)
+	 {
+	    largest = max(largest, double(fabs(rewardModel.getReward(actions[f], frames[f]) - vectorRewards[f])));
+	    largest = max(largest, double(fabs(batchRewards[f] - vectorRewards[f])));
+	    numRewarding += vectorRewards[f] > 0;
+	 }
+      }
+   }
+   check(largest == 0 && numRewarding > 0, "shooter reward kernel: packed frames are rewarded as pixel vectors are", largest);
+}
+
+int main(int argc, char** argv)
+{
+   if(argc > 2)
+   {
+      cout << "Usage: ./ctsTest [numSteps]" << endl;
+      cout << "numSteps -- the number of frames to learn (default 300)" << endl;
+      exit(1);
+   }
+   int numSteps = argc > 1 ? atoi(argv[1]) : 300;
+
+   vector<Game> trainGames;
+   vector<Game> testGames;
+   play(numSteps, 1, trainGames);
+   play(numSteps/3, 2, testGames);
+
+   checkTrees<DoublePrecision, ExactMath>(trainGames, "double/exact", 1e-9);
+   checkTrees<FloatPrecision, FastMath>(trainGames, "float/fast", 0.05);
+   checkModels(trainGames, testGames);
+   checkUnrolled(trainGames, testGames);
+
+   vector<tuple<vector<int>, int, float, float> > rewardExamples;
+   rewardData(20*numSteps, 3, rewardExamples);
+   checkRewardModels(rewardExamples);
+   checkRewardKernel(numSteps);
+
+   if(numFailures > 0)
+   {
+      cout << numFailures << " check(s) failed" << endl;
+      return 1;
+   }
+   cout << "All checks passed" << endl;
+   return 0;
+}
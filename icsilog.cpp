@@ -1,4 +1,5 @@
 #include "icsilog.h"
+#include "SIMD.h"
 
 #include <cmath>
 
@@ -46,3 +47,43 @@ void fill_icsi_log_table2(const unsigned precision, float* const   pTable)
     }
 }
 
+
+#ifdef SIMD_AVX2
+/*ET: icsi_log_batch for as many multiples of 8 values as there are, returning how many it did */
+SIMD_TARGET_AVX2 static int icsi_log_avx2(const float *vals, float *out, int count, const float *lookup_table, int n)
+{
+    const __m256i expMask = _mm256_set1_epi32(255);
+    const __m256i expBias = _mm256_set1_epi32(127);
+    const __m256i manMask = _mm256_set1_epi32(0x7FFFFF);
+    const __m128i shift = _mm_cvtsi32_si128(23-n);
+    const __m256 ln2 = _mm256_set1_ps(0.69314718f);
+
+    int i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256i x = _mm256_castps_si256(_mm256_loadu_ps(vals + i));
+        __m256i log_2 = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(x, 23), expMask), expBias);
+        __m256i index = _mm256_srl_epi32(_mm256_and_si256(x, manMask), shift);
+        __m256 val = _mm256_i32gather_ps(lookup_table, index, 4);
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_add_ps(val, _mm256_cvtepi32_ps(log_2)), ln2));
+    }
+    return i;
+}
+#endif
+
+
+/*ET: icsi_log of count values, giving the same results as calling icsi_log on each one */
+void icsi_log_batch(const float *vals, float *out, int count, const float *lookup_table, int n)
+{
+    int i = 0;
+#ifdef SIMD_AVX2
+    if(haveAVX2())
+    {
+        i = icsi_log_avx2(vals, out, count, lookup_table, n);
+    }
+#endif
+    for(; i < count; i++)
+    {
+        out[i] = icsi_log(vals[i], lookup_table, n);
+    }
+}
@@ -41,6 +41,9 @@
 extern void fill_icsi_log_table(const int n,float *lookup_table);
 extern void fill_icsi_log_table2(const unsigned precision, float* const   pTable);
 
+/*ET: icsi_log of count values (8 at a time when the processor has AVX2) */
+extern void icsi_log_batch(const float *vals, float *out, int count, const float *lookup_table, int n);
+
 
 inline float icsi_log(float val,register const float *lookup_table,register const int n)
 {
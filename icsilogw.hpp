@@ -23,6 +23,9 @@ class ICSILog {
         /** Fast approximation to std::log. */
         float log(float x) { return icsi_log(x, m_table, m_n); }
 
+        /** ET: log of count values at once (may be done in place). */
+        void log(const float *x, float *out, size_t count) const { icsi_log_batch(x, out, int(count), m_table, m_n); }
+
     private:
 
         /** Disable copy constructor and assignment operator. */
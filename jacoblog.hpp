@@ -11,6 +11,8 @@
 
 #include <boost/utility.hpp>
 
+#include "SIMD.h"
+
 
 /** Builds a cache for a fast Jacobian Logarithm approximation. */
 class JacobianLogTable : private boost::noncopyable {
@@ -26,8 +28,15 @@ class JacobianLogTable : private boost::noncopyable {
         /** Compute the Jacobian Logarithm log(1+exp(x)). */
         double jacobianLog(double x) const;
 
+        /** ET: jacobianLog of count values at once (may be done in place). */
+        void jacobianLog(const float *x, float *out, size_t count) const;
+
     private:
 
+#ifdef SIMD_AVX2
+        size_t jacobianLogAVX2(const float *x, float *out, size_t count) const;
+#endif
+
         double *m_tbl, *m_tbl2;
         double m_index_mul;
         double m_step;
@@ -79,5 +88,55 @@ inline double JacobianLogTable::jacobianLog(double x) const {
     return x + m_tbl[i] + (x - x0) * m_tbl2[i];
 }
 
+
+#ifdef SIMD_AVX2
+/** ET: The batch jacobianLog for as many multiples of 8 values as there are,
+    returning how many it did. Works in double, like the scalar version. */
+SIMD_TARGET_AVX2 inline size_t JacobianLogTable::jacobianLogAVX2(const float *x, float *out, size_t count) const {
+
+    const __m256d limit     = _mm256_set1_pd(100.0);
+    const __m256d index_mul = _mm256_set1_pd(m_index_mul);
+    const __m256d step      = _mm256_set1_pd(m_step);
+
+    size_t n = 0;
+    for (; n + 8 <= count; n += 8) {
+
+        __m256 xs = _mm256_loadu_ps(x + n);
+        __m128 half[2] = { _mm256_castps256_ps128(xs), _mm256_extractf128_ps(xs, 1) };
+
+        for (int h=0; h < 2; h++) {
+            __m256d xd = _mm256_cvtps_pd(half[h]);
+
+            // values past the table look up entry 0 and are replaced by x afterwards
+            __m256d big = _mm256_cmp_pd(xd, limit, _CMP_GE_OQ);
+            __m128i i = _mm256_cvttpd_epi32(_mm256_andnot_pd(big, _mm256_mul_pd(xd, index_mul)));
+
+            __m256d x0 = _mm256_mul_pd(step, _mm256_cvtepi32_pd(i));
+            __m256d y = _mm256_add_pd(_mm256_add_pd(xd, _mm256_i32gather_pd(m_tbl, i, 8)),
+                                      _mm256_mul_pd(_mm256_sub_pd(xd, x0), _mm256_i32gather_pd(m_tbl2, i, 8)));
+            half[h] = _mm256_cvtpd_ps(_mm256_blendv_pd(y, xd, big));
+        }
+
+        _mm256_storeu_ps(out + n, _mm256_insertf128_ps(_mm256_castps128_ps256(half[0]), half[1], 1));
+    }
+
+    return n;
+}
+#endif
+
+
+/** ET: Compute the Jacobian Logarithm of count values, giving the same results
+    as the scalar version (rounded to float). */
+inline void JacobianLogTable::jacobianLog(const float *x, float *out, size_t count) const {
+
+    size_t n = 0;
+#ifdef SIMD_AVX2
+    if (haveAVX2()) n = jacobianLogAVX2(x, out, count);
+#endif
+    for (; n < count; n++) {
+        out[n] = float(jacobianLog(double(x[n])));
+    }
+}
+
 #endif // __JACOBLOG_HPP__
 
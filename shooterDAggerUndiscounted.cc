@@ -6,11 +6,14 @@ Author: Erik Talvitie
 #include "ShooterModel.h"
 #include "PatchRewardModel.h"
 #include "ShooterRewardModel.h"
+#include "PolicyCache.h"
+#include "Checkpoint.h"
 
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <cstdio>
 #include <boost/tuple/tuple.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/functional/hash.hpp>
@@ -18,14 +21,66 @@ Author: Erik Talvitie
 using namespace std;
 using namespace boost;
 
+/*The data points generated by a single sample*/
+struct Sample
+{
+   vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > dataset;
+   vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > hdataset;
+   vector<tuple<vector<int>, int, float, float> > rDataset;
+   vector<tuple<vector<int>, int, float, float> > hrDataset;
+};
+
+/*A random integer in [0, n) drawn from the given stream*/
+int randomInt(randgen_t& uniform, int n)
+{
+   return int(uniform()*n)%n;
+}
+
+/*Seeds a random stream from the trial number and the given identifiers,
+  so that results do not depend on how work is divided among threads*/
+unsigned streamSeed(int trial, int batch, size_t id)
+{
+   size_t seed = 0;
+   hash_combine(seed, trial);
+   hash_combine(seed, batch);
+   hash_combine(seed, id);
+   return seed;
+}
+
+/*Removes "--name value" from the arguments (if it is there), returning the value
+  (or "" if the option wasn't given), so the rest can be read by position*/
+string takeOption(int& argc, char** argv, const string& name)
+{
+   for(int i = 1; i + 1 < argc; i++)
+   {
+      if(argv[i] == "--" + name)
+      {
+	 string value = argv[i + 1];
+	 for(int j = i; j + 2 < argc; j++)
+	 {
+	    argv[j] = argv[j + 2];
+	 }
+	 argc -= 2;
+	 return value;
+      }
+   }
+   return "";
+}
+
 /* Takes a model, discount factor, current observation
    and uses one-ply Monte Carlo to choose an action.
+   uniform is the random stream for rollout actions and tie breaking.
    Optional parameters:
    printReturns/printRollouts - if true, prints things for debugging.*/
-int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& curObs, bool printReturns=false, bool printRollouts=false)
+int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& curObs, randgen_t& uniform, bool printReturns=false, bool printRollouts=false)
 {
    int numActions = model->getNumActs();
    vector<double> returns(numActions, 0);
+   RewardFeatures rootFeatures;
+   rewardModel->initFeatures(curObs, rootFeatures);
+   BitFrame rootFrame(curObs);
+   vector<int> changed;
+   model->expectEveryAction(rootFrame);
    for(int a = 0; a < numActions; a++)
    {
       for(int rollout = 0; rollout < rolloutsPerA; rollout++)
@@ -40,16 +95,22 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
 	 }
 	 double rolloutReturn = 0;
 	 vector<int> obs = curObs;
+	 BitFrame frame = rootFrame;
+	 RewardFeatures features = rootFeatures;
 	 for(int t = 0; t < rolloutDepth; t++)
 	 {
-	    float reward = rewardModel->getReward(action, obs);
+	    float reward = rewardModel->getFeatureReward(action, features);
 	    if(printRollouts)
 	    {
 	       cout << "A: " << action << " R: " << reward << endl;
 	    }
 	    bool endEpisode;
 	    int dummyReward;
-	    model->takeAction(action, obs, dummyReward, endEpisode);
+	    model->takeAction(action, obs, frame, changed, dummyReward, endEpisode);
+	    if(t < rolloutDepth-1)
+	    {
+	       rewardModel->updateFeatures(obs, changed, features);
+	    }
 	    if(printRollouts)
 	    {
 	       for(int y = 0; y < 15; y++)
@@ -65,7 +126,7 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
 	    rolloutReturn += discount*reward;
 	    discount *= discountFactor;
 
-	    action = rand()%numActions;
+	    action = randomInt(uniform, numActions);
 	 }
 	 if(printRollouts)
 	 {
@@ -101,8 +162,7 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
 	 maxActs.push_back(i);
       }
    }
-   int choice = rand();
-   choice = choice%maxActs.size();
+   int choice = randomInt(uniform, maxActs.size());
    return maxActs[choice];
 }
       
@@ -116,8 +176,9 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
   generates an action for each state, not a new action
   each time a state is visited. The cache ensures that
   each state is assigned a single action.
+  uniform - See onePlyMC
   printRollouts - See onePlyMC*/
-tuple<double, double, double> evaluate(ConvolutionalBinaryCTS* model, RewardModel* rewardModel, ShooterModel* world, ShooterRewardModel* worldReward, double discountFactor, int rolloutsPerA, int rolloutDepth, unordered_map<size_t, int>& policyCache, bool printRollouts=false)
+tuple<double, double, double> evaluate(ConvolutionalBinaryCTS* model, RewardModel* rewardModel, ShooterModel* world, ShooterRewardModel* worldReward, double discountFactor, int rolloutsPerA, int rolloutDepth, PolicyCache& policyCache, randgen_t& uniform, bool printRollouts=false)
 {
    double totalDiscountedReward = 0;
    double ll = 0;
@@ -161,19 +222,15 @@ tuple<double, double, double> evaluate(ConvolutionalBinaryCTS* model, RewardMode
 	    }
 	    cout << endl;
 	 }
-	 size_t hash = hash_range(obs.begin(), obs.end());
-	 int action = policyCache[hash];
-	 if(!action)
-	 {
-	    action = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obs, printRollouts, printRollouts);
-	    policyCache[hash] = action + 1;
-	 }
-	 else
+	 const BitFrame& state = world->getFrame();
+	 int action;
+	 if(!policyCache.lookup(state, action))
 	 {
-	    action--;
+	    action = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obs, uniform, printRollouts, printRollouts);
+	    policyCache.insert(state, action);
 	 }
 
-	 float r = worldReward->getReward(action, obs);
+	 float r = worldReward->getReward(action, world->getFrame());
 	 float predictedR = rewardModel->getReward(action, obs);
 	 rewardSSE += (r - predictedR)*(r - predictedR);
 	 count++;
@@ -198,16 +255,16 @@ tuple<double, double, double> evaluate(ConvolutionalBinaryCTS* model, RewardMode
   Type 0: Uniform random
   Type 1: Optimal policy
   Type 2: One-ply MC with a perfect model*/
-int explorationPolicy(ShooterModel* world, ShooterRewardModel* worldReward, vector<int>& curObs, int t, double discountFactor, int rolloutsPerA, int rolloutDepth, int numActions, int type)
+int explorationPolicy(ShooterModel* world, ShooterRewardModel* worldReward, vector<int>& curObs, int t, double discountFactor, int rolloutsPerA, int rolloutDepth, int numActions, int type, randgen_t& uniform)
 {
    int a = 0;
    if(type == 0) //Uniform random policy
    {
-      a = rand()%numActions;
+      a = randomInt(uniform, numActions);
    }
    else if(type == 2) //One-ply MC with a perfect model
    {
-      a = onePlyMC(world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, curObs);
+      a = onePlyMC(world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, curObs, uniform);
    }
    else if(type == 1) //Optimal policy
    {
@@ -221,8 +278,332 @@ int explorationPolicy(ShooterModel* world, ShooterRewardModel* worldReward, vect
    return a;
 }
 
+/*Chooses the model policy's action in the given state (one-ply MC with the
+  learned model, remembered in the policy cache). The planning rollouts and
+  the model's samples use a stream seeded by the state itself, so the action
+  assigned to a state does not depend on which thread plans in it first.
+  state - obs, packed (e.g. the world's frame)
+  modelUniform - the random stream the model samples from*/
+int modelPolicy(ConvolutionalBinaryCTS* model, randgen_t& modelUniform, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& obs, const BitFrame& state, PolicyCache& policyCache, int trial, int batch)
+{
+   int action;
+   if(!policyCache.lookup(state, action))
+   {
+      modelUniform.base().seed(streamSeed(trial, batch, state.fingerprint()));
+      action = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obs, modelUniform);
+      policyCache.insert(state, action);
+   }
+   return action;
+}
+
+/*Generates a sample for the first batch (using only the exploration policy)*/
+void explorationSample(ShooterModel* world, ShooterRewardModel* worldReward, double discountFactor, int gamma, int rolloutsPerA, int rolloutDepth, int numActions, int explorationType, randgen_t& uniform, Sample& sample)
+{
+   world->reset();
+
+   vector<vector<int> > obsContext(1);
+   vector<int> actContext(1);
+   int nextAct;
+   vector<int> nextObs;
+   int dummyReward;
+   bool endEpisode;
+   float reward;
+
+   //Make a context
+   world->takeAction(0, obsContext[0], dummyReward, endEpisode);
+   actContext[0] = 0;
+
+   int t = 0;
+   while(randomInt(uniform, 10) < gamma)
+   {
+      int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+      world->takeAction(a, obsContext[0], dummyReward, endEpisode);
+      actContext[0] = a;
+      t++;
+   }
+
+   int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+   reward = worldReward->getReward(a, world->getFrame());
+   world->takeAction(a, nextObs, dummyReward, endEpisode);
+   nextAct = a;
+
+   sample.dataset.push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
+   sample.rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, 1));
+}
+
+/*Generates a sample for batch b, using a mixture of the exploration policy
+  and the policy of the current model
+  uniform - the sample's own random stream
+  modelUniform - the random stream the model samples from*/
+void daggerSample(int b, ShooterModel* world, ShooterRewardModel* worldReward, ConvolutionalBinaryCTS* model, randgen_t& modelUniform, RewardModel* rewardModel, PolicyCache& policyCache, int trial, int daggerType, int explorationType, double discountFactor, int gamma, int rolloutsPerA, int rolloutDepth, int numActions, int hDelay, int maxH, randgen_t& uniform, Sample& sample)
+{
+   world->reset();
+   model->reset();
+   vector<vector<int> > obsContext(1);
+   vector<int> actContext(1);
+   vector<int> prevObs;
+   int nextAct;
+   vector<int> nextObs;
+   int dummyReward;
+   bool endEpisode;
+   //Make a context
+   world->takeAction(0, obsContext[0], dummyReward, endEpisode);
+   model->update(0, obsContext[0], 0, false, false);
+
+   actContext[0] = 0;
+
+   //Flip a coin
+   int r = randomInt(uniform, 2);
+   r = r%2;
+   if(randomInt(uniform, 2)) //If heads, use exploration policy to sample a state
+   {
+      int t = 0;
+      //(1 - gamma) probability of termination
+      int term = randomInt(uniform, 10);
+      while(term < gamma)
+      {
+	 term = randomInt(uniform, 10);
+	 int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+	 world->takeAction(a, obsContext[0], dummyReward, endEpisode);
+	 if(daggerType > 0)
+	 {
+	    model->update(a, obsContext[0], 0, false, false);
+	 }
+	 actContext[0] = a;
+	 t++;
+      }
+
+      //Flip another coin to determine what to do in the last step
+      int coin = randomInt(uniform, 2);
+      if(daggerType == 0 || coin) //If doing regular DAgger, or if coin comes up heads: just use the exploration policy
+      {
+	 nextAct = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+      }
+      else //Otherwise use exploration policy in the last step
+      {
+	 nextAct = modelPolicy(model, modelUniform, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], world->getFrame(), policyCache, trial, b);
+      }
+   }
+   else //The first coin (r) was tails: use model policy to sample a state
+   {
+      //(1 - gamma) probability of termination
+      int term = randomInt(uniform, 10);
+      while(term < gamma)
+      {
+	 term = randomInt(uniform, 10);
+	 int a = modelPolicy(model, modelUniform, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], world->getFrame(), policyCache, trial, b);
+
+	 world->takeAction(a, obsContext[0], dummyReward, endEpisode);
+	 model->update(a, obsContext[0], 0, false, false);
+	 actContext[0] = a;
+      }
+
+      nextAct = modelPolicy(model, modelUniform, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], world->getFrame(), policyCache, trial, b);
+   }
+
+   //We have now sampled a state and action -- take the action in that state
+   if(daggerType > 0) //The hallucinated context starts out the same as the regular context
+   {
+      vector<vector<int> > hObsContext;
+      int hReward;
+      bool hEnd;
+      hObsContext = obsContext;
+      //The hallucinated steps are part of this sample
+      modelUniform.base().seed(uniform.base()());
+
+      //The real steps are rewarded all at once at the end
+      vector<int> actions;
+      vector<BitFrame> frames;
+      vector<pair<int, int> > hrSteps; //(hrDataset entry, step)
+      int rStart = sample.rDataset.size();
+
+      actions.push_back(nextAct);
+      frames.push_back(world->getFrame());
+      world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
+      for(int h = 0; h < rolloutDepth; h++)
+      {
+	 sample.dataset.push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
+	 if(b >= h*hDelay && h <= maxH)  //If hallucinating and if we've seen enough batches for this depth, and if we're not past the maximum depth, use the hallucinated context
+	 {
+	    sample.hdataset.push_back(make_tuple(hObsContext, actContext, nextAct, nextObs, 0, false));
+	 }
+
+	 sample.rDataset.push_back(make_tuple(obsContext[0], nextAct, 0, pow(discountFactor, h)));
+	 if(b > h*hDelay || b > maxH*hDelay)
+	 {
+	    hrSteps.push_back(make_pair(sample.hrDataset.size(), h));
+	    sample.hrDataset.push_back(make_tuple(hObsContext[0], nextAct, 0, pow(discountFactor, h)));	  
+	 }
+	       
+	 model->takeAction(nextAct, hObsContext[0], hReward, hEnd);
+	       
+	 obsContext[0] = nextObs;
+	 actContext[0] = nextAct;	       
+	 nextAct = randomInt(uniform, numActions);
+	 if(h < rolloutDepth - 1)
+	 {
+	    actions.push_back(nextAct);
+	    frames.push_back(world->getFrame());
+	 }
+	 world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
+      }
+
+      vector<float> rewards;
+      worldReward->getRewards(actions, frames, rewards);
+      for(int h = 0; h < rolloutDepth; h++)
+      {
+	 sample.rDataset[rStart + h].get<2>() = rewards[h];
+      }
+      for(unsigned i = 0; i < hrSteps.size(); i++)
+      {
+	 sample.hrDataset[hrSteps[i].first].get<2>() = rewards[hrSteps[i].second];
+      }
+   }
+   else
+   {
+      float reward = worldReward->getReward(nextAct, world->getFrame());
+      world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
+      sample.dataset.push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
+      sample.rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, 1));
+   }
+}
+
+/*Generates a batch of samples in parallel and appends them to the datasets in order.
+  Each thread gets its own copy of the world and of the model (sharing the trained trees),
+  and each sample its own random stream seeded from the trial, batch, and sample number,
+  so the batch is the same no matter how many threads are used.
+  Batch 0 uses only the exploration policy.*/
+void generateSamples(int b, int samplesPerBatch, ShooterModel* world, ShooterRewardModel* worldReward, ConvolutionalBinaryCTS* model, RewardModel* rewardModel, PolicyCache& policyCache, int trial, int daggerType, int explorationType, double discountFactor, int gamma, int rolloutsPerA, int rolloutDepth, int numActions, int hDelay, int maxH, vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& dataset, vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >& hdataset, vector<tuple<vector<int>, int, float, float> >& rDataset, vector<tuple<vector<int>, int, float, float> >& hrDataset)
+{
+   cout << "Generating Samples";
+   cout.flush();
+
+   vector<Sample> samples(samplesPerBatch);
+   int numGenerated = 0;
+#pragma omp parallel
+   {
+      ShooterModel workerWorld(*world);
+      randgen_t modelUniform((randsrc_t()));
+      ConvolutionalBinaryCTS workerModel(*model, modelUniform);
+
+#pragma omp for schedule(dynamic, 1)
+      for(int s = 0; s < samplesPerBatch; s++)
+      {
+	 randgen_t uniform((randsrc_t(streamSeed(trial, b, s))));
+	 if(b == 0)
+	 {
+	    explorationSample(&workerWorld, worldReward, discountFactor, gamma, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform, samples[s]);
+	 }
+	 else
+	 {
+	    daggerSample(b, &workerWorld, worldReward, &workerModel, modelUniform, rewardModel, policyCache, trial, daggerType, explorationType, discountFactor, gamma, rolloutsPerA, rolloutDepth, numActions, hDelay, maxH, uniform, samples[s]);
+	 }
+
+#pragma omp critical(progress)
+	 {
+	    numGenerated++;
+	    if(numGenerated%(samplesPerBatch/10) == 0)
+	    {
+	       cout << ".";
+	       cout.flush();
+	    }
+	 }
+      }
+   }
+
+   for(int s = 0; s < samplesPerBatch; s++)
+   {
+      dataset.insert(dataset.end(), samples[s].dataset.begin(), samples[s].dataset.end());
+      hdataset.insert(hdataset.end(), samples[s].hdataset.begin(), samples[s].hdataset.end());
+      rDataset.insert(rDataset.end(), samples[s].rDataset.begin(), samples[s].rDataset.end());
+      hrDataset.insert(hrDataset.end(), samples[s].hrDataset.begin(), samples[s].hrDataset.end());
+   }
+}
+
+/*Checkpoints let a run that was stopped carry on where it left off. One is written
+  after each batch's training, before the batch is evaluated (evaluation fills the
+  policy cache that the next batch's samples use), so a resumed run evaluates the
+  batch again and then goes on exactly as the run would have.
+  It holds the output file name (which encodes the run's settings), the batch, how much
+  of the output file had been written, the batch's log likelihoods and reward errors,
+  the evaluation's random stream, and the models.
+  The checkpoint is written next to filename and then renamed, so stopping the run
+  while it is written leaves the last one.
+  rewardModel - the learned reward model (null if the reward is not learned)*/
+void saveCheckpoint(const string& filename, const string& outputName, int batch, boost::uint64_t outputLength, double ll, double hll, double mse, double hmse, randgen_t& uniform, ConvolutionalBinaryCTS* model, PatchRewardModel* rewardModel)
+{
+   string tempName = filename + ".tmp";
+   ofstream out(tempName.c_str(), ios::binary);
+   writeCheckpointHeader(out, "SHDU");
+   writeString(out, outputName);
+   writeBinary(out, boost::int32_t(batch));
+   writeBinary(out, outputLength);
+   writeBinary(out, ll);
+   writeBinary(out, hll);
+   writeBinary(out, mse);
+   writeBinary(out, hmse);
+   stringstream rngState;
+   rngState << uniform.base() << " ";
+   writeString(out, rngState.str());
+   model->save(out);
+   writeBinary(out, boost::int32_t(rewardModel != NULL));
+   if(rewardModel)
+   {
+      rewardModel->save(out);
+   }
+   out.close();
+
+   if(!out || rename(tempName.c_str(), filename.c_str()) != 0)
+   {
+      cerr << "Could not write the checkpoint " << filename << endl;
+      exit(1);
+   }
+}
+
+/*Reads a checkpoint written by saveCheckpoint into the given models and stream.
+  Returns false if it can't be read or was written with different models
+  (which may then be partly replaced)*/
+bool loadCheckpoint(const string& filename, string& outputName, int& batch, boost::uint64_t& outputLength, double& ll, double& hll, double& mse, double& hmse, randgen_t& uniform, ConvolutionalBinaryCTS* model, PatchRewardModel* rewardModel)
+{
+   ifstream in(filename.c_str(), ios::binary);
+   boost::int32_t savedBatch;
+   string state;
+   if(!readCheckpointHeader(in, "SHDU") ||
+      !readString(in, outputName) ||
+      !readBinary(in, savedBatch) ||
+      !readBinary(in, outputLength) ||
+      !readBinary(in, ll) ||
+      !readBinary(in, hll) ||
+      !readBinary(in, mse) ||
+      !readBinary(in, hmse) ||
+      !readString(in, state))
+   {
+      return false;
+   }
+   randsrc_t savedRng;
+   stringstream rngState(state);
+   rngState >> savedRng;
+   if(!rngState || !model->load(in) || !readMatching(in, boost::int32_t(rewardModel != NULL)) || (rewardModel && !rewardModel->load(in)))
+   {
+      return false;
+   }
+
+   batch = savedBatch;
+   uniform.base() = savedRng;
+   return true;
+}
+
 int main(int argc, char** argv)
 {
+   string rewardTraining = takeOption(argc, argv, "rewardTraining");
+   if(rewardTraining == "")
+   {
+      rewardTraining = "hogwild";
+   }
+   string checkpointFile = takeOption(argc, argv, "checkpoint");
+   string evaluateFile = takeOption(argc, argv, "evaluate");
+   string mappableFile = takeOption(argc, argv, "saveMappable");
+
    if(argc <= 13)
    {
       cout << "Usage: ./shooterDAggerUnrolled algorithm explorationType trial numBatches samplesPerBatch movingBullseye maxHDepth [outputFileNote]" << endl;
@@ -240,6 +621,11 @@ int main(int argc, char** argv)
       cout << "movingBullseye -- 0: bullseyes stay still, 1: bullseyes move" << endl;
       cout << "maxHDepth -- maximum hallucinated rollout depth during training" << endl;
       cout << "outputFileNote -- adds the given string to the output filename" << endl;
+      cout << "Options (anywhere in the arguments):" << endl;
+      cout << "--rewardTraining serial|hogwild|minibatch -- how the learned reward model spreads its training over threads (default hogwild)" << endl;
+      cout << "--checkpoint file -- saves the run to file after each batch, and resumes from it if it exists" << endl;
+      cout << "--saveMappable file -- writes the final model to file in the form --evaluate can map" << endl;
+      cout << "--evaluate file -- only evaluates the policy of the model in file (a checkpoint, or a file from --saveMappable with perfect reward), adding .evaluation to the output filename" << endl;
       exit(1);
    }
 
@@ -345,6 +731,10 @@ int main(int argc, char** argv)
       if(rewardType > 0)
       {
 	 outSS << ".stepSize" << rewardStepSize;
+	 if(rewardTraining != "hogwild")
+	 {
+	    outSS << "." << rewardTraining;
+	 }
       }
 
       outSS << ".nbhd" << neighborhoodWidth << "x" << neighborhoodHeight << ".spb" << samplesPerBatch << ".numBatches" << numBatches;
@@ -352,29 +742,96 @@ int main(int argc, char** argv)
 
    outSS << ".t" << trial;
 
-   srand(trial + 1);
-   
-   ofstream fout(outSS.str().c_str());
+   //Samples get their own streams (see generateSamples)
+   randgen_t uniform((randsrc_t(trial + 1)));
 
    int height = 15;
    int numTargets = 3;
    int numActions = 4;
    ShooterModel* world = new ShooterModel(numTargets, height, movingSweetSpot);
-   ShooterRewardModel* worldReward = new ShooterRewardModel();
+   ShooterRewardModel* worldReward = new ShooterRewardModel(numTargets, height);
 
    ConvolutionalBinaryCTS* model = new ConvolutionalBinaryCTS(height, numTargets*5, neighborhoodHeight, neighborhoodWidth, numActions, 1, trial + 1);
+   model->setTransitionCache(size_t(256) << 20);
+   //Rewards come from rewardModel and rollouts have a fixed length
+   model->setHeads(false, false);
 
+   PatchRewardModel* patchRewardModel = NULL; //If the reward is learned
    RewardModel* rewardModel;
    if(rewardType > 0)
    {
-      rewardModel = new PatchRewardModel(numActions, numTargets*5, height, 3, 3, rewardStepSize);
+      patchRewardModel = new PatchRewardModel(numActions, numTargets*5, height, 3, 3, rewardStepSize);
+      if(rewardTraining == "hogwild")
+      {
+	 patchRewardModel->setTrainingMode(PatchRewardModel::HOGWILD);
+      }
+      else if(rewardTraining == "minibatch")
+      {
+	 patchRewardModel->setTrainingMode(PatchRewardModel::MINIBATCH);
+      }
+      rewardModel = patchRewardModel;
    }
    else
    {
-      rewardModel = new ShooterRewardModel();
+      rewardModel = new ShooterRewardModel(numTargets, height);
    }
 
-   unordered_map<size_t, int> policyCache;   
+   PolicyCache policyCache;
+
+   if(evaluateFile != "") //Just evaluate a saved model's policy
+   {
+      string savedName;
+      int batch;
+      boost::uint64_t outputLength;
+      double ll, hll, mse, hmse;
+      //(a checkpoint also restores the random stream its batch was evaluated with)
+      bool mapped = patchRewardModel == NULL && model->mapFile(evaluateFile);
+      if(!mapped && !loadCheckpoint(evaluateFile, savedName, batch, outputLength, ll, hll, mse, hmse, uniform, model, patchRewardModel))
+      {
+	 cerr << "Could not map or load " << evaluateFile << " (not a model of these settings; mapped models only go with perfect reward)" << endl;
+	 exit(1);
+      }
+
+      outSS << ".evaluation";
+      ofstream fout(outSS.str().c_str());
+      policyCache.newGeneration();
+      tuple<double, double, double> results = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, uniform);
+      cout << "Discounted Reward: " << results.get<0>() << endl;
+      fout << results.get<0>() << " " << results.get<1>() << " " << results.get<2>() << endl;
+      exit(0);
+   }
+
+   //If the run was stopped, carry on from its checkpoint (see saveCheckpoint)
+   int firstBatch = 0;
+   bool resumed = false;
+   double ll = 0;
+   double hll = 0;
+   double mse = 0;
+   double hmse = 0;
+   string written; //The output of the batches before firstBatch
+   if(checkpointFile != "" && ifstream(checkpointFile.c_str()).good())
+   {
+      string savedName;
+      boost::uint64_t outputLength;
+      if(!loadCheckpoint(checkpointFile, savedName, firstBatch, outputLength, ll, hll, mse, hmse, uniform, model, patchRewardModel) || savedName != outSS.str())
+      {
+	 cerr << "Could not resume from " << checkpointFile << " (not a checkpoint of this run)" << endl;
+	 exit(1);
+      }
+
+      ifstream previous(outSS.str().c_str(), ios::binary);
+      written.assign(outputLength, ' ');
+      if(outputLength > 0 && !previous.read(&written[0], outputLength))
+      {
+	 cerr << "Could not resume from " << checkpointFile << " (" << outSS.str() << " is missing output)" << endl;
+	 exit(1);
+      }
+      resumed = true;
+      cout << "Resuming at batch " << firstBatch << endl;
+   }
+
+   ofstream fout(outSS.str().c_str());
+   fout << written;
 
    if(daggerType >= 3) //Not really doing DAgger. Just execute one of the benchmark policies and report the results.
    {
@@ -389,7 +846,7 @@ int main(int argc, char** argv)
       {
 	 world->reset();
 	 world->takeAction(0, obs, r, endEpisode);
-	 policyCache.clear();
+	 policyCache.newGeneration();
 	 
 	 double discount = 1.0;
 	 for(int t = 0; t < 30; t++)
@@ -397,21 +854,16 @@ int main(int argc, char** argv)
 	    int action;
 	    if(daggerType == 3) //One-ply MC with perfect model
 	    {
-	       size_t hash = hash_range(obs.begin(), obs.end());
-	       action = policyCache[hash];
-	       if(!action)
-	       {
-		  action = onePlyMC(world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, obs);
-		  policyCache[hash] = action + 1;
-	       }
-	       else
+	       const BitFrame& state = world->getFrame();
+	       if(!policyCache.lookup(state, action))
 	       {
-		  action--;
+		  action = onePlyMC(world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, obs, uniform);
+		  policyCache.insert(state, action);
 	       }
 	    }
 	    else if(daggerType == 4) //Uniform random policy
 	    {
-	       action = rand()%numActions;
+	       action = randomInt(uniform, numActions);
 	    }
 	    else //Optimal policy
 	    {
@@ -421,7 +873,7 @@ int main(int argc, char** argv)
 		  action = 3;
 	       }
 	    }
-	    int r = worldReward->getReward(action, obs);
+	    int r = worldReward->getReward(action, world->getFrame());
 
 	    int dummyR;
 	    bool endEpisode;
@@ -444,251 +896,72 @@ int main(int argc, char** argv)
    vector<tuple<vector<int>, int, float, float> > rDataset; //obs, action, reward, weight
    vector<tuple<vector<int>, int, float, float> > hrDataset; //obs, action, reward, weight
    
-   //First batch uses only exploration policy
-   cout << "Generating Samples";
-   cout.flush();
-   for(int s = 0; s < samplesPerBatch; s++)
+   for(int b = firstBatch; b < numBatches; b++)
    {
-      if((s + 1)%(samplesPerBatch/10) == 0)
+      if(!resumed || b > firstBatch) //(a resumed run has already trained on its first batch)
       {
-	 cout << ".";
-	 cout.flush();
-      }
-
-      world->reset();
-
-      vector<vector<int> > obsContext(1);
-      vector<int> actContext(1);
-      int nextAct;
-      vector<int> nextObs;
-      int dummyReward;
-      bool endEpisode;
-      float reward;
-
-      //Make a context
-      world->takeAction(0, obsContext[0], dummyReward, endEpisode);
-      actContext[0] = 0;
-
-      int t = 0;
-      while(rand()%10 < gamma)
-      {
-	 int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
-	 world->takeAction(a, obsContext[0], dummyReward, endEpisode);
-	 actContext[0] = a;
-	 t++;
-      }
-
-      int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
-      reward = worldReward->getReward(a, obsContext[0]);
-      world->takeAction(a, nextObs, dummyReward, endEpisode);
-      nextAct = a;
-
-      dataset.push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
-      rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, 1));
-   }
-
-   //Update the model
-   model->batchUpdate(dataset);
-   rewardModel->batchUpdate(rDataset);
-
-   double ll = model->batchLL(dataset);
-   double hll = ll;
-   double mse = rewardModel->batchMSE(rDataset);
+	 dataset.clear();
+	 hdataset.clear();
+	 rDataset.clear();
+	 hrDataset.clear();
 
-   //Evaluate the first policy
-   policyCache.clear();
-   tuple<double, double, double> results = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache);//, true);
-   cout << "Batch 0 Discounted Reward: " << results.get<0>() << endl;
-   fout << results.get<0>() << " " << results.get<1>() << " " << results.get<2>() << " " << ll << " " << ll << " " << mse << " " << mse << endl;
+	 generateSamples(b, samplesPerBatch, world, worldReward, model, rewardModel, policyCache, trial, daggerType, explorationType, discountFactor, gamma, rolloutsPerA, rolloutDepth, numActions, hDelay, maxH, dataset, hdataset, rDataset, hrDataset);
 
-   //Now do the rest of the batches
-   for(int b = 1; b < numBatches; b++)
-   {
-      dataset.clear();
-      hdataset.clear();
-      rDataset.clear();
-      hrDataset.clear();
-      
-      cout << "Generating Samples";
-      cout.flush();
-      for(int s = 0; s < samplesPerBatch; s++)
-      {
-	 if((s + 1)%(samplesPerBatch/10) == 0)
+	 if(b == 0) //The first batch uses only the exploration policy
 	 {
-	    cout << ".";
-	    cout.flush();
-	 }
+	    model->batchUpdate(dataset);
+	    rewardModel->batchUpdate(rDataset);
 
-	 world->reset();
-	 model->reset();
-	 vector<vector<int> > obsContext(1);
-	 vector<int> actContext(1);
-	 vector<int> prevObs;
-	 int nextAct;
-	 vector<int> nextObs;
-	 int dummyReward;
-	 bool endEpisode;
-	 //Make a context
-	 world->takeAction(0, obsContext[0], dummyReward, endEpisode);
-	 model->update(0, obsContext[0], 0, false, false);
-
-	 actContext[0] = 0;
-
-	 //Flip a coin
-	 int r = rand();
-	 r = r%2;
-	 if(rand()%2) //If heads, use exploration policy to sample a state
+	    ll = model->batchLL(dataset);
+	    hll = ll;
+	    mse = rewardModel->batchMSE(rDataset);
+	    hmse = mse;
+	 }
+	 else
 	 {
-	    int t = 0;
-	    //(1 - gamma) probability of termination
-	    int term = rand();
-	    term = term%10;
-	    while(term < gamma)
+	    if(rewardType < 2)
 	    {
-	       term = rand();
-	       term = term%10;
-	       int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
-	       world->takeAction(a, obsContext[0], dummyReward, endEpisode);
-	       if(daggerType > 0)
-	       {
-		  model->update(a, obsContext[0], 0, false, false);
-	       }
-	       actContext[0] = a;
-	       t++;
+	       rewardModel->batchUpdate(rDataset);
 	    }
-
-	    //Flip another coin to determine what to do in the last step
-	    int coin = rand();
-	    coin = coin%2;
-	    if(daggerType == 0 || coin) //If doing regular DAgger, or if coin comes up heads: just use the exploration policy
+	    else
 	    {
-	       nextAct = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
+	       rewardModel->batchUpdate(hrDataset);
 	    }
-	    else //Otherwise use exploration policy in the last step
-	    {
-	       size_t hash = hash_range(obsContext[0].begin(), obsContext[0].end());
-	       nextAct = policyCache[hash];
-	       if(!nextAct)
-	       {
-		  nextAct = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0]);
-		  policyCache[hash] = nextAct + 1;
-	       }
-	       else
-	       {
-		  nextAct--;
-	       }
-	    }
-	 }
-	 else //The first coin (r) was tails: use model policy to sample a state
-	 {
-	    //(1 - gamma) probability of termination
-	    int term = rand();
-	    term = term%10;
-	    while(term < gamma)
-	    {
-	       term = rand();
-	       term = term%10;
-	       size_t hash = hash_range(obsContext[0].begin(), obsContext[0].end());
-	       int a = policyCache[hash];
-	       if(!a)
-	       {
-		  a = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0]);
-		  policyCache[hash] = a + 1;
-	       }
-	       else
-	       {
-		  a--;
-	       }
 
-	       world->takeAction(a, obsContext[0], dummyReward, endEpisode);
-	       model->update(a, obsContext[0], 0, false, false);
-	       actContext[0] = a;
-	    }
+	    mse = rewardModel->batchMSE(rDataset);
+	    hmse = rewardModel->batchMSE(hrDataset);
 
-	    size_t hash = hash_range(obsContext[0].begin(), obsContext[0].end());
-	    nextAct = policyCache[hash];
-	    if(!nextAct)
+	    //Update the model
+	    if(daggerType < 2)
 	    {
-	       nextAct = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0]);
-	       policyCache[hash] = nextAct + 1;
+	       model->batchUpdate(dataset);
 	    }
 	    else
 	    {
-	       nextAct--;
-	    }	    
-	 }
-
-	 //We have now sampled a state and action -- take the action in that state
-	 world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
-	 float reward = worldReward->getReward(nextAct, obsContext[0]);
-
-	 if(daggerType > 0) //The hallucinated context starts out the same as the regular context
-	 {
-	    vector<vector<int> > hObsContext;
-	    int hReward;
-	    bool hEnd;
-	    hObsContext = obsContext;
-	    
-	    for(int h = 0; h < rolloutDepth; h++)
-	    {
-	       dataset.push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
-	       if(b >= h*hDelay && h <= maxH)  //If hallucinating and if we've seen enough batches for this depth, and if we're not past the maximum depth, use the hallucinated context
-	       {
-		  hdataset.push_back(make_tuple(hObsContext, actContext, nextAct, nextObs, 0, false));
-	       }
-
-	       rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, pow(discountFactor, h)));
-	       if(b > h*hDelay || b > maxH*hDelay)
-	       {
-		  hrDataset.push_back(make_tuple(hObsContext[0], nextAct, reward, pow(discountFactor, h)));	  
-	       }
-	       
-	       model->takeAction(nextAct, hObsContext[0], hReward, hEnd);
-	       
-	       obsContext[0] = nextObs;
-	       actContext[0] = nextAct;	       
-	       nextAct = rand();
-	       nextAct = nextAct%numActions;
-	       world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
-	       reward = worldReward->getReward(nextAct, obsContext[0]);
+	       model->batchUpdate(hdataset);
 	    }
+
+	    ll = model->batchLL(dataset);
+	    hll = model->batchLL(hdataset);
 	 }
-	 else
+
+	 if(checkpointFile != "")
 	 {
-	    dataset.push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
-	    rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, 1));
+	    fout.flush();
+	    saveCheckpoint(checkpointFile, outSS.str(), b, fout.tellp(), ll, hll, mse, hmse, uniform, model, patchRewardModel);
 	 }
       }
 
-      if(rewardType < 2)
-      {
-	 rewardModel->batchUpdate(rDataset);
-      }
-      else
-      {
-	 rewardModel->batchUpdate(hrDataset);
-      }
-
-      double mse = rewardModel->batchMSE(rDataset);
-      double hmse = rewardModel->batchMSE(hrDataset);
-
-      //Update the model
-      if(daggerType < 2)
-      {
-	 model->batchUpdate(dataset);
-      }
-      else
-      {
-	 model->batchUpdate(hdataset);
-      }
-
-      ll = model->batchLL(dataset);
-      hll = model->batchLL(hdataset);
-
       //Evaluate the policy for this batch
-      policyCache.clear();
-      tuple<double, double, double> results = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, b > 50);
+      policyCache.newGeneration();
+      tuple<double, double, double> results = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, uniform, b > 50);
       cout << "Batch " << b << " Discounted Reward: " << results.get<0>() << endl;
       fout << results.get<0>() << " " << results.get<1>() << " " << results.get<2>() << " " << ll << " " << hll << " " << mse << " " << hmse << endl;
    }
+
+   if(mappableFile != "")
+   {
+      ofstream out(mappableFile.c_str(), ios::binary);
+      model->saveMappable(out);
+   }
 }
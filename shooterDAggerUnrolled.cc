@@ -3,14 +3,18 @@ Author: Erik Talvitie
 ********************/
 
 #include "ConvolutionalBinaryCTS.h"
+#include "UnrolledCTS.h"
 #include "ShooterModel.h"
 #include "PatchRewardModel.h"
 #include "ShooterRewardModel.h"
+#include "PolicyCache.h"
+#include "Checkpoint.h"
 
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <cstdio>
 #include <boost/tuple/tuple.hpp>
 #include <boost/unordered_map.hpp>
 #include <boost/functional/hash.hpp>
@@ -18,14 +22,39 @@ Author: Erik Talvitie
 using namespace std;
 using namespace boost;
 
+/*The data points generated by a single sample*/
+struct Sample
+{
+   vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > > dataset; //One for each sub-model
+   vector<tuple<vector<int>, int, float, float> > rDataset;
+};
+
+/*A random integer in [0, n) drawn from the given stream*/
+int randomInt(randgen_t& uniform, int n)
+{
+   return int(uniform()*n)%n;
+}
+
+/*Seeds a random stream from the trial number and the given identifiers,
+  so that results do not depend on how work is divided among threads*/
+unsigned streamSeed(int trial, int batch, size_t id)
+{
+   size_t seed = 0;
+   hash_combine(seed, trial);
+   hash_combine(seed, batch);
+   hash_combine(seed, id);
+   return seed;
+}
+
 /* Takes an unrolled model, discount factor, current observation
    and uses one-ply Monte Carlo to choose an action.
+   uniform is the random stream for rollout actions and tie breaking.
    Optional parameters:
    maxD - limits the depth of model to use. For rollout steps
    beond maxD, will simply repeat the maxDth model. Pass -1 to
    use the entire depth of the model.
    printReturns/printRollouts - if true, prints things for debugging.*/
-int onePlyMC(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& curObs, int maxD=-1, bool printReturns=false, bool printRollouts=false)
+int onePlyMC(const UnrolledCTS& model, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& curObs, randgen_t& uniform, int maxD=-1, bool printReturns=false, bool printRollouts=false)
 {
    int maxModelDepth = maxD;
    if(maxD < 0 || maxD > int(model.size()))
@@ -35,6 +64,12 @@ int onePlyMC(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewardMo
 
    int numActions = model[0]->getNumActs();
    vector<double> returns(numActions, 0);
+   RewardFeatures rootFeatures;
+   rewardModel->initFeatures(curObs, rootFeatures);
+   BitFrame rootFrame(curObs);
+   vector<int> changed;
+   //Every action's first step is sampled from the first model
+   model[0]->expectEveryAction(rootFrame);
    for(int a = 0; a < numActions; a++)
    {
       for(int rollout = 0; rollout < rolloutsPerA; rollout++)
@@ -53,16 +88,22 @@ int onePlyMC(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewardMo
 	 double rolloutReturn = 0;
 	 int m = 0;
 	 vector<int> obs = curObs;
+	 BitFrame frame = rootFrame;
+	 RewardFeatures features = rootFeatures;
 	 for(int t = 0; t < rolloutDepth; t++)
 	 {
-	    float reward = rewardModel->getReward(action, obs);
+	    float reward = rewardModel->getFeatureReward(action, features);
 	    if(printRollouts)
 	    {
 	       cout << "A: " << action << " R: " << reward << endl;
 	    }
 	    bool endEpisode;
 	    bool dummyReward;
-	    model[m]->sample(action, obs, dummyReward, endEpisode);
+	    model[m]->sample(action, obs, frame, changed, dummyReward, endEpisode);
+	    if(t < rolloutDepth-1)
+	    {
+	       rewardModel->updateFeatures(obs, changed, features);
+	    }
 	    if(m+1 < maxModelDepth)
 	    {
 	       m++;
@@ -87,8 +128,7 @@ int onePlyMC(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewardMo
 	    rolloutReturn += discount*reward;
 	    discount *= discountFactor;
 
-	    action = rand();
-	    action = action%numActions;
+	    action = randomInt(uniform, numActions);
 	 }
 
 	 if(printRollouts)
@@ -129,19 +169,44 @@ int onePlyMC(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewardMo
 	 maxActs.push_back(i);
       }
    }
-   int choice = rand();
-   choice = choice%maxActs.size();
+   int choice = randomInt(uniform, maxActs.size());
    return maxActs[choice];
 }
 
+/*Removes "--name value" from the arguments (if it is there), returning the value
+  (or "" if the option wasn't given), so the rest can be read by position*/
+string takeOption(int& argc, char** argv, const string& name)
+{
+   for(int i = 1; i + 1 < argc; i++)
+   {
+      if(argv[i] == "--" + name)
+      {
+	 string value = argv[i + 1];
+	 for(int j = i; j + 2 < argc; j++)
+	 {
+	    argv[j] = argv[j + 2];
+	 }
+	 argc -= 2;
+	 return value;
+      }
+   }
+   return "";
+}
+
 /* Takes a model, discount factor, current observation
    and uses one-ply Monte Carlo to choose an action.
+   uniform is the random stream for rollout actions and tie breaking.
    Optional parameters:
    printReturns/printRollouts - if true, prints things for debugging.*/
-int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& curObs, bool printReturns=false, bool printRollouts=false)
+int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& curObs, randgen_t& uniform, bool printReturns=false, bool printRollouts=false)
 {
    int numActions = model->getNumActs();
    vector<double> returns(numActions, 0);
+   RewardFeatures rootFeatures;
+   rewardModel->initFeatures(curObs, rootFeatures);
+   BitFrame rootFrame(curObs);
+   vector<int> changed;
+   model->expectEveryAction(rootFrame);
    for(int a = 0; a < numActions; a++)
    {
       for(int rollout = 0; rollout < rolloutsPerA; rollout++)
@@ -156,12 +221,18 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
 	 }
 	 double rolloutReturn = 0;
 	 vector<int> obs = curObs;
+	 BitFrame frame = rootFrame;
+	 RewardFeatures features = rootFeatures;
 	 for(int t = 0; t < rolloutDepth; t++)
 	 {
-	    float reward = rewardModel->getReward(action, obs);
+	    float reward = rewardModel->getFeatureReward(action, features);
 	    bool endEpisode;
 	    int dummyReward;
-	    model->takeAction(action, obs, dummyReward, endEpisode);
+	    model->takeAction(action, obs, frame, changed, dummyReward, endEpisode);
+	    if(t < rolloutDepth-1)
+	    {
+	       rewardModel->updateFeatures(obs, changed, features);
+	    }
 	    if(printRollouts)
 	    {
 	       cout << "A: " << action << endl;
@@ -179,9 +250,7 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
 	    rolloutReturn += discount*reward;
 	    discount *= discountFactor;
 
-	    action = rand();
-
-	    action = action%numActions;
+	    action = randomInt(uniform, numActions);
 	 }
 	 if(printRollouts)
 	 {
@@ -217,8 +286,7 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
 	 maxActs.push_back(i);
       }
    }
-   int choice = rand();
-   choice = choice%maxActs.size();
+   int choice = randomInt(uniform, maxActs.size());
    return maxActs[choice];
 }
 
@@ -232,9 +300,10 @@ int onePlyMC(SamplingModel<int>* model, RewardModel* rewardModel, double discoun
   generates an action for each state, not a new action
   each time a state is visited. The cache ensures that
   each state is assigned a single action.
+  uniform - See onePlyMC
   maxD - See onePlyMC
   printRollouts - See onePlyMC*/
-double evaluate(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewardModel, ShooterModel* world, RewardModel* worldReward, double discountFactor, int numRollouts, int rolloutDepth, unordered_map<size_t, int>& policyCache, int maxD=-1, bool printRollouts=false)
+double evaluate(const UnrolledCTS& model, RewardModel* rewardModel, ShooterModel* world, ShooterRewardModel* worldReward, double discountFactor, int numRollouts, int rolloutDepth, PolicyCache& policyCache, randgen_t& uniform, int maxD=-1, bool printRollouts=false)
 {
    double totalDiscountedReward = 0;
 
@@ -287,19 +356,15 @@ double evaluate(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewar
 	    }
 	    cout << endl;
 	 }	 
-	 size_t hash = hash_range(obs.begin(), obs.end());
-	 int action = policyCache[hash];
-	 if(!action)
+	 const BitFrame& state = world->getFrame();
+	 int action;
+	 if(!policyCache.lookup(state, action))
 	 {
-	    action = onePlyMC(model, rewardModel, discountFactor, numRollouts, rolloutDepth, obs, maxD, printRollouts, printRollouts);
-	    policyCache[hash] = action + 1;
-	 }
-	 else
-	 {
-	    action--;
+	    action = onePlyMC(model, rewardModel, discountFactor, numRollouts, rolloutDepth, obs, uniform, maxD, printRollouts, printRollouts);
+	    policyCache.insert(state, action);
 	 }
 
-	 float r = worldReward->getReward(action, obs);
+	 float r = worldReward->getReward(action, world->getFrame());
 
 	 if(printRollouts)
 	 {
@@ -323,16 +388,16 @@ double evaluate(const vector<ConvolutionalBinaryCTS*>& model, RewardModel* rewar
   Type 0: Uniform random
   Type 1: Optimal policy
   Type 2: One-ply MC with a perfect model*/
-int explorationPolicy(ShooterModel* world, ShooterRewardModel* worldReward, vector<int>& curObs, int t, double discountFactor, int numRollouts, int rolloutDepth, int numActions, int type)
+int explorationPolicy(ShooterModel* world, ShooterRewardModel* worldReward, vector<int>& curObs, int t, double discountFactor, int numRollouts, int rolloutDepth, int numActions, int type, randgen_t& uniform)
 {
    int a = 0;
    if(type == 0) //Uniform random policy
    {
-      a = rand()%numActions;
+      a = randomInt(uniform, numActions);
    }
    else if(type == 2) //One-ply MC with a perfect model
    {
-      a = onePlyMC(world, worldReward, discountFactor, numRollouts, rolloutDepth, curObs);
+      a = onePlyMC(world, worldReward, discountFactor, numRollouts, rolloutDepth, curObs, uniform);
    }
    else if(type == 1) //Optimal policy
    {
@@ -346,8 +411,349 @@ int explorationPolicy(ShooterModel* world, ShooterRewardModel* worldReward, vect
    return a;
 }
 
+/*Chooses the model policy's action in the given state (one-ply MC with the
+  learned models, remembered in the policy cache). The planning rollouts and
+  the model's samples use a stream seeded by the state itself, so the action
+  assigned to a state does not depend on which thread plans in it first.
+  state - obs, packed (e.g. the world's frame)
+  modelUniform - the random stream the model samples from*/
+int modelPolicy(const UnrolledCTS& model, randgen_t& modelUniform, RewardModel* rewardModel, double discountFactor, int rolloutsPerA, int rolloutDepth, const vector<int>& obs, const BitFrame& state, int maxD, PolicyCache& policyCache, int trial, int batch)
+{
+   int action;
+   if(!policyCache.lookup(state, action))
+   {
+      modelUniform.base().seed(streamSeed(trial, batch, state.fingerprint()));
+      action = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obs, modelUniform, maxD);
+      policyCache.insert(state, action);
+   }
+   return action;
+}
+
+/*Generates a sample for the first batch (using only the exploration policy)*/
+void explorationSample(ShooterModel* world, ShooterRewardModel* worldReward, double discountFactor, int gamma, int rolloutsPerA, int rolloutDepth, int numActions, int explorationType, randgen_t& uniform, Sample& sample)
+{
+   world->reset();
+
+   vector<vector<int> > obsContext(1);
+   vector<int> actContext(1);
+   int nextAct;
+   vector<int> nextObs;
+   int reward;
+   bool endEpisode;
+
+   //Make a context
+   world->takeAction(0, obsContext[0], reward, endEpisode);
+   actContext[0] = 0;
+
+   int t = 0;
+   while(randomInt(uniform, 10) < gamma)
+   {
+      int a = explorationPolicy(world, worldReward, obsContext[0], t, rolloutsPerA, rolloutDepth, discountFactor, numActions, explorationType, uniform);
+      world->takeAction(a, obsContext[0], reward, endEpisode);
+      actContext[0] = a;
+      t++;
+   }
+
+   int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+   world->takeAction(a, nextObs, reward, endEpisode);
+   nextAct = a;
+
+   sample.dataset.assign(rolloutDepth, vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >());
+   for(int m = 0; m < rolloutDepth; m++)
+   {
+      sample.dataset[m].push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
+   }
+   sample.rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, 1));
+}
+
+/*Generates a sample for batch b, using a mixture of the exploration policy
+  and the policy of the current models
+  uniform - the sample's own random stream
+  modelUniform - the random stream the model samples from*/
+void daggerSample(int b, ShooterModel* world, ShooterRewardModel* worldReward, const UnrolledCTS& model, randgen_t& modelUniform, RewardModel* rewardModel, PolicyCache& policyCache, int trial, int daggerType, int explorationType, int rewardType, double discountFactor, int gamma, int rolloutsPerA, int rolloutDepth, int numActions, int hDelay, randgen_t& uniform, Sample& sample)
+{
+   sample.dataset.assign(rolloutDepth, vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> >());
+
+   world->reset();
+   for(int m = 0; m < rolloutDepth; m++)
+   {
+      model[m]->reset();
+   }
+   vector<vector<int> > obsContext(1);
+   vector<int> actContext(1);
+   vector<int> prevObs;
+   int nextAct;
+   vector<int> nextObs;
+   int dummyReward;
+   bool endEpisode;
+   //Make a context
+   world->takeAction(0, obsContext[0], dummyReward, endEpisode);
+   for(int m = 0; m < rolloutDepth; m++)
+   {
+      model[m]->update(0, obsContext[0], 0, false, false);
+   }
+
+   actContext[0] = 0;
+
+   //Flip a coin
+   int r = randomInt(uniform, 2);
+   if(r) //If heads, use exploration policy to sample a state
+   {
+      int t = 0;
+      //(1 - gamma) probability of termination
+      int term = randomInt(uniform, 10);
+      while(term < gamma)
+      {
+	 term = randomInt(uniform, 10);
+	 int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+	 world->takeAction(a, obsContext[0], dummyReward, endEpisode);
+
+	 for(int m = 0; m < rolloutDepth; m++)
+	 {
+	    model[m]->update(a, obsContext[0], 0, false, false);
+	 }
+
+	 actContext[0] = a;
+	 t++;
+      }
+
+      //Flip another coin to determine what to do in the last step
+      int coin = randomInt(uniform, 2);
+      if(coin) //If coin comes up heads: just use the exploration policy
+      {
+	 nextAct = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform);
+      }
+      else //Otherwise use exploration policy in the last step
+      {
+	 nextAct = modelPolicy(model, modelUniform, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], world->getFrame(), hDelay > 0 ? b/hDelay+1 : -1, policyCache, trial, b);
+      }
+   }
+   else //The first coin (r) was tails: use model policy to sample a state
+   {
+      //(1 - gamma) probability of termination
+      int term = randomInt(uniform, 10);
+      while(term < gamma)
+      {
+	 term = randomInt(uniform, 10);
+	 int a = modelPolicy(model, modelUniform, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], world->getFrame(), hDelay > 0 ? b/hDelay+1 : -1, policyCache, trial, b);
+
+	 world->takeAction(a, obsContext[0], dummyReward, endEpisode);
+	 for(int m = 0; m < rolloutDepth; m++)
+	 {
+	    model[m]->update(a, obsContext[0], 0, false, false);
+	 }
+	 actContext[0] = a;
+      }
+
+      nextAct = modelPolicy(model, modelUniform, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], world->getFrame(), hDelay > 0 ? b/hDelay+1 : -1, policyCache, trial, b);
+   }
+
+   //We have now sampled a state and action -- take the action in that state
+   //The real steps are rewarded all at once at the end
+   vector<int> actions;
+   vector<BitFrame> frames;
+   vector<pair<int, int> > rSteps; //(rDataset entry, step)
+   actions.push_back(nextAct);
+   frames.push_back(world->getFrame());
+   world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
+
+   vector<vector<int> > hObsContext;
+   bool hReward;	 
+   bool hEnd;
+   if(daggerType == 1) //The hallucinated context starts out the same as the regular context
+   {
+      hObsContext = obsContext;
+      //The hallucinated steps are part of this sample
+      modelUniform.base().seed(uniform.base()());
+   }
+   for(int m = 0; m < rolloutDepth; m++)
+   {
+      if(daggerType == 0) //If not hallucinating, just use the regular context to create the data point
+      {
+	 sample.dataset[m].push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
+      }
+      else if(b >= m*hDelay) //If hallucinating and if we've seen enough batches for this depth, use the hallucinated context
+      {
+	 sample.dataset[m].push_back(make_tuple(hObsContext, actContext, nextAct, nextObs, 0, false));
+      }
+
+      if(rewardType < 2)
+      {
+	 rSteps.push_back(make_pair(sample.rDataset.size(), m));
+	 sample.rDataset.push_back(make_tuple(obsContext[0], nextAct, 0, pow(discountFactor, m)));
+      }
+      else if(b >= m*hDelay)
+      {
+	 rSteps.push_back(make_pair(sample.rDataset.size(), m));
+	 sample.rDataset.push_back(make_tuple(hObsContext[0], nextAct, 0, pow(discountFactor, m)));
+      }
+
+      if(daggerType == 1 && b >= (m+1)*hDelay) //If hallucinating and if seen enough batches for this depth, roll the model forward (sample and update)
+      {
+	 model[m]->sample(nextAct, hObsContext[0], hReward, hEnd);
+	 if(m < rolloutDepth-1)
+	 {
+	    model[m+1]->update(nextAct, hObsContext[0], 0, false, false);
+	 }
+      }
+
+      obsContext[0] = nextObs;
+      actContext[0] = nextAct;	       
+      nextAct = randomInt(uniform, numActions);
+      if(m < rolloutDepth - 1)
+      {
+	 actions.push_back(nextAct);
+	 frames.push_back(world->getFrame());
+      }
+      world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
+   }
+
+   vector<float> rewards;
+   worldReward->getRewards(actions, frames, rewards);
+   for(unsigned i = 0; i < rSteps.size(); i++)
+   {
+      sample.rDataset[rSteps[i].first].get<2>() = rewards[rSteps[i].second];
+   }
+}
+
+/*Generates a batch of samples in parallel and appends them to the datasets in order.
+  Each thread gets its own copy of the world and of the models (sharing the trained trees),
+  and each sample its own random stream seeded from the trial, batch, and sample number,
+  so the batch is the same no matter how many threads are used.
+  Batch 0 uses only the exploration policy.*/
+void generateSamples(int b, int samplesPerBatch, ShooterModel* world, ShooterRewardModel* worldReward, const UnrolledCTS& model, RewardModel* rewardModel, PolicyCache& policyCache, int trial, int daggerType, int explorationType, int rewardType, double discountFactor, int gamma, int rolloutsPerA, int rolloutDepth, int numActions, int hDelay, vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > >& dataset, vector<tuple<vector<int>, int, float, float> >& rDataset)
+{
+   cout << "Generating Samples";
+   cout.flush();
+
+   vector<Sample> samples(samplesPerBatch);
+   int numGenerated = 0;
+#pragma omp parallel
+   {
+      ShooterModel workerWorld(*world);
+      randgen_t modelUniform((randsrc_t()));
+      UnrolledCTS workerModel(model, modelUniform);
+
+#pragma omp for schedule(dynamic, 1)
+      for(int s = 0; s < samplesPerBatch; s++)
+      {
+	 randgen_t uniform((randsrc_t(streamSeed(trial, b, s))));
+	 if(b == 0)
+	 {
+	    explorationSample(&workerWorld, worldReward, discountFactor, gamma, rolloutsPerA, rolloutDepth, numActions, explorationType, uniform, samples[s]);
+	 }
+	 else
+	 {
+	    daggerSample(b, &workerWorld, worldReward, workerModel, modelUniform, rewardModel, policyCache, trial, daggerType, explorationType, rewardType, discountFactor, gamma, rolloutsPerA, rolloutDepth, numActions, hDelay, uniform, samples[s]);
+	 }
+
+#pragma omp critical(progress)
+	 {
+	    numGenerated++;
+	    if(numGenerated%(samplesPerBatch/10) == 0)
+	    {
+	       cout << ".";
+	       cout.flush();
+	    }
+	 }
+      }
+   }
+
+   for(int s = 0; s < samplesPerBatch; s++)
+   {
+      for(int m = 0; m < rolloutDepth; m++)
+      {
+	 dataset[m].insert(dataset[m].end(), samples[s].dataset[m].begin(), samples[s].dataset[m].end());
+      }
+      rDataset.insert(rDataset.end(), samples[s].rDataset.begin(), samples[s].rDataset.end());
+   }
+}
+
+/*Reports the training log likelihood of each model in the unrolled model*/
+void printLL(int batch, const vector<double>& ll)
+{
+   cout << "Batch " << batch << " LL:";
+   for(unsigned m = 0; m < ll.size(); m++)
+   {
+      cout << " " << ll[m];
+   }
+   cout << endl;
+}
+
+/*Checkpoints let a run that was stopped carry on where it left off. One is written
+  after each batch's training, before the batch is evaluated (evaluation fills the
+  policy cache that the next batch's samples use), so a resumed run evaluates the
+  batch again and then goes on exactly as the run would have.
+  It holds the output file name (which encodes the run's settings), the batch, how much
+  of the output file had been written, the evaluation's random stream, and the models.
+  The checkpoint is written next to filename and then renamed, so stopping the run
+  while it is written leaves the last one.
+  rewardModel - the learned reward model (null if the reward is not learned)*/
+void saveCheckpoint(const string& filename, const string& outputName, int batch, boost::uint64_t outputLength, randgen_t& uniform, const UnrolledCTS& model, PatchRewardModel* rewardModel)
+{
+   string tempName = filename + ".tmp";
+   ofstream out(tempName.c_str(), ios::binary);
+   writeCheckpointHeader(out, "SHDR");
+   writeString(out, outputName);
+   writeBinary(out, boost::int32_t(batch));
+   writeBinary(out, outputLength);
+   stringstream rngState;
+   rngState << uniform.base() << " ";
+   writeString(out, rngState.str());
+   model.save(out);
+   writeBinary(out, boost::int32_t(rewardModel != NULL));
+   if(rewardModel)
+   {
+      rewardModel->save(out);
+   }
+   out.close();
+
+   if(!out || rename(tempName.c_str(), filename.c_str()) != 0)
+   {
+      cerr << "Could not write the checkpoint " << filename << endl;
+      exit(1);
+   }
+}
+
+/*Reads a checkpoint written by saveCheckpoint into the given models and stream.
+  Returns false if it can't be read or was written with different models
+  (which may then be partly replaced)*/
+bool loadCheckpoint(const string& filename, string& outputName, int& batch, boost::uint64_t& outputLength, randgen_t& uniform, UnrolledCTS& model, PatchRewardModel* rewardModel)
+{
+   ifstream in(filename.c_str(), ios::binary);
+   boost::int32_t savedBatch;
+   string state;
+   if(!readCheckpointHeader(in, "SHDR") ||
+      !readString(in, outputName) ||
+      !readBinary(in, savedBatch) ||
+      !readBinary(in, outputLength) ||
+      !readString(in, state))
+   {
+      return false;
+   }
+   randsrc_t savedRng;
+   stringstream rngState(state);
+   rngState >> savedRng;
+   if(!rngState || !model.load(in) || !readMatching(in, boost::int32_t(rewardModel != NULL)) || (rewardModel && !rewardModel->load(in)))
+   {
+      return false;
+   }
+
+   batch = savedBatch;
+   uniform.base() = savedRng;
+   return true;
+}
+
 int main(int argc, char** argv)
 {
+   string rewardTraining = takeOption(argc, argv, "rewardTraining");
+   if(rewardTraining == "")
+   {
+      rewardTraining = "hogwild";
+   }
+   string checkpointFile = takeOption(argc, argv, "checkpoint");
+   string evaluateFile = takeOption(argc, argv, "evaluate");
+
    if(argc <= 12)
    {
       cout << "Usage: ./shooterDAggerUnrolled algorithm explorationType trial numBatches samplesPerBatch movingBullseye [outputFileNote]" << endl;
@@ -363,6 +769,10 @@ int main(int argc, char** argv)
       cout << "neighborhoodHeight -- the height of the convolutional neighborhood" << endl;
       cout << "outputFileNote -- adds the given string to the output filename" << endl;
       cout << "movingBullseye -- 0: bullseyes stay still, 1: bullseyes move" << endl;
+      cout << "Options (anywhere in the arguments):" << endl;
+      cout << "--rewardTraining serial|hogwild|minibatch -- how the learned reward model spreads its training over threads (default hogwild)" << endl;
+      cout << "--checkpoint file -- saves the run to file after each batch, and resumes from it if it exists" << endl;
+      cout << "--evaluate file -- only evaluates the policy of the models in file (a checkpoint), adding .evaluation to the output filename" << endl;
       exit(1);
    }
 
@@ -463,6 +873,10 @@ int main(int argc, char** argv)
       if(rewardType > 0)
       {
 	 outSS << ".stepSize" << rewardStepSize;
+	 if(rewardTraining != "hogwild")
+	 {
+	    outSS << "." << rewardTraining;
+	 }
       }
       
       outSS << ".nbhd" << neighborhoodWidth << "x" << neighborhoodHeight << ".spb" << samplesPerBatch << ".numBatches" << numBatches;
@@ -470,33 +884,90 @@ int main(int argc, char** argv)
 
    outSS << ".t" << trial;
 
-   srand(trial + 1);
-   
-   ofstream fout(outSS.str().c_str());
+   //Samples get their own streams (see generateSamples)
+   randgen_t uniform((randsrc_t(trial + 1)));
 
    int height = 15;
    int numTargets = 3;
    int numActions = 4;
    ShooterModel* world = new ShooterModel(numTargets, height, movingSweetSpot);
-   ShooterRewardModel* worldReward = new ShooterRewardModel();
+   ShooterRewardModel* worldReward = new ShooterRewardModel(numTargets, height);
 
-   vector<ConvolutionalBinaryCTS*> model(rolloutDepth);
-   for(int m = 0; m < rolloutDepth; m++)
-   {
-      model[m] = new ConvolutionalBinaryCTS(height, numTargets*5, neighborhoodHeight, neighborhoodWidth, numActions, 1, trial + 1);
-   }
+   UnrolledCTS model(rolloutDepth, height, numTargets*5, neighborhoodHeight, neighborhoodWidth, numActions, 1, trial + 1);
+   model.setTransitionCache(size_t(256) << 20);
+   //Rewards come from rewardModel and rollouts have a fixed length
+   model.setHeads(false, false);
 
+   PatchRewardModel* patchRewardModel = NULL; //If the reward is learned
    RewardModel* rewardModel;
    if(rewardType > 0)
    {
-      rewardModel = new PatchRewardModel(numActions, numTargets*5, height, 3, 3, rewardStepSize);
+      patchRewardModel = new PatchRewardModel(numActions, numTargets*5, height, 3, 3, rewardStepSize);
+      if(rewardTraining == "hogwild")
+      {
+	 patchRewardModel->setTrainingMode(PatchRewardModel::HOGWILD);
+      }
+      else if(rewardTraining == "minibatch")
+      {
+	 patchRewardModel->setTrainingMode(PatchRewardModel::MINIBATCH);
+      }
+      rewardModel = patchRewardModel;
    }
    else
    {
-      rewardModel = new ShooterRewardModel();
+      rewardModel = new ShooterRewardModel(numTargets, height);
    }
 
-   unordered_map<size_t, int> policyCache;   
+   PolicyCache policyCache;
+
+   if(evaluateFile != "") //Just evaluate a saved model's policy
+   {
+      //(which also restores the random stream its batch was evaluated with)
+      string savedName;
+      int batch;
+      boost::uint64_t outputLength;
+      if(!loadCheckpoint(evaluateFile, savedName, batch, outputLength, uniform, model, patchRewardModel))
+      {
+	 cerr << "Could not load " << evaluateFile << " (not a checkpoint of these models)" << endl;
+	 exit(1);
+      }
+
+      outSS << ".evaluation";
+      ofstream fout(outSS.str().c_str());
+      policyCache.newGeneration();
+      double averageDiscountedReward = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, uniform, hDelay > 0 ? batch/hDelay+1 : -1);
+      cout << "Discounted Reward: " << averageDiscountedReward << endl;
+      fout << averageDiscountedReward << endl;
+      exit(0);
+   }
+
+   //If the run was stopped, carry on from its checkpoint (see saveCheckpoint)
+   int firstBatch = 0;
+   bool resumed = false;
+   string written; //The output of the batches before firstBatch
+   if(checkpointFile != "" && ifstream(checkpointFile.c_str()).good())
+   {
+      string savedName;
+      boost::uint64_t outputLength;
+      if(!loadCheckpoint(checkpointFile, savedName, firstBatch, outputLength, uniform, model, patchRewardModel) || savedName != outSS.str())
+      {
+	 cerr << "Could not resume from " << checkpointFile << " (not a checkpoint of this run)" << endl;
+	 exit(1);
+      }
+
+      ifstream previous(outSS.str().c_str(), ios::binary);
+      written.assign(outputLength, ' ');
+      if(outputLength > 0 && !previous.read(&written[0], outputLength))
+      {
+	 cerr << "Could not resume from " << checkpointFile << " (" << outSS.str() << " is missing output)" << endl;
+	 exit(1);
+      }
+      resumed = true;
+      cout << "Resuming at batch " << firstBatch << endl;
+   }
+
+   ofstream fout(outSS.str().c_str());
+   fout << written;
 
    if(daggerType >= 2) //Not really doing DAgger. Just execute one of the benchmark policies and report the results.
    {
@@ -511,7 +982,7 @@ int main(int argc, char** argv)
       {
 	 world->reset();
 	 world->takeAction(0, obs, r, endEpisode);
-	 policyCache.clear();
+	 policyCache.newGeneration();
 	 
 	 double discount = 1.0;
 	 for(int t = 0; t < 30; t++)
@@ -519,21 +990,16 @@ int main(int argc, char** argv)
 	    int action;
 	    if(daggerType == 2) //One-ply MC with perfect model
 	    {
-	       size_t hash = hash_range(obs.begin(), obs.end());
-	       action = policyCache[hash];
-	       if(!action)
+	       const BitFrame& state = world->getFrame();
+	       if(!policyCache.lookup(state, action))
 	       {
-		  action = onePlyMC(world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, obs);
-		  policyCache[hash] = action + 1;
-	       }
-	       else
-	       {
-		  action--;
+		  action = onePlyMC(world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, obs, uniform);
+		  policyCache.insert(state, action);
 	       }
 	    }
 	    else if(daggerType == 3) //Uniform random policy
 	    {
-	       action = rand()%numActions;
+	       action = randomInt(uniform, numActions);
 	    }
 	    else //Optimal policy
 	    {
@@ -543,7 +1009,7 @@ int main(int argc, char** argv)
 		  action = 3;
 	       }
 	    }
-	    int r = worldReward->getReward(action, obs);
+	    int r = worldReward->getReward(action, world->getFrame());
 	    int dummyR;
 	    bool endEpisode;
 	    world->takeAction(action, obs, dummyR, endEpisode);
@@ -563,257 +1029,49 @@ int main(int argc, char** argv)
    vector<vector<tuple<vector<vector<int> >, vector<int>, int, vector<int>, int, bool> > > dataset(rolloutDepth); //obs context, action context, nextAct, nextObs, reward, endEpisode
    vector<tuple<vector<int>, int, float, float> > rDataset; //obs, action, reward, weight
 
-   //First batch uses only exploration policy
-   cout << "Generating Samples";
-   cout.flush();
-   for(int s = 0; s < samplesPerBatch; s++)
+   vector<double> ll;
+   for(int b = firstBatch; b < numBatches; b++)
    {
-      if((s + 1)%(samplesPerBatch/10) == 0)
-      {
-	 cout << ".";
-	 cout.flush();
-      }
-
-      world->reset();
-
-      vector<vector<int> > obsContext(1);
-      vector<int> actContext(1);
-      int nextAct;
-      vector<int> nextObs;
-      int reward;
-      bool endEpisode;
-
-      //Make a context
-      world->takeAction(0, obsContext[0], reward, endEpisode);
-      actContext[0] = 0;
-
-      int t = 0;
-      while(rand()%10 < gamma)
-      {
-	 int a = explorationPolicy(world, worldReward, obsContext[0], t, rolloutsPerA, rolloutDepth, discountFactor, numActions, explorationType);
-	 world->takeAction(a, obsContext[0], reward, endEpisode);
-	 actContext[0] = a;
-	 t++;
-      }
-
-      int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
-      world->takeAction(a, nextObs, reward, endEpisode);
-      nextAct = a;
-
-      for(int m = 0; m < rolloutDepth; m++)
+      if(!resumed || b > firstBatch) //(a resumed run has already trained on its first batch)
       {
-	 dataset[m].push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false)); 
-      }
-      rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, 1));
-   }
-   
-   if(daggerType == 0) //If not hallucinating, then update everything
-   {
-      for(int m = 0; m < rolloutDepth; m++)
-      {
-	 model[m]->batchUpdate(dataset[m]);
-      }
-   }
-   else //Otherwise only update the first layer
-   {
-      model[0]->batchUpdate(dataset[0]);
-   }
-   rewardModel->batchUpdate(rDataset);
-   
-   //Evaluate the first policy
-   policyCache.clear();
-   double averageDiscountedReward = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, 1);
-   cout << "Batch 0 Average Discounted Reward: " << averageDiscountedReward << endl;
-   fout << averageDiscountedReward << endl;
-
-   //Now do the rest of the batches
-   for(int b = 1; b < numBatches; b++)
-   {
-      for(int m = 0; m < rolloutDepth; m++)
-      {
-	 dataset[m].clear();
-      }
-      rDataset.clear();
-
-      cout << "Generating Samples";
-      cout.flush();
-      for(int s = 0; s < samplesPerBatch; s++)
-      {
-	 if((s + 1)%(samplesPerBatch/10) == 0)
-	 {
-	    cout << ".";
-	    cout.flush();
-	 }
-
-	 world->reset();
 	 for(int m = 0; m < rolloutDepth; m++)
 	 {
-	    model[m]->reset();
-	 }
-	 vector<vector<int> > obsContext(1);
-	 vector<int> actContext(1);
-	 vector<int> prevObs;
-	 int nextAct;
-	 vector<int> nextObs;
-	 int dummyReward;
-	 bool endEpisode;
-	 //Make a context
-	 world->takeAction(0, obsContext[0], dummyReward, endEpisode);
-	 for(int m = 0; m < rolloutDepth; m++)
-	 {
-	    model[m]->update(0, obsContext[0], 0, false, false);
+	    dataset[m].clear();
 	 }
+	 rDataset.clear();
 
-	 actContext[0] = 0;
+	 generateSamples(b, samplesPerBatch, world, worldReward, model, rewardModel, policyCache, trial, daggerType, explorationType, rewardType, discountFactor, gamma, rolloutsPerA, rolloutDepth, numActions, hDelay, dataset, rDataset);
 
-	 //Flip a coin
-	 int r = rand();
-	 r = r%2;
-	 if(r) //If heads, use exploration policy to sample a state
+	 if(b == 0) //The first batch uses only the exploration policy
 	 {
-	    int t = 0;
-	    //(1 - gamma) probability of termination
-	    int term = rand();
-	    term = term%10;
-	    while(term < gamma)
-	    {
-	       term = rand();
-	       term = term%10;
-	       int a = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
-	       world->takeAction(a, obsContext[0], dummyReward, endEpisode);
-
-	       for(int m = 0; m < rolloutDepth; m++)
-	       {
-		  model[m]->update(a, obsContext[0], 0, false, false);
-	       }
-
-	       actContext[0] = a;
-	       t++;
-	    }
+	    //If not hallucinating, then update everything
+	    //Otherwise only update the first layer
+	    int numTrained = daggerType == 0 ? rolloutDepth : 1;
+	    model.batchUpdate(dataset, numTrained);
+	    rewardModel->batchUpdate(rDataset);
 
-	    //Flip another coin to determine what to do in the last step
-	    int coin = rand();
-	    coin = coin%2;
-	    if(coin) //If coin comes up heads: just use the exploration policy
-	    {
-	       nextAct = explorationPolicy(world, worldReward, obsContext[0], t, discountFactor, rolloutsPerA, rolloutDepth, numActions, explorationType);
-	    }
-	    else //Otherwise use exploration policy in the last step
-	    {
-	       size_t hash = hash_range(obsContext[0].begin(), obsContext[0].end());
-	       nextAct = policyCache[hash];
-	       if(!nextAct)
-	       {
-		  nextAct = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], hDelay > 0 ? b/hDelay+1 : -1);
-		  policyCache[hash] = nextAct + 1;
-	       }
-	       else
-	       {
-		  nextAct--;
-	       }
-	    }
+	    model.batchLL(dataset, ll, numTrained);
 	 }
-	 else //The first coin (r) was tails: use model policy to sample a state
+	 else
 	 {
-	    //(1 - gamma) probability of termination
-	    int term = rand();
-	    term = term%10;
-	    while(term < gamma)
-	    {
-	       term = rand();
-	       term = term%10;
-	       size_t hash = hash_range(obsContext[0].begin(), obsContext[0].end());
-	       int a = policyCache[hash];
-	       if(!a)
-	       {
-		  a = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], hDelay > 0 ? b/hDelay+1 : -1);
-		  policyCache[hash] = a + 1;
-	       }
-	       else
-	       {
-		  a--;
-	       }
-
-	       world->takeAction(a, obsContext[0], dummyReward, endEpisode);
-	       for(int m = 0; m < rolloutDepth; m++)
-	       {
-		  model[m]->update(a, obsContext[0], 0, false, false);
-	       }
-	       actContext[0] = a;
-	    }
+	    //Update all the models
+	    model.batchUpdate(dataset);
+	    rewardModel->batchUpdate(rDataset);
 
-	    size_t hash = hash_range(obsContext[0].begin(), obsContext[0].end());
-	    nextAct = policyCache[hash];
-	    if(!nextAct)
-	    {
-	       nextAct = onePlyMC(model, rewardModel, discountFactor, rolloutsPerA, rolloutDepth, obsContext[0], hDelay > 0 ? b/hDelay+1 : -1);
-	       policyCache[hash] = nextAct + 1;
-	    }
-	    else
-	    {
-	       nextAct--;
-	    }	    
+	    model.batchLL(dataset, ll);
 	 }
+	 printLL(b, ll);
 
-	 //We have now sampled a state and action -- take the action in that state
-	 world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
-	 float reward = worldReward->getReward(nextAct, obsContext[0]);
-	 
-	 vector<vector<int> > hObsContext;
-	 bool hReward;	 
-	 bool hEnd;
-	 if(daggerType == 1) //The hallucinated context starts out the same as the regular context
+	 if(checkpointFile != "")
 	 {
-	    hObsContext = obsContext;
-	 }
-	 for(int m = 0; m < rolloutDepth; m++)
-	 {
-	    if(daggerType == 0) //If not hallucinating, just use the regular context to create the data point
-	    {
-	       dataset[m].push_back(make_tuple(obsContext, actContext, nextAct, nextObs, 0, false));
-	    }
-	    else if(b >= m*hDelay) //If hallucinating and if we've seen enough batches for this depth, use the hallucinated context
-	    {
-	       dataset[m].push_back(make_tuple(hObsContext, actContext, nextAct, nextObs, 0, false));
-	    }
-
-	    if(rewardType < 2)
-	    {
-	       rDataset.push_back(make_tuple(obsContext[0], nextAct, reward, pow(discountFactor, m)));
-	    }
-	    else if(b >= m*hDelay)
-	    {
-	       rDataset.push_back(make_tuple(hObsContext[0], nextAct, reward, pow(discountFactor, m)));
-	    }
-
-	    if(daggerType == 1 && b >= (m+1)*hDelay) //If hallucinating and if seen enough batches for this depth, roll the model forward (sample and update)
-	    {
-	       model[m]->sample(nextAct, hObsContext[0], hReward, hEnd);
-	       if(m < rolloutDepth-1)
-	       {
-		  model[m+1]->update(nextAct, hObsContext[0], 0, false, false);
-	       }
-	    }
-
-	    obsContext[0] = nextObs;
-	    actContext[0] = nextAct;	       
-	    nextAct = rand();
-	    nextAct = nextAct%numActions;
-	    world->takeAction(nextAct, nextObs, dummyReward, endEpisode);
-	    reward = worldReward->getReward(nextAct, obsContext[0]);
+	    fout.flush();
+	    saveCheckpoint(checkpointFile, outSS.str(), b, fout.tellp(), uniform, model, patchRewardModel);
 	 }
       }
 
-      //Update all the models
-      for(int m = 0; m < rolloutDepth; m++)
-      {
-	 model[m]->batchUpdate(dataset[m]);
-      }
-      rewardModel->batchUpdate(rDataset);
-	 
       //Evaluate the policy for this batch
-      policyCache.clear();
-      double averageDiscountedReward = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, hDelay > 0 ? b/hDelay+1 : -1);
+      policyCache.newGeneration();
+      double averageDiscountedReward = evaluate(model, rewardModel, world, worldReward, discountFactor, rolloutsPerA, rolloutDepth, policyCache, uniform, hDelay > 0 ? b/hDelay+1 : -1);
       cout << "Batch " << b << " Discounted Reward: " << averageDiscountedReward << endl;
       fout << averageDiscountedReward << endl;
    }